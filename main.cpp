@@ -1,11 +1,18 @@
 /* katahiromz/templa --- Copy files with replacing filenames and contents.
    License: MIT */
-#include <windows.h>
+#ifdef _WIN32
+    #include <windows.h>
+#else
+    #include <clocale>
+    #include <cstdlib>
+    #include <sys/resource.h>
+#endif
 #include <string>
 #include <vector>
 #include <unordered_map>
 #include "templa.hpp"
 
+#ifdef _WIN32
 extern "C"
 int __cdecl wmain(int argc, wchar_t **argv)
 {
@@ -22,3 +29,21 @@ int main(void)
     return ret;
 }
 #endif
+#else
+int main(int argc, char **argv)
+{
+    // wide strings are printed with "%ls", which needs a multibyte locale
+    if (!setlocale(LC_CTYPE, "") || MB_CUR_MAX == 1)
+        setlocale(LC_CTYPE, "C.UTF-8");
+
+    // the parallel walk holds two descriptors for each folder with pending entries
+    struct rlimit limit;
+    if (getrlimit(RLIMIT_NOFILE, &limit) == 0 && limit.rlim_cur < limit.rlim_max)
+    {
+        limit.rlim_cur = limit.rlim_max;
+        setrlimit(RLIMIT_NOFILE, &limit);
+    }
+
+    return templa_main(argc, argv);
+}
+#endif
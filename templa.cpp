@@ -1,13 +1,73 @@
 /* katahiromz/templa --- Copy files with replacing filenames and contents.
    License: MIT */
-#include <windows.h>
-#include <shlwapi.h>
+#ifdef _WIN32
+    #include <windows.h>
+    #include <shlwapi.h>
+    #include <io.h>
+    #include <fcntl.h>
+    #include <sys/types.h>
+    #include <sys/stat.h>
+#else
+    #include <unistd.h>
+    #include <fcntl.h>
+    #include <dirent.h>
+    #include <sys/stat.h>
+    #include <sys/mman.h>
+    #include <cerrno>
+    #include <climits>
+    #include <cstdlib>
+    #include <cwctype>
+#endif
+#ifdef __linux__
+    #include <sys/ioctl.h>
+    #include <sys/sendfile.h>
+    #include <linux/fs.h>
+    #if defined(__has_include) && !defined(TEMPLA_NO_IO_URING)
+        #if __has_include(<linux/io_uring.h>)
+            #include <linux/io_uring.h>
+            #include <sys/syscall.h>
+        #endif
+    #endif
+    #if defined(IORING_FEAT_RW_CUR_POS) && defined(__NR_io_uring_setup)
+        #define TEMPLA_HAVE_IO_URING
+    #endif
+#endif
 #include <string>
 #include <vector>
+#include <deque>
+#include <memory>
+#include <atomic>
+#include <thread>
+#include <mutex>
+#include <condition_variable>
+#include <functional>
+#include <chrono>
+#include <cstdio>
+#include <cstdarg>
+#include <ctime>
+#include <cstring>
 #include <cstdint>
+#include <algorithm>
+#include <type_traits>
 #include <unordered_map>
+#include <set>
 #include "templa.hpp"
 
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+    #include <emmintrin.h>
+    #define TEMPLA_HAVE_SSE2
+#endif
+#if defined(TEMPLA_HAVE_SSE2) && (defined(__GNUC__) || defined(__clang__) || defined(_MSC_VER))
+    #include <immintrin.h>
+    #define TEMPLA_HAVE_AVX2
+    #ifdef _MSC_VER
+        #include <intrin.h>
+        #define TEMPLA_AVX2
+    #else
+        #define TEMPLA_AVX2 __attribute__((target("avx2")))
+    #endif
+#endif
+
 const char *templa_get_version(void)
 {
     return
@@ -28,8 +88,37 @@ const char *templa_get_usage(void)
         "\n"
         "Options:\n"
         "  --replace FROM TO    Replace strings in filename and file contents.\n"
+        "  --mapping-file FILE  Read replacements from FILE (a \"FROM<TAB>TO\" per line).\n"
         "  --ignore \"PATTERN\"   Ignore the wildcard patterns separated by semicolon.\n"
         "                       (default: \"q;*.bin;.git;.svn;.vs\")\n"
+        "  --force-decode       Decode UTF-8/ASCII files before replacing (slower).\n"
+        "  --jobs N             Process files in N threads (default: number of CPUs).\n"
+        "  --stream-size SIZE   Convert files of SIZE bytes or more in chunks\n"
+        "                       (K, M or G suffix; default: 32M; 0: never).\n"
+        "  --incremental        Skip files unchanged since the last run, and remove\n"
+        "                       outputs of deleted files (see .templa-manifest).\n"
+        "  --dedup              Convert identical files once, and clone or copy the\n"
+        "                       output for the others.\n"
+        "  --hardlinks          With --dedup, hard-link the outputs instead.\n"
+        "  --ordered            List everything and create the folders first, then\n"
+        "                       read the files in on-disk order (for slow disks).\n"
+        "  --pipeline SIZE      Read, convert and write in overlapping stages, with\n"
+        "                       up to SIZE bytes in flight (K, M or G suffix).\n"
+        "  --io-uring DEPTH     Read and write small files through io_uring, DEPTH\n"
+        "                       files at a time (Linux only; default: 0, off).\n"
+        "  --atomic             Write each file under a temporary name and rename it\n"
+        "                       into place, so that no output is left half-written.\n"
+        "  --sync MODE          Make the outputs durable: none (default), file (sync\n"
+        "                       each file) or batch (sync everything at the end).\n"
+        "  --tar-input FILE     Read the sources from the tar archive FILE (\"-\":\n"
+        "                       standard input); give only the destination.\n"
+        "  --tar-output FILE    Write the outputs to the tar archive FILE (\"-\":\n"
+        "                       standard output) instead of the destination.\n"
+        "  --quiet              Do not show the files as they are done.\n"
+        "  --progress           Show a progress line on stderr instead.\n"
+        "  --stats              Show counters and timings at the end (on stderr).\n"
+        "  --stats-json FILE    Write them to FILE as JSON (\"-\": standard output).\n"
+        "  --plan               Show what would be done, without doing it.\n"
         "  --help               Show this message.\n"
         "  --version            Show version information.\n"
         "\n"
@@ -48,7 +137,7 @@ static void templa_help(void)
 
 static string_t dirname(const string_t& pathname)
 {
-    size_t ich = pathname.rfind(L'\\');
+    size_t ich = pathname.rfind(TEMPLA_PATH_SEP);
     if (ich == pathname.npos)
         return L"";
     return pathname.substr(0, ich + 1);
@@ -56,659 +145,7142 @@ static string_t dirname(const string_t& pathname)
 
 static string_t basename(const string_t& pathname)
 {
-    size_t ich = pathname.rfind(L'\\');
+    size_t ich = pathname.rfind(TEMPLA_PATH_SEP);
     if (ich == pathname.npos)
         return pathname;
     return pathname.substr(ich + 1);
 }
 
-static string_t binary_to_string(UINT codepage, const binary_t& bin)
+static inline unsigned templa_ctz(uint32_t value)
 {
-    string_t ret;
-    auto cch = MultiByteToWideChar(codepage, 0, bin.data(), INT(bin.size()), NULL, 0);
-    if (cch <= 0)
-        return ret;
-
-    ret.resize(cch);
-    MultiByteToWideChar(codepage, 0, bin.data(), INT(bin.size()), &ret[0], INT(ret.size()));
-    return ret;
+#ifdef _MSC_VER
+    unsigned long index;
+    _BitScanForward(&index, value);
+    return unsigned(index);
+#else
+    return unsigned(__builtin_ctz(value));
+#endif
 }
 
-static binary_t string_to_binary(UINT codepage, const string_t& str)
-{
-    binary_t ret;
-    auto cch = WideCharToMultiByte(codepage, 0, str.data(), INT(str.size()), NULL, 0, NULL, NULL);
-    if (cch <= 0)
-        return ret;
-
-    ret.resize(cch);
-    WideCharToMultiByte(codepage, 0, str.data(), INT(str.size()), &ret[0], INT(ret.size()), NULL, NULL);
-    return ret;
-}
+// The transcoders below write into buffers sized for the worst case:
+// decoding never makes more units than there are bytes, and encoding
+// never makes more than TEMPLA_UTF*_MAX bytes per unit. ASCII (and, for
+// UTF-16, runs without surrogates) is converted 16 bytes at a time.
+#define TEMPLA_UTF8_MAX ((sizeof(wchar_t) == 2) ? 3 : 4)
+#define TEMPLA_UTF16_MAX ((sizeof(wchar_t) == 2) ? 2 : 4)
 
-bool templa_wildcard(const string_t& str, const string_t& pat, size_t istr, size_t ipat, bool ignore_case)
+static inline wchar_t *templa_put_codepoint(wchar_t *dst, uint32_t ch)
 {
-    for (;;)
+    if (sizeof(wchar_t) == 2 && ch >= 0x10000)
     {
-        if (ipat == pat.size())
-            return istr == str.size();
-
-        if (pat[ipat] == L'?')
-        {
-            if (istr == str.size())
-                return false;
-
-            ++istr;
-            ++ipat;
-            continue;
-        }
-
-        if (pat[ipat] == L'*')
-        {
-            if (templa_wildcard(str, pat, istr, ipat + 1, ignore_case))
-                return true;
-
-            if (istr == str.size())
-                return false;
-
-            ++istr;
-            continue;
-        }
-
-        if (istr == str.size())
-            return false;
-
-        wchar_t ch1 = pat[ipat], ch2 = str[istr];
-        if (ignore_case)
-        {
-            ch1 = (wchar_t)(ULONG_PTR)CharUpperW(MAKEINTRESOURCEW(ch1));
-            ch2 = (wchar_t)(ULONG_PTR)CharUpperW(MAKEINTRESOURCEW(ch2));
-        }
-        if (ch1 != ch2)
-            return false;
-
-        ++ipat;
-        ++istr;
+        ch -= 0x10000;
+        *dst++ = wchar_t(0xD800 | (ch >> 10));
+        *dst++ = wchar_t(0xDC00 | (ch & 0x3FF));
+        return dst;
     }
+    *dst++ = wchar_t(ch);
+    return dst;
 }
 
-bool templa_wildcard(const string_t& str, const string_t& pat, bool ignore_case)
-{
-    return templa_wildcard(str, pat, 0, 0, ignore_case);
-}
-
-bool templa_load_file(const string_t& filename, binary_t& data)
+#ifdef TEMPLA_HAVE_SSE2
+// Store 8 UTF-16 units as wchar_t.
+static inline void templa_widen16_sse2(wchar_t *dst, __m128i units)
 {
-    if (FILE *fp = _wfopen(filename.c_str(), L"rb"))
+    if (sizeof(wchar_t) == 2)
     {
-        fseek(fp, 0, SEEK_END);
-        size_t file_size = ftell(fp);
-        fseek(fp, 0, SEEK_SET);
-
-        data.resize(file_size);
-        bool ok = fread(&data[0], data.size(), 1, fp);
-        fclose(fp);
-
-        return ok;
+        _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), units);
+        return;
     }
-    return false;
+    const __m128i zero = _mm_setzero_si128();
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), _mm_unpacklo_epi16(units, zero));
+    _mm_storeu_si128(reinterpret_cast<__m128i*>(dst) + 1, _mm_unpackhi_epi16(units, zero));
 }
 
-bool templa_save_file(const string_t& filename, const void *ptr, size_t data_size)
+// Load 8 wchar_t as UTF-16 units. Returns false if any is above U+FFFF.
+static inline bool templa_narrow16_sse2(const wchar_t *src, __m128i& units)
 {
-    if (FILE *fp = _wfopen(filename.c_str(), L"wb"))
+    auto p = reinterpret_cast<const __m128i*>(src);
+    if (sizeof(wchar_t) == 2)
     {
-        bool ok = fwrite(ptr, data_size, 1, fp);
-        fclose(fp);
-        return ok;
+        units = _mm_loadu_si128(p);
+        return true;
     }
-    return false;
+    __m128i lo = _mm_loadu_si128(p), hi = _mm_loadu_si128(p + 1);
+    __m128i upper = _mm_or_si128(_mm_srli_epi32(lo, 16), _mm_srli_epi32(hi, 16));
+    if (_mm_movemask_epi8(_mm_cmpeq_epi32(upper, _mm_setzero_si128())) != 0xFFFF)
+        return false;
+    // packs_epi32 saturates, so pack from the signed range and back
+    const __m128i bias = _mm_set1_epi32(0x8000);
+    units = _mm_packs_epi32(_mm_sub_epi32(lo, bias), _mm_sub_epi32(hi, bias));
+    units = _mm_add_epi16(units, _mm_set1_epi16(-0x8000));
+    return true;
 }
+#endif
 
-static void swap_endian(void *ptr, size_t size)
+#ifdef TEMPLA_HAVE_SSE2
+// Store 16 bytes widened to wchar_t.
+static inline void templa_widen8_sse2(wchar_t *dst, __m128i bytes)
 {
-    auto pw = reinterpret_cast<uint16_t*>(ptr);
-    size /= sizeof(uint16_t);
-    while (size-- > 0)
-    {
-        uint16_t w = *pw;
-        w = MAKEWORD(HIBYTE(w), LOBYTE(w));
-        *pw = w;
-    }
+    const __m128i zero = _mm_setzero_si128();
+    templa_widen16_sse2(dst, _mm_unpacklo_epi8(bytes, zero));
+    templa_widen16_sse2(dst + 8, _mm_unpackhi_epi8(bytes, zero));
 }
+#endif
 
-void TEMPLA_FILE::detect_newline()
+// Decode UTF-8 into dst (size units at most). Malformed bytes become
+// U+FFFD, or U+DC80..U+DCFF if escape is true so that they survive a
+// round trip (used for POSIX filenames); ok is cleared if there are any.
+static size_t
+templa_decode_utf8(const char *ptr, size_t size, wchar_t *dst, bool escape, bool& ok)
 {
-    if (m_encoding != TE_BINARY)
+    auto p = reinterpret_cast<const uint8_t*>(ptr), end = p + size;
+    wchar_t *start = dst;
+    while (p < end)
     {
-        if (m_string.find(L"\r\n") != m_string.npos)
+        uint32_t ch = *p;
+        if (ch < 0x80)
         {
-            m_newline = TNL_CRLF;
-            return;
+#ifdef TEMPLA_HAVE_SSE2
+            if (end - p >= 16)
+            {
+                // widen all 16 bytes and keep the leading ASCII ones
+                __m128i bytes = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p));
+                unsigned ascii = templa_ctz(unsigned(_mm_movemask_epi8(bytes)) | 0x10000);
+                templa_widen8_sse2(dst, bytes);
+                dst += ascii;
+                p += ascii;
+                continue;
+            }
+#endif
+            *dst++ = wchar_t(*p++);
+            continue;
         }
 
-        if (m_string.find(L"\n") != m_string.npos)
+        size_t len = 0;
+        uint32_t lo = 0x80, hi = 0xBF;
+        if (0xC2 <= ch && ch <= 0xDF)
         {
-            m_newline = TNL_LF;
-            return;
+            len = 2;
+            ch &= 0x1F;
+        }
+        else if (0xE0 <= ch && ch <= 0xEF)
+        {
+            len = 3;
+            ch &= 0x0F;
+            if (ch == 0x0)
+                lo = 0xA0;      // overlong
+            else if (ch == 0xD)
+                hi = 0x9F;      // surrogates
+        }
+        else if (0xF0 <= ch && ch <= 0xF4)
+        {
+            len = 4;
+            ch &= 0x07;
+            if (ch == 0x0)
+                lo = 0x90;      // overlong
+            else if (ch == 0x4)
+                hi = 0x8F;      // above U+10FFFF
         }
 
-        if (m_string.find(L"\r") != m_string.npos)
+        bool valid = (len && size_t(end - p) >= len && lo <= p[1] && p[1] <= hi);
+        for (size_t i = 1; valid && i < len; ++i)
         {
-            m_newline = TNL_CR;
-            return;
+            if ((p[i] & 0xC0) != 0x80)
+                valid = false;
+            ch = (ch << 6) | (p[i] & 0x3F);
         }
-    }
 
-    m_newline = TNL_UNKNOWN;
-}
+        if (!valid)
+        {
+            ok = false;
+            *dst++ = wchar_t(escape ? (0xDC00 | *p) : 0xFFFD);
+            ++p;
+            continue;
+        }
 
-static bool binary_is_ascii(const binary_t& binary)
-{
-    for (auto byte : binary)
-    {
-        if (byte == 0)
-            return false;
-        if (byte & 0x80)
-            return false;
+        dst = templa_put_codepoint(dst, ch);
+        p += len;
     }
-    return true;
+    return size_t(dst - start);
 }
 
-static void check_nulls(const binary_t& binary, bool& bUTF16LE, bool& bUTF16BE)
+// Encode into dst (size * TEMPLA_UTF8_MAX bytes at most). Unpaired
+// surrogates become U+FFFD, unless escape is true and they are escaped
+// bytes made by templa_decode_utf8.
+static size_t
+templa_encode_utf8(const wchar_t *ptr, size_t size, char *out, bool escape)
 {
-    size_t index = 0;
-    for (auto ch : binary)
+    auto dst = reinterpret_cast<uint8_t*>(out);
+    for (size_t i = 0; i < size; ++i)
     {
-        if (ch == 0)
+        uint32_t ch = uint32_t(ptr[i]);
+        if (ch < 0x80)
         {
-            if (index & 1)
+#ifdef TEMPLA_HAVE_SSE2
+            __m128i units;
+            if (size - i >= 8 && templa_narrow16_sse2(ptr + i, units))
             {
-                bUTF16LE = true;
-                if (bUTF16BE)
-                    break;
+                // narrow all 8 units and keep the leading ASCII ones
+                __m128i ascii_units = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(-0x80)),
+                                                      _mm_setzero_si128());
+                unsigned ascii = templa_ctz(~unsigned(_mm_movemask_epi8(ascii_units))) / 2;
+                _mm_storel_epi64(reinterpret_cast<__m128i*>(dst), _mm_packus_epi16(units, units));
+                dst += ascii;
+                i += ascii - 1;
+                continue;
             }
-            else
+#endif
+            *dst++ = uint8_t(ch);
+            continue;
+        }
+
+        if (0xD800 <= ch && ch <= 0xDBFF && i + 1 < size &&
+            0xDC00 <= uint32_t(ptr[i + 1]) && uint32_t(ptr[i + 1]) <= 0xDFFF)
+        {
+            ch = 0x10000 + ((ch - 0xD800) << 10) + (uint32_t(ptr[i + 1]) - 0xDC00);
+            ++i;
+        }
+        else if (0xD800 <= ch && ch <= 0xDFFF)
+        {
+            if (escape && 0xDC80 <= ch && ch <= 0xDCFF)
             {
-                bUTF16BE = true;
-                if (bUTF16LE)
-                    break;
+                *dst++ = uint8_t(ch & 0xFF);
+                continue;
             }
+            ch = 0xFFFD;
+        }
+        else if (ch > 0x10FFFF)
+        {
+            ch = 0xFFFD;
         }
 
-        ++index;
-        if (index >= binary.size())
-            break;
+        if (ch < 0x800)
+        {
+            *dst++ = uint8_t(0xC0 | (ch >> 6));
+        }
+        else if (ch < 0x10000)
+        {
+            *dst++ = uint8_t(0xE0 | (ch >> 12));
+            *dst++ = uint8_t(0x80 | ((ch >> 6) & 0x3F));
+        }
+        else
+        {
+            *dst++ = uint8_t(0xF0 | (ch >> 18));
+            *dst++ = uint8_t(0x80 | ((ch >> 12) & 0x3F));
+            *dst++ = uint8_t(0x80 | ((ch >> 6) & 0x3F));
+        }
+        *dst++ = uint8_t(0x80 | (ch & 0x3F));
     }
+    return size_t(dst - reinterpret_cast<uint8_t*>(out));
 }
 
-void TEMPLA_FILE::detect_encoding()
+static inline uint32_t templa_get_utf16(const uint8_t *p, bool big_endian)
 {
-    if (m_binary.size() >= 3 && memcmp(m_binary.data(), "\xEF\xBB\xBF", 3) == 0)
-    {
-        m_encoding = TE_UTF8;
-        m_bom = true;
-        m_string = binary_to_string(CP_UTF8, m_binary.substr(3));
-        return;
-    }
-    else if (m_binary.size() >= 2 && memcmp(m_binary.data(), "\xFF\xFE", 2) == 0)
-    {
-        m_encoding = TE_UTF16;
-        m_bom = true;
-        m_string.assign(reinterpret_cast<const wchar_t*>(&m_binary[2]),
-                        reinterpret_cast<const wchar_t*>(&m_binary[m_binary.size()]));
-        return;
-    }
-    else if (m_binary.size() >= 2 && memcmp(m_binary.data(), "\xFE\xFF", 2) == 0)
-    {
-        m_encoding = TE_UTF16BE;
-        m_bom = true;
-        swap_endian(&m_binary[0], m_binary.size());
-        m_string.assign(reinterpret_cast<const wchar_t*>(&m_binary[2]),
-                        reinterpret_cast<const wchar_t*>(&m_binary[m_binary.size()]));
-        return;
-    }
-    else if (binary_is_ascii(m_binary))
+    return big_endian ? ((p[0] << 8) | p[1]) : (p[0] | (p[1] << 8));
+}
+
+// Decode UTF-16 into dst (size / 2 units at most). The byte swap of BE is
+// done in the same pass. Unpaired surrogates are kept as they are.
+static size_t
+templa_decode_utf16(const char *ptr, size_t size, bool big_endian, wchar_t *dst)
+{
+    auto p = reinterpret_cast<const uint8_t*>(ptr);
+    size_t count = size / 2;
+    wchar_t *start = dst;
+    for (size_t i = 0; i < count; ++i)
     {
-        m_encoding = TE_ASCII;
-        m_bom = false;
-        m_string = binary_to_string(CP_ACP, m_binary);
-        return;
+#ifdef TEMPLA_HAVE_SSE2
+        while (count - i >= 8)
+        {
+            __m128i units = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + 2 * i));
+            if (big_endian)
+                units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+            __m128i surrogates = _mm_cmpeq_epi16(_mm_and_si128(units, _mm_set1_epi16(-0x800)),
+                                                 _mm_set1_epi16(-0x2800));
+            if (_mm_movemask_epi8(surrogates))
+                break;
+            templa_widen16_sse2(dst, units);
+            dst += 8;
+            i += 8;
+        }
+        if (i == count)
+            break;
+#endif
+        uint32_t ch = templa_get_utf16(p + 2 * i, big_endian);
+        if (sizeof(wchar_t) > 2 && 0xD800 <= ch && ch <= 0xDBFF && i + 1 < count)
+        {
+            uint32_t ch2 = templa_get_utf16(p + 2 * i + 2, big_endian);
+            if (0xDC00 <= ch2 && ch2 <= 0xDFFF)
+            {
+                ch = 0x10000 + ((ch - 0xD800) << 10) + (ch2 - 0xDC00);
+                ++i;
+            }
+        }
+        *dst++ = wchar_t(ch);
     }
-    else
-    {
-        bool bUTF16LE = false, bUTF16BE = false;
-        check_nulls(m_binary, bUTF16LE, bUTF16BE);
+    return size_t(dst - start);
+}
 
-        if (bUTF16LE && bUTF16BE)
+// Encode into dst (size * TEMPLA_UTF16_MAX bytes at most).
+static size_t
+templa_encode_utf16(const wchar_t *ptr, size_t size, bool big_endian, char *out)
+{
+    auto dst = reinterpret_cast<uint8_t*>(out);
+    for (size_t i = 0; i < size; ++i)
+    {
+#ifdef TEMPLA_HAVE_SSE2
+        __m128i units;
+        while (size - i >= 8 && templa_narrow16_sse2(ptr + i, units))
         {
-            m_encoding = TE_BINARY;
-            m_string = binary_to_string(CP_ACP, m_binary);
-            return;
+            if (big_endian)
+                units = _mm_or_si128(_mm_slli_epi16(units, 8), _mm_srli_epi16(units, 8));
+            _mm_storeu_si128(reinterpret_cast<__m128i*>(dst), units);
+            dst += 16;
+            i += 8;
+        }
+        if (i == size)
+            break;
+#endif
+        uint32_t ch = uint32_t(ptr[i]);
+        uint32_t pair[2] = { ch, 0 };
+        size_t num_units = 1;
+        if (ch > 0x10FFFF)
+        {
+            pair[0] = 0xFFFD;
+        }
+        else if (ch >= 0x10000)
+        {
+            pair[0] = 0xD800 | ((ch - 0x10000) >> 10);
+            pair[1] = 0xDC00 | ((ch - 0x10000) & 0x3FF);
+            num_units = 2;
         }
-        else if ((m_binary.size() & 1) == 0)
+
+        for (size_t k = 0; k < num_units; ++k)
         {
-            auto begin = m_binary.data();
-            auto end = m_binary.data() + m_binary.size();
-            if (bUTF16LE)
+            if (big_endian)
             {
-                m_encoding = TE_UTF16;
-                m_string.assign(reinterpret_cast<const wchar_t*>(begin), reinterpret_cast<const wchar_t*>(end));
-                return;
+                *dst++ = uint8_t(pair[k] >> 8);
+                *dst++ = uint8_t(pair[k]);
             }
-            else if (bUTF16BE)
+            else
             {
-                m_encoding = TE_UTF16BE;
-                swap_endian(&m_binary[0], m_binary.size());
-                m_string.assign(reinterpret_cast<const wchar_t*>(begin), reinterpret_cast<const wchar_t*>(end));
-                return;
+                *dst++ = uint8_t(pair[k]);
+                *dst++ = uint8_t(pair[k] >> 8);
             }
         }
     }
+    return size_t(dst - reinterpret_cast<uint8_t*>(out));
+}
+
+bool utf8_to_string(const char *ptr, size_t size, string_t& ret, bool escape)
+{
+    bool ok = true;
+    ret.resize(size);
+    ret.resize(size ? templa_decode_utf8(ptr, size, &ret[0], escape, ok) : 0);
+    return ok;
+}
+
+void string_to_utf8(const wchar_t *ptr, size_t size, binary_t& ret, bool escape)
+{
+    ret.resize(size * TEMPLA_UTF8_MAX);
+    ret.resize(size ? templa_encode_utf8(ptr, size, &ret[0], escape) : 0);
+}
+
+void utf16_to_string(const char *ptr, size_t size, bool big_endian, string_t& ret)
+{
+    ret.resize(size / 2);
+    ret.resize(ret.empty() ? 0 : templa_decode_utf16(ptr, size, big_endian, &ret[0]));
+}
+
+void string_to_utf16(const wchar_t *ptr, size_t size, bool big_endian, binary_t& ret)
+{
+    ret.resize(size * TEMPLA_UTF16_MAX);
+    ret.resize(size ? templa_encode_utf16(ptr, size, big_endian, &ret[0]) : 0);
+}
+
+void utf16_to_units(const char *ptr, size_t size, bool big_endian, std::u16string& ret)
+{
+    ret.resize(size / 2);
+    auto bytes = reinterpret_cast<const uint8_t*>(ptr);
+    size_t hi = big_endian ? 0 : 1;
+    for (size_t i = 0; i < ret.size(); ++i)
+        ret[i] = char16_t((bytes[2 * i + hi] << 8) | bytes[2 * i + 1 - hi]);
+}
+
+static bool templa_is_utf16(TEMPLA_ENCODING encoding)
+{
+    return encoding == TE_UTF16 || encoding == TE_UTF16BE;
+}
 
-    bool is_utf8 = MultiByteToWideChar(CP_UTF8, MB_ERR_INVALID_CHARS, m_binary.data(), -1, NULL, 0) > 0;
-    bool is_ansi = MultiByteToWideChar(CP_ACP, MB_ERR_INVALID_CHARS, m_binary.data(), -1, NULL, 0) > 0;
+#define TEMPLA_POOL_CAP (4 << 20)   // the largest buffer a thread keeps, in bytes
+#define TEMPLA_POOL_COUNT 4         // the buffers of each kind a thread keeps
 
-    if (is_utf8 && !is_ansi)
+// The buffers of a thread that outlive the files, so that reading,
+// decoding, replacing and encoding a file does not allocate once they have
+// grown to the sizes of the files. A buffer of more than TEMPLA_POOL_CAP
+// bytes is freed when it is given back, so one huge file does not pin it.
+class TEMPLA_POOL
+{
+public:
+    static TEMPLA_POOL& local()
     {
-        m_encoding = TE_UTF8;
-        m_string = binary_to_string(CP_UTF8, m_binary);
-        return;
+        static thread_local TEMPLA_POOL s_pool;
+        return s_pool;
     }
-    else if (!is_utf8 && is_ansi)
+
+    // Swap an empty buffer with the capacity of an earlier one into str.
+    template <typename T_STRING>
+    void get(T_STRING& str)
     {
-        m_encoding = TE_ANSI;
-        m_string = binary_to_string(CP_ACP, m_binary);
-        return;
+        auto& list = buffers(str);
+        if (!list.empty())
+        {
+            str.swap(list.back());
+            list.pop_back();
+        }
+        str.clear();
     }
 
-    auto utf8 = binary_to_string(CP_UTF8, m_binary);
-    if (string_to_binary(CP_UTF8, utf8) == m_binary)
+    template <typename T_STRING>
+    void put(T_STRING& str)
     {
-        m_encoding = TE_UTF8;
-        m_string = std::move(utf8);
-        return;
+        auto& list = buffers(str);
+        if (str.capacity() * sizeof(str[0]) > TEMPLA_POOL_CAP)
+            T_STRING().swap(str);
+        else if (list.size() < TEMPLA_POOL_COUNT && str.capacity() > T_STRING().capacity())
+            list.push_back(std::move(str));
     }
 
-    auto ansi = binary_to_string(CP_ACP, m_binary);
-    if (string_to_binary(CP_ACP, ansi) == m_binary)
+protected:
+    std::vector<binary_t> m_binaries;
+    std::vector<string_t> m_strings;
+    std::vector<std::u16string> m_strings16;
+
+    TEMPLA_POOL()
     {
-        m_encoding = TE_ANSI;
-        m_string = std::move(ansi);
-        return;
+        m_binaries.reserve(TEMPLA_POOL_COUNT);
+        m_strings.reserve(TEMPLA_POOL_COUNT);
+        m_strings16.reserve(TEMPLA_POOL_COUNT);
     }
 
-    m_encoding = TE_BINARY;
-    m_string = std::move(utf8);
-}
+    std::vector<binary_t>& buffers(const binary_t&) { return m_binaries; }
+    std::vector<string_t>& buffers(const string_t&) { return m_strings; }
+    std::vector<std::u16string>& buffers(const std::u16string&) { return m_strings16; }
+};
 
-bool TEMPLA_FILE::load(const string_t& filename)
+// A buffer from the pool of the thread, given back at the end of its scope.
+template <typename T_STRING>
+struct TEMPLA_POOLED
 {
-    if (!templa_load_file(filename, m_binary))
-        return false;
+    T_STRING m_str;
 
-    detect_encoding();
-    detect_newline();
-    return true;
-}
+    TEMPLA_POOLED() { TEMPLA_POOL::local().get(m_str); }
+    TEMPLA_POOLED(const TEMPLA_POOLED&) = delete;
+    TEMPLA_POOLED& operator=(const TEMPLA_POOLED&) = delete;
+    ~TEMPLA_POOLED() { TEMPLA_POOL::local().put(m_str); }
+};
 
-bool TEMPLA_FILE::save(const string_t& filename)
+#ifdef _WIN32
+static void binary_to_string(UINT codepage, const char *ptr, size_t size, string_t& ret)
 {
-    if (m_encoding != TE_BINARY)
-    {
-        switch (m_newline)
-        {
-        case TNL_CRLF:
-            str_replace(m_string, L"\r\n", L"\n");
-            str_replace(m_string, L"\n", L"\r\n");
-            break;
-
-        case TNL_LF:
-            str_replace(m_string, L"\r\n", L"\n");
-            str_replace(m_string, L"\r", L"\n");
-            break;
-
-        case TNL_CR:
-            str_replace(m_string, L"\r\n", L"\r");
-            str_replace(m_string, L"\n", L"\r");
-            break;
+    // one call into a buffer of the largest size: a byte makes one unit at most
+    ret.resize(size);
+    auto cch = size ? MultiByteToWideChar(codepage, 0, ptr, INT(size), &ret[0], INT(size)) : 0;
+    ret.resize((cch > 0) ? cch : 0);
+}
 
-        case TNL_UNKNOWN:
-            break;
-        }
-    }
+static void string_to_binary(UINT codepage, const string_t& str, binary_t& ret)
+{
+    ret.resize(str.size() * 4);
+    auto cch = str.size() ? WideCharToMultiByte(codepage, 0, str.data(), INT(str.size()),
+                                                &ret[0], INT(ret.size()), NULL, NULL) : 0;
+    ret.resize((cch > 0) ? cch : 0);
+}
+#endif
 
-    switch (m_encoding)
+// On POSIX there is no system "ANSI" code page; ISO-8859-1 is used instead
+// so that any byte sequence that is not UTF-8 still round-trips. ret keeps
+// its capacity.
+static void
+binary_to_string(TEMPLA_ENCODING encoding, const char *ptr, size_t size, string_t& ret)
+{
+    switch (encoding)
     {
-    case TE_BINARY:
+    case TE_UTF16:
+        utf16_to_string(ptr, size, false, ret);
         break;
 
-    case TE_UTF8:
-        m_binary = string_to_binary(CP_UTF8, m_string);
+    case TE_UTF16BE:
+        utf16_to_string(ptr, size, true, ret);
         break;
 
-    case TE_UTF16:
-        m_binary.assign(reinterpret_cast<const uint8_t*>(m_string.data()), reinterpret_cast<const uint8_t*>(&m_string[m_string.size()]));
+    case TE_UTF8:
+        utf8_to_string(ptr, size, ret);
         break;
 
-    case TE_UTF16BE:
-        m_binary.assign(reinterpret_cast<const uint8_t*>(m_string.data()), reinterpret_cast<const uint8_t*>(&m_string[m_string.size()]));
-        swap_endian(&m_binary[0], m_binary.size());
+#ifdef _WIN32
+    case TE_BINARY:
+    case TE_ANSI:
+    case TE_ASCII:
+        binary_to_string(CP_ACP, ptr, size, ret);
         break;
-
+#else
+    case TE_BINARY:
     case TE_ANSI:
     case TE_ASCII:
-        m_binary = string_to_binary(CP_ACP, m_string);
+        ret.resize(size);   // assign() of a range would make a temporary
+        for (size_t i = 0; i < size; ++i)
+            ret[i] = uint8_t(ptr[i]);
         break;
+#endif
     }
+}
 
-    if (m_bom)
-    {
-        switch (m_encoding)
-        {
-        case TE_UTF8:
-            m_binary.insert(0, "\xEF\xBB\xBF", 3);
-            break;
-
-        case TE_UTF16:
-            m_binary.insert(0, "\xFF\xFE", 2);
-            break;
-
-        case TE_UTF16BE:
-            m_binary.insert(0, "\xFE\xFF", 2);
-            break;
-
-        default:
-            break;
-        }
-    }
+#ifndef _WIN32
+static std::string string_to_native(const string_t& str)
+{
+    std::string ret;
+    string_to_utf8(str.data(), str.size(), ret, true);
+    return ret;
+}
 
-    return templa_save_file(filename, m_binary.data(), m_binary.size());
+static string_t native_to_string(const char *str)
+{
+    string_t ret;
+    utf8_to_string(str, strlen(str), ret, true);
+    return ret;
 }
+#endif
 
-static TEMPLA_RET
-templa_file(string_t& file1, string_t& file2, const mapping_t& mapping,
-            const string_list_t& ignore, templa_canceler_t canceler)
+static wchar_t templa_char_upper(wchar_t ch)
 {
-    if (canceler && canceler())
-        return TEMPLA_RET_CANCELED;
+#ifdef _WIN32
+    return (wchar_t)(ULONG_PTR)CharUpperW(MAKEINTRESOURCEW(ch));
+#else
+    return wchar_t(towupper(ch));
+#endif
+}
 
-    auto basename1 = basename(file1);
-    for (auto& ignore_item : ignore)
+static int templa_lstrcmpi(const wchar_t *str1, const wchar_t *str2)
+{
+#ifdef _WIN32
+    return lstrcmpiW(str1, str2);
+#else
+    for (;; ++str1, ++str2)
     {
-        if (templa_wildcard(basename1, ignore_item))
-        {
-            printf("%ls [ignored]\n", file1.c_str());
-            return TEMPLA_RET_OK;
-        }
+        wchar_t ch1 = templa_char_upper(*str1), ch2 = templa_char_upper(*str2);
+        if (ch1 != ch2)
+            return (ch1 < ch2) ? -1 : 1;
+        if (!ch1)
+            return 0;
     }
+#endif
+}
 
-    TEMPLA_FILE file;
-    if (!file.load(file1))
+bool templa_wildcard(const string_t& str, const string_t& pat, size_t istr, size_t ipat, bool ignore_case)
+{
+    for (;;)
     {
-        fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
-        return TEMPLA_RET_READERROR;
-    }
+        if (ipat == pat.size())
+            return istr == str.size();
 
-    if (file.m_encoding != TE_BINARY)
-    {
-        for (auto& pair : mapping)
+        if (pat[ipat] == L'?')
         {
-            str_replace(file.m_string, pair.first, pair.second);
-        }
-    }
+            if (istr == str.size())
+                return false;
+
+            ++istr;
+            ++ipat;
+            continue;
+        }
+
+        if (pat[ipat] == L'*')
+        {
+            if (templa_wildcard(str, pat, istr, ipat + 1, ignore_case))
+                return true;
+
+            if (istr == str.size())
+                return false;
+
+            ++istr;
+            continue;
+        }
+
+        if (istr == str.size())
+            return false;
+
+        wchar_t ch1 = pat[ipat], ch2 = str[istr];
+        if (ignore_case)
+        {
+            ch1 = templa_char_upper(ch1);
+            ch2 = templa_char_upper(ch2);
+        }
+        if (ch1 != ch2)
+            return false;
+
+        ++ipat;
+        ++istr;
+    }
+}
+
+bool templa_wildcard(const string_t& str, const string_t& pat, bool ignore_case)
+{
+    return templa_wildcard(str, pat, 0, 0, ignore_case);
+}
+
+static string_t templa_upper(const string_t& str)
+{
+    string_t ret = str;
+    for (auto& ch : ret)
+        ch = templa_char_upper(ch);
+    return ret;
+}
+
+void TEMPLA_GLOBSET::TRIE::add(const wchar_t *ptr, size_t size, bool reverse)
+{
+    uint32_t node = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        wchar_t ch = ptr[reverse ? size - 1 - i : i];
+        auto it = m_next[node].find(ch);
+        if (it != m_next[node].end())
+        {
+            node = it->second;
+            continue;
+        }
+
+        uint32_t child = uint32_t(m_next.size());
+        m_next[node][ch] = child;
+        m_next.emplace_back();
+        m_end.push_back(false);
+        node = child;
+    }
+    m_end[node] = true;
+}
+
+// Whether a key is a prefix (or with reverse, a suffix) of the string,
+// ignoring its case.
+bool TEMPLA_GLOBSET::TRIE::match(const wchar_t *ptr, size_t size, bool reverse) const
+{
+    uint32_t node = 0;
+    for (size_t i = 0; !m_end[node]; ++i)
+    {
+        if (i == size)
+            return false;
+
+        auto it = m_next[node].find(templa_char_upper(ptr[reverse ? size - 1 - i : i]));
+        if (it == m_next[node].end())
+            return false;
+        node = it->second;
+    }
+    return true;
+}
+
+TEMPLA_GLOBSET::TEMPLA_GLOBSET(const string_list_t& patterns)
+{
+    for (auto& pattern : patterns)
+        add(pattern);
+}
+
+void TEMPLA_GLOBSET::add(const string_t& pattern)
+{
+    string_t pat = templa_upper(pattern);
+    m_empty = false;
+
+    if (pat.find_first_of(L"*?") == pat.npos)
+    {
+        auto it = std::lower_bound(m_literals.begin(), m_literals.end(), pat);
+        if (it == m_literals.end() || *it != pat)
+            m_literals.insert(it, pat);
+        return;
+    }
+
+    if (pat.find(L'?') == pat.npos)
+    {
+        size_t first = pat.find_first_not_of(L'*');
+        if (first == pat.npos)
+        {
+            m_prefixes.add(L"", 0, false);  // matches anything
+            return;
+        }
+
+        size_t last = pat.find_last_not_of(L'*');
+        size_t star = pat.find(L'*', first);
+        if (first == 0 && star == last + 1)
+        {
+            m_prefixes.add(pat.data(), last + 1, false);
+            return;
+        }
+        if (first > 0 && star == pat.npos)
+        {
+            m_suffixes.add(pat.data() + first, pat.size() - first, true);
+            return;
+        }
+    }
+
+    add_automaton(pat);
+}
+
+void TEMPLA_GLOBSET::add_automaton(const string_t& pat)
+{
+    size_t base = m_bits;
+    m_bits += std::count_if(pat.begin(), pat.end(), [](wchar_t ch) { return ch != L'*'; }) + 1;
+
+    size_t words = (m_bits + 63) / 64;
+    m_start.resize(words);
+    m_final.resize(words);
+    m_stay.resize(words);
+    if (m_tokens.empty())
+        m_tokens.resize(1);
+    for (auto& tokens : m_tokens)
+        tokens.resize(words);
+
+    size_t bit = base;
+    m_start[bit / 64] |= uint64_t(1) << (bit % 64);
+    for (auto ch : pat)
+    {
+        uint64_t flag = uint64_t(1) << (bit % 64);
+        if (ch == L'*')
+        {
+            m_stay[bit / 64] |= flag;
+            continue;
+        }
+
+        if (ch == L'?')
+        {
+            for (auto& tokens : m_tokens)
+                tokens[bit / 64] |= flag;
+        }
+        else
+        {
+            uint32_t& cls = (uint32_t(ch) < 128) ? m_ascii[ch] : m_classes[ch];
+            if (!cls)
+            {
+                // a new class starts with the '?' of class 0
+                cls = uint32_t(m_tokens.size());
+                m_tokens.push_back(m_tokens[0]);
+            }
+            m_tokens[cls][bit / 64] |= flag;
+        }
+        ++bit;
+    }
+    m_final[bit / 64] |= uint64_t(1) << (bit % 64);
+}
+
+// Compare upper with str in upper case, without a copy of it.
+static int templa_compare_upper(const string_t& upper, const string_t& str)
+{
+    size_t size = std::min(upper.size(), str.size());
+    for (size_t i = 0; i < size; ++i)
+    {
+        wchar_t ch = templa_char_upper(str[i]);
+        if (upper[i] != ch)
+            return (upper[i] < ch) ? -1 : 1;
+    }
+    return (upper.size() < str.size()) ? -1 : (upper.size() > str.size());
+}
+
+// The case of str is folded as it is read; nothing is allocated once the
+// state of the thread has grown to m_start.
+bool TEMPLA_GLOBSET::match(const string_t& str) const
+{
+    if (m_empty)
+        return false;
+
+    auto it = std::lower_bound(m_literals.begin(), m_literals.end(), str,
+        [](const string_t& literal, const string_t& name) {
+            return templa_compare_upper(literal, name) < 0;
+        });
+    if (it != m_literals.end() && templa_compare_upper(*it, str) == 0)
+        return true;
+    if (m_prefixes.match(str.data(), str.size(), false) ||
+        m_suffixes.match(str.data(), str.size(), true))
+    {
+        return true;
+    }
+    if (!m_bits)
+        return false;
+
+    static thread_local std::vector<uint64_t> s_state;
+    std::vector<uint64_t>& state = s_state;
+    state.assign(m_start.begin(), m_start.end());
+    for (auto ch : str)
+    {
+        ch = templa_char_upper(ch);
+        uint32_t cls = 0;
+        if (uint32_t(ch) < 128)
+        {
+            cls = m_ascii[ch];
+        }
+        else
+        {
+            auto it = m_classes.find(ch);
+            if (it != m_classes.end())
+                cls = it->second;
+        }
+
+        const std::vector<uint64_t>& tokens = m_tokens[cls];
+        uint64_t carry = 0, alive = 0;
+        for (size_t i = 0; i < state.size(); ++i)
+        {
+            uint64_t moved = state[i] & tokens[i];
+            state[i] = (moved << 1) | carry | (state[i] & m_stay[i]);
+            carry = moved >> 63;
+            alive |= state[i];
+        }
+        if (!alive)
+            return false;
+    }
+
+    for (size_t i = 0; i < state.size(); ++i)
+    {
+        if (state[i] & m_final[i])
+            return true;
+    }
+    return false;
+}
+
+template <typename T_CHAR>
+static inline uint32_t templa_char_unit(T_CHAR ch)
+{
+    return uint32_t(typename std::make_unsigned<T_CHAR>::type(ch));
+}
+
+#ifdef TEMPLA_HAVE_AVX2
+static bool templa_has_avx2(void)
+{
+#ifdef _MSC_VER
+    static const bool s_avx2 = []() {
+        int regs[4];
+        __cpuid(regs, 1);
+        if (!(regs[2] & (1 << 27)) || (_xgetbv(0) & 6) != 6)
+            return false;
+        __cpuidex(regs, 7, 0);
+        return (regs[1] & (1 << 5)) != 0;
+    }();
+#else
+    static const bool s_avx2 = __builtin_cpu_supports("avx2");
+#endif
+    return s_avx2;
+}
+#endif
+
+template <typename T_CHAR>
+static inline bool
+str_match_middle(const T_CHAR *ptr, const T_CHAR *from, size_t from_size)
+{
+    if (from_size <= 2)
+        return true;
+    return memcmp(ptr + 1, from + 1, (from_size - 2) * sizeof(T_CHAR)) == 0;
+}
+
+// Scan [i, size) one code unit at a time; next is the first position where
+// a match may start without overlapping the previous one.
+template <typename T_CHAR>
+static void
+str_find_scalar(const T_CHAR *ptr, size_t size, size_t i, size_t next,
+                const T_CHAR *from, size_t from_size, std::vector<size_t>& hits)
+{
+    T_CHAR first = from[0], last = from[from_size - 1];
+    for (; i + from_size <= size; ++i)
+    {
+        if (i < next || ptr[i] != first || ptr[i + from_size - 1] != last)
+            continue;
+        if (!str_match_middle(ptr + i, from, from_size))
+            continue;
+        hits.push_back(i);
+        next = i + from_size;
+    }
+}
+
+#ifdef TEMPLA_HAVE_SSE2
+template <size_t N> struct TEMPLA_SSE2_UNIT;
+template <> struct TEMPLA_SSE2_UNIT<1>
+{
+    static __m128i set1(uint32_t v) { return _mm_set1_epi8(char(v)); }
+    static __m128i cmpeq(__m128i a, __m128i b) { return _mm_cmpeq_epi8(a, b); }
+};
+template <> struct TEMPLA_SSE2_UNIT<2>
+{
+    static __m128i set1(uint32_t v) { return _mm_set1_epi16(short(v)); }
+    static __m128i cmpeq(__m128i a, __m128i b) { return _mm_cmpeq_epi16(a, b); }
+};
+template <> struct TEMPLA_SSE2_UNIT<4>
+{
+    static __m128i set1(uint32_t v) { return _mm_set1_epi32(int(v)); }
+    static __m128i cmpeq(__m128i a, __m128i b) { return _mm_cmpeq_epi32(a, b); }
+};
+
+// Compare the first and the last code unit of FROM at 16 bytes of
+// positions at once, then verify the candidates.
+template <typename T_CHAR>
+static void
+str_find_sse2(const T_CHAR *ptr, size_t size, const T_CHAR *from, size_t from_size,
+              std::vector<size_t>& hits)
+{
+    typedef TEMPLA_SSE2_UNIT<sizeof(T_CHAR)> unit;
+    const size_t lanes = 16 / sizeof(T_CHAR);
+    const uint32_t unit_bits = (1u << sizeof(T_CHAR)) - 1;
+
+    __m128i first = unit::set1(templa_char_unit(from[0]));
+    __m128i last = unit::set1(templa_char_unit(from[from_size - 1]));
+
+    size_t i = 0, next = 0;
+    for (; i + from_size - 1 + lanes <= size; i += lanes)
+    {
+        __m128i block1 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i));
+        __m128i block2 = _mm_loadu_si128(reinterpret_cast<const __m128i*>(ptr + i + from_size - 1));
+        __m128i eq = _mm_and_si128(unit::cmpeq(block1, first), unit::cmpeq(block2, last));
+        uint32_t mask = uint32_t(_mm_movemask_epi8(eq));
+        while (mask)
+        {
+            unsigned bit = templa_ctz(mask);
+            mask &= ~(unit_bits << bit);
+
+            size_t pos = i + bit / sizeof(T_CHAR);
+            if (pos < next || !str_match_middle(ptr + pos, from, from_size))
+                continue;
+            hits.push_back(pos);
+            next = pos + from_size;
+        }
+    }
+
+    str_find_scalar(ptr, size, i, next, from, from_size, hits);
+}
+#endif
+
+#ifdef TEMPLA_HAVE_AVX2
+template <size_t N> struct TEMPLA_AVX2_UNIT;
+template <> struct TEMPLA_AVX2_UNIT<1>
+{
+    TEMPLA_AVX2 static __m256i set1(uint32_t v) { return _mm256_set1_epi8(char(v)); }
+    TEMPLA_AVX2 static __m256i cmpeq(__m256i a, __m256i b) { return _mm256_cmpeq_epi8(a, b); }
+};
+template <> struct TEMPLA_AVX2_UNIT<2>
+{
+    TEMPLA_AVX2 static __m256i set1(uint32_t v) { return _mm256_set1_epi16(short(v)); }
+    TEMPLA_AVX2 static __m256i cmpeq(__m256i a, __m256i b) { return _mm256_cmpeq_epi16(a, b); }
+};
+template <> struct TEMPLA_AVX2_UNIT<4>
+{
+    TEMPLA_AVX2 static __m256i set1(uint32_t v) { return _mm256_set1_epi32(int(v)); }
+    TEMPLA_AVX2 static __m256i cmpeq(__m256i a, __m256i b) { return _mm256_cmpeq_epi32(a, b); }
+};
+
+template <typename T_CHAR>
+TEMPLA_AVX2 static void
+str_find_avx2(const T_CHAR *ptr, size_t size, const T_CHAR *from, size_t from_size,
+              std::vector<size_t>& hits)
+{
+    typedef TEMPLA_AVX2_UNIT<sizeof(T_CHAR)> unit;
+    const size_t lanes = 32 / sizeof(T_CHAR);
+    const uint32_t unit_bits = (1u << sizeof(T_CHAR)) - 1;
+
+    __m256i first = unit::set1(templa_char_unit(from[0]));
+    __m256i last = unit::set1(templa_char_unit(from[from_size - 1]));
+
+    size_t i = 0, next = 0;
+    for (; i + from_size - 1 + lanes <= size; i += lanes)
+    {
+        __m256i block1 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i));
+        __m256i block2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(ptr + i + from_size - 1));
+        __m256i eq = _mm256_and_si256(unit::cmpeq(block1, first), unit::cmpeq(block2, last));
+        uint32_t mask = uint32_t(_mm256_movemask_epi8(eq));
+        while (mask)
+        {
+            unsigned bit = templa_ctz(mask);
+            mask &= ~(unit_bits << bit);
+
+            size_t pos = i + bit / sizeof(T_CHAR);
+            if (pos < next || !str_match_middle(ptr + pos, from, from_size))
+                continue;
+            hits.push_back(pos);
+            next = pos + from_size;
+        }
+    }
+
+    str_find_scalar(ptr, size, i, next, from, from_size, hits);
+}
+#endif
+
+static std::atomic<TEMPLA_SIMD> s_templa_simd(TSIMD_AUTO);
+
+TEMPLA_SIMD templa_set_simd(TEMPLA_SIMD simd)
+{
+    return s_templa_simd.exchange(simd);
+}
+
+// Find the non-overlapping occurrences of FROM, from left to right.
+template <typename T_CHAR>
+static void
+str_find_all(const T_CHAR *ptr, size_t size, const T_CHAR *from, size_t from_size,
+             std::vector<size_t>& hits)
+{
+    hits.clear();
+    if (!from_size || size < from_size)
+        return;
+
+    TEMPLA_SIMD simd = s_templa_simd.load(std::memory_order_relaxed);
+#ifdef TEMPLA_HAVE_AVX2
+    if ((simd == TSIMD_AUTO || simd == TSIMD_AVX2) && templa_has_avx2())
+    {
+        str_find_avx2(ptr, size, from, from_size, hits);
+        return;
+    }
+#endif
+#ifdef TEMPLA_HAVE_SSE2
+    if (simd != TSIMD_SCALAR)
+    {
+        str_find_sse2(ptr, size, from, from_size, hits);
+        return;
+    }
+#endif
+    (void)simd;
+    str_find_scalar(ptr, size, 0, 0, from, from_size, hits);
+}
+
+template <typename T_CHAR>
+size_t str_replace(std::basic_string<T_CHAR>& data, const T_CHAR *from, size_t from_size,
+                   const T_CHAR *to, size_t to_size)
+{
+    std::vector<size_t> hits;
+    str_find_all(data.data(), data.size(), from, from_size, hits);
+    if (hits.empty())
+        return 0;
+
+    if (from_size == to_size)
+    {
+        for (auto pos : hits)
+            std::copy(to, to + to_size, &data[pos]);
+        return hits.size();
+    }
+
+    std::basic_string<T_CHAR> ret;
+    ret.reserve(data.size() - hits.size() * from_size + hits.size() * to_size);
+
+    size_t copied = 0;
+    for (auto pos : hits)
+    {
+        ret.append(data, copied, pos - copied);
+        ret.append(to, to_size);
+        copied = pos + from_size;
+    }
+    ret.append(data, copied, data.npos);
+
+    data.swap(ret);
+    return hits.size();
+}
+
+template size_t str_replace(std::string&, const char *, size_t, const char *, size_t);
+template size_t str_replace(std::wstring&, const wchar_t *, size_t, const wchar_t *, size_t);
+template size_t str_replace(std::u16string&, const char16_t *, size_t, const char16_t *, size_t);
+template size_t str_replace(std::u32string&, const char32_t *, size_t, const char32_t *, size_t);
+
+template <typename T_CHAR>
+void TEMPLA_MATCHER<T_CHAR>::add(const string_type& from, const string_type& to, uint32_t key)
+{
+    if (from.empty())
+        return;
+
+    if (m_trie.empty())
+    {
+        m_nodes.resize(1);
+        m_trie.resize(1);
+    }
+
+    uint32_t state = 0;
+    for (auto ch : from)
+    {
+        auto it = m_trie[state].find(ch);
+        if (it != m_trie[state].end())
+        {
+            state = it->second;
+            continue;
+        }
+
+        uint32_t node = uint32_t(m_nodes.size());
+        m_trie[state][ch] = node;
+        m_nodes.push_back(NODE());
+        m_nodes[node].depth = m_nodes[state].depth + 1;
+        m_trie.resize(m_nodes.size());
+        state = node;
+    }
+
+    if (m_nodes[state].terminal)
+    {
+        m_to[m_nodes[state].value] = to;
+        m_keys[m_nodes[state].value] = key;
+        return;
+    }
+
+    m_nodes[state].terminal = true;
+    m_nodes[state].value = uint32_t(m_to.size());
+    m_to.push_back(to);
+    m_keys.push_back(key);
+
+    if (m_max_length < from.size())
+        m_max_length = from.size();
+}
+
+template <typename T_CHAR>
+void TEMPLA_MATCHER<T_CHAR>::compile()
+{
+    if (m_trie.empty())
+        return;
+
+    // flatten the children into sorted edge ranges
+    m_edges.clear();
+    for (size_t i = 0; i < m_nodes.size(); ++i)
+    {
+        m_nodes[i].first_edge = uint32_t(m_edges.size());
+        m_nodes[i].num_edges = uint32_t(m_trie[i].size());
+        for (auto& pair : m_trie[i])
+            m_edges.push_back(pair);
+    }
+
+    for (auto& entry : m_root)
+        entry = 0;
+    for (auto& pair : m_trie[0])
+    {
+        uint32_t unit = templa_char_unit(pair.first);
+        if (unit < 256)
+            m_root[unit] = pair.second;
+    }
+
+    // breadth-first, so that the failure target is always done first
+    std::vector<uint32_t> queue;
+    for (auto& pair : m_trie[0])
+        queue.push_back(pair.second);
+
+    for (size_t iqueue = 0; iqueue < queue.size(); ++iqueue)
+    {
+        uint32_t node = queue[iqueue];
+        NODE& info = m_nodes[node];
+        info.output = info.terminal ? node : m_nodes[info.fail].output;
+
+        for (auto& pair : m_trie[node])
+        {
+            uint32_t child = pair.second;
+            uint32_t state = info.fail;
+            uint32_t target;
+            for (;;)
+            {
+                target = find_edge(state, pair.first);
+                if (target || state == 0)
+                    break;
+                state = m_nodes[state].fail;
+            }
+            m_nodes[child].fail = target;
+            queue.push_back(child);
+        }
+    }
+
+    m_trie.clear();
+}
+
+template <typename T_CHAR>
+uint32_t TEMPLA_MATCHER<T_CHAR>::find_edge(uint32_t state, T_CHAR ch) const
+{
+    const NODE& node = m_nodes[state];
+    auto begin = m_edges.begin() + node.first_edge;
+    auto end = begin + node.num_edges;
+    if (node.num_edges <= 8)
+    {
+        for (; begin != end; ++begin)
+        {
+            if (begin->first == ch)
+                return begin->second;
+        }
+        return 0;
+    }
+
+    auto it = std::lower_bound(begin, end, ch,
+        [](const std::pair<T_CHAR, uint32_t>& edge, T_CHAR value) {
+            return edge.first < value;
+        });
+    if (it != end && it->first == ch)
+        return it->second;
+    return 0;
+}
+
+template <typename T_CHAR>
+inline uint32_t TEMPLA_MATCHER<T_CHAR>::next(uint32_t state, T_CHAR ch) const
+{
+    for (;;)
+    {
+        if (state == 0)
+        {
+            uint32_t unit = templa_char_unit(ch);
+            if (unit < 256)
+                return m_root[unit];
+            return find_edge(0, ch);
+        }
+
+        uint32_t target = find_edge(state, ch);
+        if (target)
+            return target;
+
+        state = m_nodes[state].fail;
+    }
+}
+
+template <typename T_CHAR>
+size_t TEMPLA_MATCHER<T_CHAR>::replace(const T_CHAR *ptr, size_t size, string_type& ret,
+                                       uint64_t *counts) const
+{
+    if (m_nodes.size() <= 1)
+        return 0;
+
+    size_t count = 0, copied = 0, i = 0;
+    size_t start = 0, length = 0;
+    uint32_t value = 0, state = 0;
+    bool pending = false;
+    for (;;)
+    {
+        if (i < size)
+        {
+            state = next(state, ptr[i]);
+            ++i;
+
+            const NODE& node = m_nodes[state];
+            if (node.output)
+            {
+                const NODE& found = m_nodes[node.output];
+                size_t found_start = i - found.depth;
+                if (!pending || found_start < start ||
+                    (found_start == start && found.depth > length))
+                {
+                    pending = true;
+                    start = found_start;
+                    length = found.depth;
+                    value = found.value;
+                }
+            }
+
+            // Any match still to come starts at or after i - node.depth.
+            if (!pending || i - node.depth <= start)
+                continue;
+        }
+        else if (!pending)
+        {
+            break;
+        }
+
+        if (!count)
+        {
+            ret.clear();
+            ret.reserve(size);
+        }
+        ret.append(ptr + copied, start - copied);
+        ret += m_to[value];
+        ++count;
+        if (counts)
+            ++counts[m_keys[value]];
+
+        copied = i = start + length;
+        state = 0;
+        pending = false;
+    }
+
+    if (count)
+        ret.append(ptr + copied, size - copied);
+
+    return count;
+}
+
+template <typename T_CHAR>
+size_t TEMPLA_MATCHER<T_CHAR>::replace_stream(const T_CHAR *ptr, size_t size, size_t limit,
+                                              string_type& ret, uint64_t *counts) const
+{
+    if (m_nodes.size() <= 1)
+    {
+        ret.append(ptr, size);
+        return size;
+    }
+
+    size_t copied = 0, i = 0;
+    size_t start = 0, length = 0;
+    uint32_t value = 0, state = 0;
+    bool pending = false;
+    for (;;)
+    {
+        if (i < size)
+        {
+            state = next(state, ptr[i]);
+            ++i;
+
+            const NODE& node = m_nodes[state];
+            if (node.output)
+            {
+                const NODE& found = m_nodes[node.output];
+                size_t found_start = i - found.depth;
+                if (!pending || found_start < start ||
+                    (found_start == start && found.depth > length))
+                {
+                    pending = true;
+                    start = found_start;
+                    length = found.depth;
+                    value = found.value;
+                }
+            }
+
+            // Matches still to come start at or after i - node.depth.
+            if (!pending && i - node.depth >= limit)
+                break;
+            if (!pending || i - node.depth <= start)
+                continue;
+        }
+        else if (!pending)
+        {
+            break;
+        }
+
+        if (start >= limit)
+            break;
+
+        ret.append(ptr + copied, start - copied);
+        ret += m_to[value];
+        if (counts)
+            ++counts[m_keys[value]];
+
+        copied = i = start + length;
+        state = 0;
+        pending = false;
+    }
+
+    size_t consumed = std::max(copied, std::min(limit, size));
+    ret.append(ptr + copied, consumed - copied);
+    return consumed;
+}
+
+template <typename T_CHAR>
+size_t TEMPLA_MATCHER<T_CHAR>::replace(string_type& str, uint64_t *counts) const
+{
+    TEMPLA_POOLED<string_type> ret;
+    size_t count = replace(str.data(), str.size(), ret.m_str, counts);
+    if (count)
+        str.swap(ret.m_str);
+    return count;
+}
+
+template struct TEMPLA_MATCHER<char>;
+template struct TEMPLA_MATCHER<wchar_t>;
+template struct TEMPLA_MATCHER<char16_t>;
+
+// The matches of each key are counted by its index in mapping.
+void templa_compile_mapping(templa_matcher_t& matcher, const mapping_t& mapping)
+{
+    uint32_t key = 0;
+    for (auto& pair : mapping)
+    {
+        matcher.add(pair.first, pair.second, key++);
+    }
+    matcher.compile();
+}
+
+void templa_compile_mapping(TEMPLA_MATCHER<char>& matcher, const mapping_t& mapping)
+{
+    binary_t from, to;
+    uint32_t key = 0;
+    for (auto& pair : mapping)
+    {
+        string_to_utf8(pair.first.data(), pair.first.size(), from);
+        string_to_utf8(pair.second.data(), pair.second.size(), to);
+        matcher.add(from, to, key++);
+    }
+    matcher.compile();
+}
+
+void templa_compile_mapping(TEMPLA_MATCHER<char16_t>& matcher, const mapping_t& mapping)
+{
+    binary_t bytes;
+    std::u16string from, to;
+    uint32_t key = 0;
+    for (auto& pair : mapping)
+    {
+        string_to_utf16(pair.first.data(), pair.first.size(), false, bytes);
+        utf16_to_units(bytes.data(), bytes.size(), false, from);
+        string_to_utf16(pair.second.data(), pair.second.size(), false, bytes);
+        utf16_to_units(bytes.data(), bytes.size(), false, to);
+        matcher.add(from, to, key++);
+    }
+    matcher.compile();
+}
+
+// A file as seen by the backend: a full pathname on Win32, a name relative
+// to an open directory on POSIX.
+#ifdef _WIN32
+    struct TEMPLA_FILE_LOC
+    {
+        const wchar_t *path;
+    };
+#else
+    struct TEMPLA_FILE_LOC
+    {
+        int dirfd;
+        const char *name;
+    };
+#endif
+
+// An input file. The size, the modification time (in nanoseconds) and the
+// identity (device and inode, or volume and file index) are taken when it
+// is opened.
+struct TEMPLA_READER
+{
+#ifdef _WIN32
+    FILE *m_fp = NULL;
+#else
+    int m_fd = -1;
+#endif
+    uint64_t m_size = 0;
+    uint64_t m_mtime = 0;
+    uint64_t m_id[2] = { 0, 0 };
+    uint64_t m_links = 1;
+
+    TEMPLA_READER() { }
+    TEMPLA_READER(const TEMPLA_READER&) = delete;
+    TEMPLA_READER& operator=(const TEMPLA_READER&) = delete;
+    ~TEMPLA_READER() { close(); }
+
+    bool open(TEMPLA_FILE_LOC loc)
+    {
+#ifdef _WIN32
+        m_fp = _wfopen(loc.path, L"rb");
+        if (!m_fp)
+            return false;
+
+        struct _stati64 st;
+        if (_fstati64(_fileno(m_fp), &st) != 0)
+        {
+            close();
+            return false;
+        }
+#else
+        m_fd = openat(loc.dirfd, loc.name, O_RDONLY | O_CLOEXEC);
+        if (m_fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0)
+        {
+            close();
+            return false;
+        }
+#endif
+        m_size = uint64_t(st.st_size);
+#if defined(_WIN32)
+        m_mtime = uint64_t(st.st_mtime) * 1000000000;
+
+        BY_HANDLE_FILE_INFORMATION info;
+        if (GetFileInformationByHandle(HANDLE(_get_osfhandle(_fileno(m_fp))), &info))
+        {
+            m_id[0] = info.dwVolumeSerialNumber;
+            m_id[1] = (uint64_t(info.nFileIndexHigh) << 32) | info.nFileIndexLow;
+            m_links = info.nNumberOfLinks;
+        }
+#elif defined(__APPLE__)
+        m_mtime = uint64_t(st.st_mtimespec.tv_sec) * 1000000000 + st.st_mtimespec.tv_nsec;
+#else
+        m_mtime = uint64_t(st.st_mtim.tv_sec) * 1000000000 + st.st_mtim.tv_nsec;
+#endif
+#ifndef _WIN32
+        m_id[0] = uint64_t(st.st_dev);
+        m_id[1] = uint64_t(st.st_ino);
+        m_links = uint64_t(st.st_nlink);
+#endif
+        return true;
+    }
+
+    // Fill ptr as far as possible. Returns the number of bytes read (less
+    // than size only at the end of the file), or -1 on error.
+    ptrdiff_t read(void *ptr, size_t size)
+    {
+#ifdef _WIN32
+        size_t got = fread(ptr, 1, size, m_fp);
+        if (got < size && ferror(m_fp))
+            return -1;
+        return ptrdiff_t(got);
+#else
+        size_t got = 0;
+        while (got < size)
+        {
+            ssize_t cb = ::read(m_fd, static_cast<char*>(ptr) + got, size - got);
+            if (cb < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return -1;
+            }
+            if (cb == 0)
+                break;
+            got += size_t(cb);
+        }
+        return ptrdiff_t(got);
+#endif
+    }
+
+    bool read_all(binary_t& data)
+    {
+        data.resize(size_t(m_size));
+        ptrdiff_t got = data.empty() ? 0 : read(&data[0], data.size());
+        if (got < 0)
+            return false;
+        data.resize(size_t(got));
+        return true;
+    }
+
+    void close()
+    {
+#ifdef _WIN32
+        if (m_fp)
+            fclose(m_fp);
+        m_fp = NULL;
+#else
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_fd = -1;
+#endif
+    }
+};
+
+// An output file, created or truncated by open. An existing file with
+// other hard links (see --hardlinks) is replaced instead of truncated.
+// With options.atomic, the file is written under a temporary name in the
+// same folder and renamed into place by close, so that the output is
+// either the old one or complete. With TS_FILE, close syncs the data.
+struct TEMPLA_WRITER
+{
+#ifdef _WIN32
+    FILE *m_fp = NULL;
+    string_t m_path, m_temp;
+#else
+    int m_fd = -1;
+    int m_dirfd = -1;
+    std::string m_name, m_temp;
+#endif
+    bool m_sync = false;
+
+    TEMPLA_WRITER() { }
+    TEMPLA_WRITER(const TEMPLA_WRITER&) = delete;
+    TEMPLA_WRITER& operator=(const TEMPLA_WRITER&) = delete;
+    ~TEMPLA_WRITER() { close(false); }
+
+    bool open(TEMPLA_FILE_LOC loc, const TEMPLA_OPTIONS *options = NULL)
+    {
+        m_sync = options && options->sync == TS_FILE;
+        if (options && options->atomic)
+            return open_temp(loc);
+#ifdef _WIN32
+        HANDLE hFile = CreateFileW(loc.path, 0, FILE_SHARE_READ | FILE_SHARE_WRITE | FILE_SHARE_DELETE,
+                                   NULL, OPEN_EXISTING, 0, NULL);
+        if (hFile != INVALID_HANDLE_VALUE)
+        {
+            BY_HANDLE_FILE_INFORMATION info;
+            bool linked = GetFileInformationByHandle(hFile, &info) && info.nNumberOfLinks > 1;
+            CloseHandle(hFile);
+            if (linked)
+                DeleteFileW(loc.path);
+        }
+        m_fp = _wfopen(loc.path, L"wb");
+        return m_fp != NULL;
+#else
+        m_fd = openat(loc.dirfd, loc.name, O_WRONLY | O_CREAT | O_CLOEXEC, 0666);
+        if (m_fd < 0)
+            return false;
+
+        struct stat st;
+        if (fstat(m_fd, &st) != 0)
+        {
+            close(false);
+            return false;
+        }
+        if (st.st_nlink > 1)
+        {
+            close(false);
+            unlinkat(loc.dirfd, loc.name, 0);
+            m_fd = openat(loc.dirfd, loc.name, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0666);
+            return m_fd >= 0;
+        }
+        if (st.st_size > 0 && ftruncate(m_fd, 0) != 0)
+        {
+            close(false);
+            return false;
+        }
+        return true;
+#endif
+    }
+
+    bool write(const void *ptr, size_t size)
+    {
+#ifdef _WIN32
+        return !size || fwrite(ptr, size, 1, m_fp);
+#else
+        auto pb = static_cast<const char*>(ptr);
+        while (size > 0)
+        {
+            ssize_t cb = ::write(m_fd, pb, size);
+            if (cb < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                return false;
+            }
+            pb += cb;
+            size -= size_t(cb);
+        }
+        return true;
+#endif
+    }
+
+    // Finish the file. If ok is false (a write failed, or the file is not
+    // wanted any more), a temporary file is removed instead of renamed.
+    bool close(bool ok = true)
+    {
+#ifdef _WIN32
+        if (m_fp)
+        {
+            if (ok && m_sync && (fflush(m_fp) != 0 || _commit(_fileno(m_fp)) != 0))
+                ok = false;
+            if (fclose(m_fp) != 0)
+                ok = false;
+        }
+        m_fp = NULL;
+        if (!m_temp.empty())
+        {
+            DWORD flags = MOVEFILE_REPLACE_EXISTING | (m_sync ? MOVEFILE_WRITE_THROUGH : 0);
+            if (ok && !MoveFileExW(m_temp.c_str(), m_path.c_str(), flags))
+                ok = false;
+            if (!ok)
+                DeleteFileW(m_temp.c_str());
+            m_temp.clear();
+        }
+#else
+        if (m_fd >= 0)
+        {
+#ifdef __APPLE__
+            if (ok && m_sync && fsync(m_fd) != 0)
+#else
+            if (ok && m_sync && fdatasync(m_fd) != 0)
+#endif
+                ok = false;
+            if (::close(m_fd) != 0)
+                ok = false;
+        }
+        m_fd = -1;
+        if (!m_temp.empty())
+        {
+            if (ok && renameat(m_dirfd, m_temp.c_str(), m_dirfd, m_name.c_str()) != 0)
+                ok = false;
+            if (!ok)
+                unlinkat(m_dirfd, m_temp.c_str(), 0);
+            m_temp.clear();
+        }
+#endif
+        return ok;
+    }
+
+protected:
+    // "name" is written as ".name.templa-PID-N" next to it, with the mode
+    // of an existing "name".
+    bool open_temp(TEMPLA_FILE_LOC loc)
+    {
+        static std::atomic<unsigned> s_count(0);
+#ifdef _WIN32
+        m_path = loc.path;
+        size_t ich = m_path.find_last_of(L"\\/");
+        ich = (ich == m_path.npos) ? 0 : ich + 1;
+        for (int retry = 0; retry < 100; ++retry)
+        {
+            wchar_t suffix[64];
+            swprintf(suffix, _countof(suffix), L".templa-%lu-%u",
+                     GetCurrentProcessId(), s_count++);
+            m_temp = m_path.substr(0, ich) + L"." + m_path.substr(ich) + suffix;
+            m_fp = _wfopen(m_temp.c_str(), L"wbx");
+            if (m_fp)
+                return true;
+            if (errno != EEXIST)
+                break;
+        }
+#else
+        m_dirfd = loc.dirfd;
+        m_name = loc.name;
+        struct stat st;
+        bool existing = fstatat(m_dirfd, loc.name, &st, 0) == 0 && S_ISREG(st.st_mode);
+        size_t ich = m_name.rfind('/');
+        ich = (ich == m_name.npos) ? 0 : ich + 1;
+        for (int retry = 0; retry < 100; ++retry)
+        {
+            char suffix[64];
+            snprintf(suffix, sizeof(suffix), ".templa-%ld-%u", long(getpid()), s_count++);
+            m_temp = m_name.substr(0, ich) + "." + m_name.substr(ich) + suffix;
+            m_fd = openat(m_dirfd, m_temp.c_str(), O_WRONLY | O_CREAT | O_EXCL | O_CLOEXEC, 0666);
+            if (m_fd >= 0)
+            {
+                if (existing && fchmod(m_fd, st.st_mode & 07777) != 0)
+                {
+                    ::close(m_fd);
+                    m_fd = -1;
+                    unlinkat(m_dirfd, m_temp.c_str(), 0);
+                    break;
+                }
+                return true;
+            }
+            if (errno != EEXIST)
+                break;
+        }
+#endif
+        m_temp.clear();
+        return false;
+    }
+};
+
+static bool templa_load_file_at(TEMPLA_FILE_LOC loc, binary_t& data)
+{
+    TEMPLA_READER reader;
+    return reader.open(loc) && reader.read_all(data);
+}
+
+static bool templa_save_file_at(TEMPLA_FILE_LOC loc, const void *ptr, size_t data_size,
+                                const TEMPLA_OPTIONS *options = NULL)
+{
+    TEMPLA_WRITER writer;
+    if (!writer.open(loc, options))
+        return false;
+    return writer.close(writer.write(ptr, data_size));
+}
+
+static bool templa_remove_file_at(TEMPLA_FILE_LOC loc)
+{
+#ifdef _WIN32
+    return DeleteFileW(loc.path);
+#else
+    return unlinkat(loc.dirfd, loc.name, 0) == 0;
+#endif
+}
+
+static bool templa_file_size_at(TEMPLA_FILE_LOC loc, uint64_t& size)
+{
+#ifdef _WIN32
+    struct _stati64 st;
+    if (_wstati64(loc.path, &st) != 0 || (st.st_mode & _S_IFDIR))
+        return false;
+#else
+    struct stat st;
+    if (fstatat(loc.dirfd, loc.name, &st, 0) != 0 || !S_ISREG(st.st_mode))
+        return false;
+#endif
+    size = uint64_t(st.st_size);
+    return true;
+}
+
+// The contents of an input file. Files of TEMPLA_MAP_SIZE bytes or more
+// are mapped instead of read, so that a file copied unchanged never goes
+// through a buffer of ours.
+#define TEMPLA_MAP_SIZE (64 * 1024)
+
+struct TEMPLA_VIEW
+{
+    const char *m_ptr = NULL;
+    size_t m_size = 0;
+    binary_t m_buffer;
+#ifdef _WIN32
+    HANDLE m_hMapping = NULL;
+#else
+    void *m_map = NULL;
+#endif
+
+    TEMPLA_VIEW() { TEMPLA_POOL::local().get(m_buffer); }
+    TEMPLA_VIEW(const TEMPLA_VIEW&) = delete;
+    TEMPLA_VIEW& operator=(const TEMPLA_VIEW&) = delete;
+
+    ~TEMPLA_VIEW()
+    {
+        TEMPLA_POOL::local().put(m_buffer);
+#ifdef _WIN32
+        if (m_hMapping)
+        {
+            UnmapViewOfFile(m_ptr);
+            CloseHandle(m_hMapping);
+        }
+#else
+        if (m_map)
+            munmap(m_map, m_size);
+#endif
+    }
+
+    bool mapped() const
+    {
+#ifdef _WIN32
+        return m_hMapping != NULL;
+#else
+        return m_map != NULL;
+#endif
+    }
+
+    bool load(TEMPLA_READER& reader)
+    {
+        if (reader.m_size >= TEMPLA_MAP_SIZE && reader.m_size <= SIZE_MAX)
+        {
+            size_t size = size_t(reader.m_size);
+#ifdef _WIN32
+            HANDLE hFile = reinterpret_cast<HANDLE>(_get_osfhandle(_fileno(reader.m_fp)));
+            m_hMapping = CreateFileMappingW(hFile, NULL, PAGE_READONLY, 0, 0, NULL);
+            if (m_hMapping)
+            {
+                if (void *ptr = MapViewOfFile(m_hMapping, FILE_MAP_READ, 0, 0, 0))
+                {
+                    m_ptr = static_cast<const char*>(ptr);
+                    m_size = size;
+                    return true;
+                }
+                CloseHandle(m_hMapping);
+                m_hMapping = NULL;
+            }
+#else
+            void *ptr = mmap(NULL, size, PROT_READ, MAP_PRIVATE, reader.m_fd, 0);
+            if (ptr != MAP_FAILED)
+            {
+                m_map = ptr;
+                m_ptr = static_cast<const char*>(ptr);
+                m_size = size;
+                return true;
+            }
+#endif
+        }
+
+        if (!reader.read_all(m_buffer))
+            return false;
+        m_ptr = m_buffer.data();
+        m_size = m_buffer.size();
+        return true;
+    }
+};
+
+// What the file systems of a run turned out not to support, so that it is
+// not asked again for each file.
+struct TEMPLA_COPY_SUPPORT
+{
+    std::atomic<bool> no_clone, no_copy_range;
+
+    TEMPLA_COPY_SUPPORT()
+        : no_clone(false)
+        , no_copy_range(false)
+    {
+    }
+};
+
+#ifdef __linux__
+// Whether errno says the operation is not supported at all, rather than
+// failed for this file.
+static bool templa_unsupported(int error)
+{
+    return error == EOPNOTSUPP || error == ENOTSUP || error == ENOTTY || error == ENOSYS ||
+           error == EXDEV;
+}
+#endif
+
+// Write an input file unchanged. A mapped file is cloned (reflink) or
+// copied by the kernel where possible.
+static bool
+templa_copy_file_at(TEMPLA_FILE_LOC loc1, TEMPLA_READER& reader, const TEMPLA_VIEW& view,
+                    TEMPLA_FILE_LOC loc2, const TEMPLA_OPTIONS *options = NULL,
+                    TEMPLA_COPY_SUPPORT *support = NULL)
+{
+#ifdef _WIN32
+    (void)reader;
+    (void)support;
+    bool plain = !options || (!options->atomic && options->sync != TS_FILE);
+    if (plain && view.mapped() && CopyFileW(loc1.path, loc2.path, FALSE))
+        return true;
+    return templa_save_file_at(loc2, view.m_ptr, view.m_size, options);
+#else
+    (void)loc1;
+    if (!view.mapped())
+        return templa_save_file_at(loc2, view.m_ptr, view.m_size, options);
+
+    TEMPLA_WRITER writer;
+    if (!writer.open(loc2, options))
+        return false;
+
+    size_t done = 0;
+#ifdef __linux__
+    if (!support || !support->no_clone)
+    {
+        if (ioctl(writer.m_fd, FICLONE, reader.m_fd) == 0)
+            done = view.m_size;
+        else if (support && templa_unsupported(errno))
+            support->no_clone = true;
+    }
+
+    while (done < view.m_size && (!support || !support->no_copy_range))
+    {
+        loff_t offset = loff_t(done);
+        ssize_t cb = copy_file_range(reader.m_fd, &offset, writer.m_fd, NULL,
+                                     view.m_size - done, 0);
+        if (cb > 0)
+        {
+            done += size_t(cb);
+            continue;
+        }
+        if (cb < 0 && errno == EINTR)
+            continue;
+        if (cb < 0 && support && templa_unsupported(errno))
+            support->no_copy_range = true;
+        break;
+    }
+
+    while (done < view.m_size)
+    {
+        off_t offset = off_t(done);
+        ssize_t cb = sendfile(writer.m_fd, reader.m_fd, &offset, view.m_size - done);
+        if (cb > 0)
+        {
+            done += size_t(cb);
+            continue;
+        }
+        if (cb < 0 && errno == EINTR)
+            continue;
+        break;
+    }
+#else
+    (void)reader;
+    (void)support;
+#endif
+
+    return writer.close(writer.write(view.m_ptr + done, view.m_size - done));
+#endif
+}
+
+static TEMPLA_FILE_LOC templa_file_loc(const string_t& filename, std::string& native)
+{
+#ifdef _WIN32
+    return { filename.c_str() };
+#else
+    native = string_to_native(filename);
+    return { AT_FDCWD, native.c_str() };
+#endif
+}
+
+bool templa_load_file(const string_t& filename, binary_t& data)
+{
+    std::string native;
+    return templa_load_file_at(templa_file_loc(filename, native), data);
+}
+
+bool templa_save_file(const string_t& filename, const void *ptr, size_t data_size)
+{
+    std::string native;
+    return templa_save_file_at(templa_file_loc(filename, native), ptr, data_size);
+}
+
+#ifdef TEMPLA_HAVE_IO_URING
+// A minimal io_uring on the system calls. Requests are queued by prepare,
+// then run submits them together and waits for all of them.
+class TEMPLA_URING
+{
+public:
+    TEMPLA_URING() { }
+    TEMPLA_URING(const TEMPLA_URING&) = delete;
+    TEMPLA_URING& operator=(const TEMPLA_URING&) = delete;
+    ~TEMPLA_URING() { close(); }
+
+    bool open(unsigned entries)
+    {
+        io_uring_params params;
+        memset(&params, 0, sizeof(params));
+        m_fd = int(syscall(__NR_io_uring_setup, entries, &params));
+        if (m_fd < 0)
+            return false;
+
+        // opens, reads and writes came with IORING_FEAT_RW_CUR_POS (Linux 5.6)
+        if (!(params.features & IORING_FEAT_SINGLE_MMAP) ||
+            !(params.features & IORING_FEAT_RW_CUR_POS))
+        {
+            close();
+            return false;
+        }
+
+        m_ring_size = std::max(params.sq_off.array + params.sq_entries * sizeof(unsigned),
+                               params.cq_off.cqes + params.cq_entries * sizeof(io_uring_cqe));
+        m_sqes_size = params.sq_entries * sizeof(io_uring_sqe);
+        void *ring = mmap(NULL, m_ring_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          m_fd, IORING_OFF_SQ_RING);
+        void *sqes = mmap(NULL, m_sqes_size, PROT_READ | PROT_WRITE, MAP_SHARED | MAP_POPULATE,
+                          m_fd, IORING_OFF_SQES);
+        m_ring = (ring != MAP_FAILED) ? static_cast<char *>(ring) : NULL;
+        m_sqes = (sqes != MAP_FAILED) ? static_cast<io_uring_sqe *>(sqes) : NULL;
+        if (!m_ring || !m_sqes)
+        {
+            close();
+            return false;
+        }
+
+        m_entries = params.sq_entries;
+        m_sq_tail = reinterpret_cast<unsigned *>(m_ring + params.sq_off.tail);
+        m_sq_mask = *reinterpret_cast<unsigned *>(m_ring + params.sq_off.ring_mask);
+        m_sq_array = reinterpret_cast<unsigned *>(m_ring + params.sq_off.array);
+        m_cq_head = reinterpret_cast<unsigned *>(m_ring + params.cq_off.head);
+        m_cq_tail = reinterpret_cast<unsigned *>(m_ring + params.cq_off.tail);
+        m_cq_mask = *reinterpret_cast<unsigned *>(m_ring + params.cq_off.ring_mask);
+        m_cqes = reinterpret_cast<io_uring_cqe *>(m_ring + params.cq_off.cqes);
+        m_tail = *m_sq_tail;
+        return true;
+    }
+
+    void close()
+    {
+        if (m_sqes)
+            munmap(m_sqes, m_sqes_size);
+        if (m_ring)
+            munmap(m_ring, m_ring_size);
+        if (m_fd >= 0)
+            ::close(m_fd);
+        m_sqes = NULL;
+        m_ring = NULL;
+        m_fd = -1;
+        m_entries = m_queued = 0;
+    }
+
+    unsigned capacity() const
+    {
+        return m_entries - m_queued;
+    }
+
+    // Queue a request. Its result goes to the slot user_data of run.
+    io_uring_sqe *prepare(uint8_t opcode, int fd, const void *addr, uint32_t len,
+                          uint64_t off, uint64_t user_data)
+    {
+        unsigned index = m_tail & m_sq_mask;
+        io_uring_sqe *sqe = &m_sqes[index];
+        memset(sqe, 0, sizeof(*sqe));
+        sqe->opcode = opcode;
+        sqe->fd = fd;
+        sqe->addr = uint64_t(uintptr_t(addr));
+        sqe->len = len;
+        sqe->off = off;
+        sqe->user_data = user_data;
+        m_sq_array[index] = index;
+        ++m_tail;
+        ++m_queued;
+        return sqe;
+    }
+
+    bool run(std::vector<int>& results)
+    {
+        __atomic_store_n(m_sq_tail, m_tail, __ATOMIC_RELEASE);
+        unsigned to_submit = m_queued, pending = m_queued;
+        m_queued = 0;
+        while (pending > 0)
+        {
+            long ret = syscall(__NR_io_uring_enter, m_fd, to_submit, pending,
+                               IORING_ENTER_GETEVENTS, NULL, 0);
+            if (ret < 0)
+            {
+                if (errno == EINTR)
+                    continue;
+                close();    // the requests in flight are lost with it
+                return false;
+            }
+            to_submit -= unsigned(ret);
+
+            unsigned head = *m_cq_head;
+            unsigned tail = __atomic_load_n(m_cq_tail, __ATOMIC_ACQUIRE);
+            for (; head != tail; ++head, --pending)
+            {
+                const io_uring_cqe& cqe = m_cqes[head & m_cq_mask];
+                results[size_t(cqe.user_data)] = cqe.res;
+            }
+            __atomic_store_n(m_cq_head, head, __ATOMIC_RELEASE);
+        }
+        return true;
+    }
+
+protected:
+    int m_fd = -1;
+    char *m_ring = NULL;
+    size_t m_ring_size = 0;
+    io_uring_sqe *m_sqes = NULL;
+    size_t m_sqes_size = 0;
+    unsigned m_entries = 0;
+    unsigned m_tail = 0;
+    unsigned m_queued = 0;
+    unsigned *m_sq_tail = NULL;
+    unsigned m_sq_mask = 0;
+    unsigned *m_sq_array = NULL;
+    unsigned *m_cq_head = NULL;
+    unsigned *m_cq_tail = NULL;
+    unsigned m_cq_mask = 0;
+    io_uring_cqe *m_cqes = NULL;
+};
+#endif  // def TEMPLA_HAVE_IO_URING
+
+// Count the newlines of each kind in one pass. Returns the newline that
+// the text is normalized to, and sets uniform if that would not change it.
+template <typename T_CHAR>
+static TEMPLA_NEWLINE
+templa_scan_newlines(const T_CHAR *ptr, size_t size, bool& uniform)
+{
+    size_t crlf = 0, cr = 0, lf = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        if (ptr[i] == T_CHAR('\r'))
+        {
+            if (i + 1 < size && ptr[i + 1] == T_CHAR('\n'))
+            {
+                ++crlf;
+                ++i;
+            }
+            else
+            {
+                ++cr;
+            }
+        }
+        else if (ptr[i] == T_CHAR('\n'))
+        {
+            ++lf;
+        }
+    }
+
+    // lone CRs are kept by the CR LF normalization
+    if (crlf)
+    {
+        uniform = !lf;
+        return TNL_CRLF;
+    }
+    if (lf)
+    {
+        uniform = !cr;
+        return TNL_LF;
+    }
+    uniform = true;
+    return cr ? TNL_CR : TNL_UNKNOWN;
+}
+
+// The output buffer of templa_encode_text. It is sized from an estimate up
+// front and only grows if the estimate was short.
+struct TEMPLA_OUTPUT
+{
+    binary_t& m_out;
+    size_t m_pos = 0;
+
+    TEMPLA_OUTPUT(binary_t& out, size_t estimate)
+        : m_out(out)
+    {
+        m_out.resize(estimate);
+    }
+
+    char *reserve(size_t size)
+    {
+        if (m_pos + size > m_out.size())
+            m_out.resize(std::max(m_out.size() + m_out.size() / 2, m_pos + size));
+        return &m_out[m_pos];
+    }
+
+    void append(const void *ptr, size_t size)
+    {
+        if (size)
+            memcpy(reserve(size), ptr, size);
+        m_pos += size;
+    }
+
+    void finish()
+    {
+        m_out.resize(m_pos);
+    }
+};
+
+// What a newline found in the text becomes after normalizing to newline.
+static TEMPLA_NEWLINE templa_newline_out(TEMPLA_NEWLINE found, TEMPLA_NEWLINE newline)
+{
+    switch (newline)
+    {
+    case TNL_CRLF:
+        return (found == TNL_CR) ? TNL_CR : TNL_CRLF;   // a lone CR is kept
+    case TNL_LF:
+    case TNL_CR:
+        return newline;
+    case TNL_UNKNOWN:
+        break;
+    }
+    return found;
+}
+
+// Call run(ptr, size) for each stretch of text between newlines, and
+// put_newline(kind) for each newline after normalizing it.
+template <typename T_CHAR, typename T_RUN, typename T_NEWLINE>
+static void
+templa_split_newlines(const T_CHAR *ptr, size_t size, TEMPLA_NEWLINE newline,
+                      T_RUN run, T_NEWLINE put_newline)
+{
+    size_t start = 0;
+    for (size_t i = 0; i < size; ++i)
+    {
+        T_CHAR ch = ptr[i];
+        if (ch != T_CHAR('\r') && ch != T_CHAR('\n'))
+            continue;
+
+        run(ptr + start, i - start);
+        TEMPLA_NEWLINE found = TNL_LF;
+        if (ch == T_CHAR('\r'))
+        {
+            found = TNL_CR;
+            if (i + 1 < size && ptr[i + 1] == T_CHAR('\n'))
+            {
+                found = TNL_CRLF;
+                ++i;
+            }
+        }
+        put_newline(templa_newline_out(found, newline));
+        start = i + 1;
+    }
+    run(ptr + start, size - start);
+}
+
+#define TEMPLA_ENCODE_BLOCK 4096
+
+// Encode a stretch of text without newlines.
+static void
+templa_encode_run(const wchar_t *ptr, size_t size, TEMPLA_ENCODING encoding, TEMPLA_OUTPUT& out)
+{
+    while (size > 0)
+    {
+        size_t count = std::min<size_t>(size, TEMPLA_ENCODE_BLOCK);
+        if (count < size && 0xD800 <= uint32_t(ptr[count - 1]) && uint32_t(ptr[count - 1]) <= 0xDBFF)
+            ++count;    // keep a surrogate pair together
+
+        char *dst = out.reserve(count * 4);
+        if (encoding == TE_UTF8)
+        {
+            out.m_pos += templa_encode_utf8(ptr, count, dst, false);
+        }
+        else if (encoding == TE_UTF16 || encoding == TE_UTF16BE)
+        {
+            out.m_pos += templa_encode_utf16(ptr, count, encoding == TE_UTF16BE, dst);
+        }
+        else
+        {
+            for (size_t i = 0; i < count; ++i)
+                dst[i] = char((uint32_t(ptr[i]) <= 0xFF) ? ptr[i] : '?');
+            out.m_pos += count;
+        }
+
+        ptr += count;
+        size -= count;
+    }
+}
+
+static const char *templa_bom(TEMPLA_ENCODING encoding, size_t& size)
+{
+    switch (encoding)
+    {
+    case TE_UTF8: size = 3; return "\xEF\xBB\xBF";
+    case TE_UTF16: size = 2; return "\xFF\xFE";
+    case TE_UTF16BE: size = 2; return "\xFE\xFF";
+    default: size = 0; return "";
+    }
+}
+
+// Encode text into the contents of a file in one sweep: the BOM, then the
+// text with its newlines normalized, in a buffer sized up front.
+static void
+templa_encode_text(const wchar_t *ptr, size_t size, TEMPLA_ENCODING encoding,
+                   TEMPLA_NEWLINE newline, bool bom, binary_t& ret)
+{
+#ifdef _WIN32
+    if (encoding == TE_ANSI || encoding == TE_ASCII || encoding == TE_BINARY)
+    {
+        // the code page conversion cannot be done piece by piece
+        TEMPLA_POOLED<string_t> str;
+        str.m_str.reserve(size + size / 16);
+        templa_split_newlines(ptr, size, newline,
+            [&](const wchar_t *run, size_t count) { str.m_str.append(run, count); },
+            [&](TEMPLA_NEWLINE kind) {
+                str.m_str += (kind == TNL_LF) ? L"\n" : (kind == TNL_CR) ? L"\r" : L"\r\n";
+            });
+        string_to_binary(CP_ACP, str.m_str, ret);
+        return;
+    }
+#endif
+
+    size_t bom_size;
+    const char *bom_bytes = templa_bom(encoding, bom_size);
+    if (!bom)
+        bom_size = 0;
+
+    size_t unit = (encoding == TE_UTF16 || encoding == TE_UTF16BE) ? 2 : 1;
+    TEMPLA_OUTPUT out(ret, bom_size + (size + size / 16) * unit);
+    out.append(bom_bytes, bom_size);
+
+    static const char cr16[] = "\r\0", lf16[] = "\n\0", crlf16[] = "\r\0\n\0";
+    static const char cr16be[] = "\0\r", lf16be[] = "\0\n", crlf16be[] = "\0\r\0\n";
+    templa_split_newlines(ptr, size, newline,
+        [&](const wchar_t *run, size_t count) { templa_encode_run(run, count, encoding, out); },
+        [&](TEMPLA_NEWLINE kind) {
+            const char *bytes = (kind == TNL_LF) ? "\n" : (kind == TNL_CR) ? "\r" : "\r\n";
+            if (encoding == TE_UTF16)
+                bytes = (kind == TNL_LF) ? lf16 : (kind == TNL_CR) ? cr16 : crlf16;
+            else if (encoding == TE_UTF16BE)
+                bytes = (kind == TNL_LF) ? lf16be : (kind == TNL_CR) ? cr16be : crlf16be;
+            out.append(bytes, ((kind == TNL_CRLF) ? 2 : 1) * unit);
+        });
+    out.finish();
+}
+
+// The same for UTF-8 or ASCII bytes that are not decoded.
+static void
+templa_encode_bytes(const char *ptr, size_t size, TEMPLA_NEWLINE newline, bool bom, binary_t& ret)
+{
+    TEMPLA_OUTPUT out(ret, (bom ? 3 : 0) + size + size / 16);
+    if (bom)
+        out.append("\xEF\xBB\xBF", 3);
+
+    templa_split_newlines(ptr, size, newline,
+        [&](const char *run, size_t count) { out.append(run, count); },
+        [&](TEMPLA_NEWLINE kind) {
+            if (kind == TNL_LF)
+                out.append("\n", 1);
+            else if (kind == TNL_CR)
+                out.append("\r", 1);
+            else
+                out.append("\r\n", 2);
+        });
+    out.finish();
+}
+
+// The same for UTF-16 code units, in the byte order of the file.
+static void
+templa_encode_units(const char16_t *ptr, size_t size, bool big_endian, TEMPLA_NEWLINE newline,
+                    bool bom, binary_t& ret)
+{
+    TEMPLA_OUTPUT out(ret, (bom ? 2 : 0) + (size + size / 16) * 2);
+    if (bom)
+        out.append(big_endian ? "\xFE\xFF" : "\xFF\xFE", 2);
+
+    size_t hi = big_endian ? 0 : 1;
+    auto put = [&](const char16_t *run, size_t count) {
+        if (!count)
+            return;
+        char *dst = out.reserve(count * 2);
+        for (size_t i = 0; i < count; ++i)
+        {
+            dst[2 * i + hi] = char(run[i] >> 8);
+            dst[2 * i + 1 - hi] = char(run[i]);
+        }
+        out.m_pos += count * 2;
+    };
+    templa_split_newlines(ptr, size, newline, put,
+        [&](TEMPLA_NEWLINE kind) {
+            if (kind == TNL_LF)
+                put(u"\n", 1);
+            else if (kind == TNL_CR)
+                put(u"\r", 1);
+            else
+                put(u"\r\n", 2);
+        });
+    out.finish();
+}
+
+void TEMPLA_FILE::detect_newline()
+{
+    bool uniform;
+    if (m_raw && templa_is_utf16(m_encoding))
+        m_newline = templa_scan_newlines(m_string16.data(), m_string16.size(), uniform);
+    else if (m_raw)
+        m_newline = templa_scan_newlines(m_binary.data(), m_binary.size(), uniform);
+    else if (m_encoding != TE_BINARY)
+        m_newline = templa_scan_newlines(m_string.data(), m_string.size(), uniform);
+    else
+        m_newline = TNL_UNKNOWN;
+}
+
+// Everything detect_encoding needs to know about the bytes, gathered in a
+// single pass. Blocks are checked for NULs and high bits with SSE2/AVX2;
+// with AVX2 the UTF-8 validation is vectorized as well, otherwise only the
+// blocks that contain non-ASCII bytes go through the scalar validator.
+struct TEMPLA_CLASSIFIER
+{
+    bool m_high = false;        // a byte >= 0x80
+    bool m_nul_even = false;    // a NUL at an even offset
+    bool m_nul_odd = false;     // a NUL at an odd offset
+    bool m_utf8 = true;         // well-formed UTF-8
+    uint32_t m_need = 0;        // continuation bytes still expected
+    uint8_t m_lo = 0x80, m_hi = 0xBF;   // range of the next continuation byte
+
+    // NULs at both parities: neither text nor UTF-16, so stop looking.
+    bool binary() const
+    {
+        return m_nul_even && m_nul_odd;
+    }
+
+    void validate(const uint8_t *p, const uint8_t *end)
+    {
+        for (; p < end; ++p)
+        {
+            uint8_t byte = *p;
+            if (m_need)
+            {
+                if (byte < m_lo || byte > m_hi)
+                {
+                    m_utf8 = false;
+                    return;
+                }
+                m_lo = 0x80;
+                m_hi = 0xBF;
+                --m_need;
+            }
+            else if (byte < 0x80)
+            {
+                continue;
+            }
+            else if (0xC2 <= byte && byte <= 0xDF)
+            {
+                m_need = 1;
+            }
+            else if (0xE0 <= byte && byte <= 0xEF)
+            {
+                m_need = 2;
+                if (byte == 0xE0)
+                    m_lo = 0xA0;    // overlong
+                else if (byte == 0xED)
+                    m_hi = 0x9F;    // surrogates
+            }
+            else if (0xF0 <= byte && byte <= 0xF4)
+            {
+                m_need = 3;
+                if (byte == 0xF0)
+                    m_lo = 0x90;    // overlong
+                else if (byte == 0xF4)
+                    m_hi = 0x8F;    // above U+10FFFF
+            }
+            else
+            {
+                m_utf8 = false;
+                return;
+            }
+        }
+    }
+
+    // The NULs of a block at offset, one bit per byte.
+    void nuls(uint32_t zero, size_t offset)
+    {
+        uint32_t even = (offset & 1) ? 0xAAAAAAAA : 0x55555555;
+        m_nul_even = m_nul_even || (zero & even);
+        m_nul_odd = m_nul_odd || (zero & ~even);
+    }
+
+    void block(const uint8_t *p, size_t size, size_t offset, uint32_t zero, uint32_t high)
+    {
+        if (zero)
+            nuls(zero, offset);
+        if (high)
+            m_high = true;
+        if (m_utf8 && (high || m_need))
+            validate(p + (m_need ? 0 : templa_ctz(high)), p + size);
+    }
+
+    void scalar(const uint8_t *p, size_t size, size_t offset)
+    {
+        for (size_t i = 0; i < size; ++i)
+        {
+            if (p[i] == 0)
+            {
+                if ((offset + i) & 1)
+                    m_nul_odd = true;
+                else
+                    m_nul_even = true;
+            }
+            else if (p[i] & 0x80)
+            {
+                m_high = true;
+            }
+        }
+        if (m_utf8)
+            validate(p, p + size);
+    }
+
+    void run(const char *ptr, size_t size);
+};
+
+#ifdef TEMPLA_HAVE_SSE2
+static size_t
+templa_classify_sse2(TEMPLA_CLASSIFIER& cls, const uint8_t *p, size_t i, size_t size)
+{
+    const __m128i zero = _mm_setzero_si128();
+    for (; i + 16 <= size && !cls.binary(); i += 16)
+    {
+        __m128i data = _mm_loadu_si128(reinterpret_cast<const __m128i*>(p + i));
+        uint32_t nuls = uint32_t(_mm_movemask_epi8(_mm_cmpeq_epi8(data, zero)));
+        uint32_t high = uint32_t(_mm_movemask_epi8(data));
+        if (nuls | high | cls.m_need)
+            cls.block(p + i, 16, i, nuls, high);
+    }
+    return i;
+}
+#endif
+
+#ifdef TEMPLA_HAVE_AVX2
+template <int N>
+TEMPLA_AVX2 static inline __m256i templa_prev_avx2(__m256i input, __m256i prev)
+{
+    return _mm256_alignr_epi8(input, _mm256_permute2x128_si256(prev, input, 0x21), 16 - N);
+}
+
+TEMPLA_AVX2 static inline __m256i templa_high_nibbles_avx2(__m256i data)
+{
+    return _mm256_and_si256(_mm256_srli_epi16(data, 4), _mm256_set1_epi8(0x0F));
+}
+
+#define TEMPLA_TABLE16_AVX2(...) _mm256_setr_epi8(__VA_ARGS__, __VA_ARGS__)
+
+// The UTF-8 errors of a block, found by looking up the nibbles of each byte
+// pair in three tables, and checking where the third and fourth bytes of
+// a sequence must be (Keiser and Lemire, "Validating UTF-8 In Less Than
+// One Instruction Per Byte").
+TEMPLA_AVX2 static __m256i templa_utf8_errors_avx2(__m256i input, __m256i prev_input)
+{
+    const char TOO_SHORT = 1 << 0, TOO_LONG = 1 << 1, OVERLONG_3 = 1 << 2, TOO_LARGE = 1 << 3;
+    const char SURROGATE = 1 << 4, OVERLONG_2 = 1 << 5, TOO_LARGE_1000 = 1 << 6;
+    const char OVERLONG_4 = 1 << 6, TWO_CONTS = char(1 << 7);
+    const char CARRY = char(TOO_SHORT | TOO_LONG | TWO_CONTS);
+
+    __m256i prev1 = templa_prev_avx2<1>(input, prev_input);
+    __m256i byte_1_high = _mm256_shuffle_epi8(TEMPLA_TABLE16_AVX2(
+        TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG, TOO_LONG,
+        TWO_CONTS, TWO_CONTS, TWO_CONTS, TWO_CONTS,
+        TOO_SHORT | OVERLONG_2,
+        TOO_SHORT,
+        TOO_SHORT | OVERLONG_3 | SURROGATE,
+        TOO_SHORT | TOO_LARGE | TOO_LARGE_1000 | OVERLONG_4), templa_high_nibbles_avx2(prev1));
+    __m256i byte_1_low = _mm256_shuffle_epi8(TEMPLA_TABLE16_AVX2(
+        CARRY | OVERLONG_3 | OVERLONG_2 | OVERLONG_4,
+        CARRY | OVERLONG_2,
+        CARRY,
+        CARRY,
+        CARRY | TOO_LARGE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000 | SURROGATE,
+        CARRY | TOO_LARGE | TOO_LARGE_1000,
+        CARRY | TOO_LARGE | TOO_LARGE_1000), _mm256_and_si256(prev1, _mm256_set1_epi8(0x0F)));
+    __m256i byte_2_high = _mm256_shuffle_epi8(TEMPLA_TABLE16_AVX2(
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE_1000 | OVERLONG_4,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | OVERLONG_3 | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_LONG | OVERLONG_2 | TWO_CONTS | SURROGATE | TOO_LARGE,
+        TOO_SHORT, TOO_SHORT, TOO_SHORT, TOO_SHORT), templa_high_nibbles_avx2(input));
+    __m256i special = _mm256_and_si256(_mm256_and_si256(byte_1_high, byte_1_low), byte_2_high);
+
+    // continuations that are required after 111_____ and 1111____
+    __m256i third = _mm256_subs_epu8(templa_prev_avx2<2>(input, prev_input),
+                                     _mm256_set1_epi8(char(0xE0 - 0x80)));
+    __m256i fourth = _mm256_subs_epu8(templa_prev_avx2<3>(input, prev_input),
+                                      _mm256_set1_epi8(char(0xF0 - 0x80)));
+    __m256i must23 = _mm256_and_si256(_mm256_or_si256(third, fourth),
+                                      _mm256_set1_epi8(char(0x80)));
+    return _mm256_xor_si256(must23, special);
+}
+
+// The classifier with the UTF-8 validation vectorized too. A sequence
+// left incomplete at the end is handed back to the scalar code.
+TEMPLA_AVX2 static size_t
+templa_classify_avx2(TEMPLA_CLASSIFIER& cls, const uint8_t *p, size_t size)
+{
+    const __m256i zero = _mm256_setzero_si256();
+    const __m256i incomplete_max = _mm256_setr_epi8(
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,
+        char(0xF0 - 1), char(0xE0 - 1), char(0xC0 - 1));
+    __m256i prev_input = zero, prev_incomplete = zero, error = zero;
+
+    size_t i = 0;
+    while (i + 32 <= size && !cls.binary())
+    {
+        __m256i data = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i));
+        if (i + 64 <= size)
+        {
+            // the common case: two blocks of plain ASCII text
+            __m256i data2 = _mm256_loadu_si256(reinterpret_cast<const __m256i*>(p + i + 32));
+            __m256i nul = _mm256_or_si256(_mm256_cmpeq_epi8(data, zero),
+                                          _mm256_cmpeq_epi8(data2, zero));
+            if (!_mm256_movemask_epi8(_mm256_or_si256(_mm256_or_si256(data, data2), nul)))
+            {
+                error = _mm256_or_si256(error, prev_incomplete);
+                prev_incomplete = zero;
+                prev_input = data2;
+                i += 64;
+                continue;
+            }
+        }
+
+        uint32_t nuls = uint32_t(_mm256_movemask_epi8(_mm256_cmpeq_epi8(data, zero)));
+        uint32_t high = uint32_t(_mm256_movemask_epi8(data));
+        if (nuls)
+            cls.nuls(nuls, i);
+        if (high)
+        {
+            cls.m_high = true;
+            error = _mm256_or_si256(error, templa_utf8_errors_avx2(data, prev_input));
+            prev_incomplete = _mm256_subs_epu8(data, incomplete_max);
+        }
+        else
+        {
+            error = _mm256_or_si256(error, prev_incomplete);
+            prev_incomplete = zero;
+        }
+        prev_input = data;
+        i += 32;
+    }
+
+    if (!_mm256_testz_si256(error, error))
+        cls.m_utf8 = false;
+
+    // back up to the lead byte of an incomplete sequence
+    if (!_mm256_testz_si256(prev_incomplete, prev_incomplete))
+    {
+        for (size_t back = 1; back <= 3; ++back)
+        {
+            if ((p[i - back] & 0xC0) != 0x80)
+                return i - back;
+        }
+    }
+    return i;
+}
+#endif
+
+void TEMPLA_CLASSIFIER::run(const char *ptr, size_t size)
+{
+    auto p = reinterpret_cast<const uint8_t*>(ptr);
+    size_t i = 0;
+#ifdef TEMPLA_HAVE_AVX2
+    if (templa_has_avx2())
+        i = templa_classify_avx2(*this, p, size);
+#endif
+#ifdef TEMPLA_HAVE_SSE2
+    i = templa_classify_sse2(*this, p, i, size);
+#endif
+    if (!binary())
+        scalar(p + i, size - i, i);
+    if (m_need)
+        m_utf8 = false;
+}
+
+// Detect the encoding of the contents of a file without decoding it.
+TEMPLA_ENCODING templa_detect_encoding(const char *ptr, size_t size, bool& bom)
+{
+    bom = false;
+    if (size >= 3 && memcmp(ptr, "\xEF\xBB\xBF", 3) == 0)
+    {
+        bom = true;
+        return TE_UTF8;
+    }
+    if (size >= 2 && memcmp(ptr, "\xFF\xFE", 2) == 0)
+    {
+        bom = true;
+        return TE_UTF16;
+    }
+    if (size >= 2 && memcmp(ptr, "\xFE\xFF", 2) == 0)
+    {
+        bom = true;
+        return TE_UTF16BE;
+    }
+
+    TEMPLA_CLASSIFIER cls;
+    cls.run(ptr, size);
+
+    if (!cls.m_high && !cls.m_nul_even && !cls.m_nul_odd)
+        return TE_ASCII;
+    if (cls.binary())
+        return TE_BINARY;
+    if ((size & 1) == 0)
+    {
+        if (cls.m_nul_odd)
+            return TE_UTF16;
+        if (cls.m_nul_even)
+            return TE_UTF16BE;
+    }
+
+    // well-formed UTF-8 always survives a round trip
+    if (cls.m_utf8)
+        return TE_UTF8;
+
+#ifdef _WIN32
+    if (!size || MultiByteToWideChar(CP_ACP, MB_ERR_INVALID_CHARS, ptr, INT(size), NULL, 0) > 0)
+        return TE_ANSI;
+
+    string_t str;
+    binary_t ansi;
+    binary_to_string(CP_ACP, ptr, size, str);
+    string_to_binary(CP_ACP, str, ansi);
+    if (ansi.size() == size && memcmp(ansi.data(), ptr, size) == 0)
+        return TE_ANSI;
+
+    return TE_BINARY;
+#else
+    return TE_ANSI;
+#endif
+}
+
+TEMPLA_FILE::TEMPLA_FILE()
+{
+    TEMPLA_POOL& pool = TEMPLA_POOL::local();
+    pool.get(m_binary);
+    pool.get(m_string);
+    pool.get(m_string16);
+}
+
+TEMPLA_FILE::~TEMPLA_FILE()
+{
+    TEMPLA_POOL& pool = TEMPLA_POOL::local();
+    pool.put(m_binary);
+    pool.put(m_string);
+    pool.put(m_string16);
+}
+
+void TEMPLA_FILE::detect_encoding()
+{
+    m_encoding = templa_detect_encoding(m_binary.data(), m_binary.size(), m_bom);
+    decode();
+}
+
+void TEMPLA_FILE::decode()
+{
+    size_t skip = 0;
+    if (m_bom)
+        skip = (m_encoding == TE_UTF8) ? 3 : 2;
+
+    if (m_raw && (m_encoding == TE_UTF8 || m_encoding == TE_ASCII))
+    {
+        m_binary.erase(0, skip);
+        m_string.clear();
+        return;
+    }
+    if (m_raw && templa_is_utf16(m_encoding))
+    {
+        utf16_to_units(m_binary.data() + skip, m_binary.size() - skip, m_encoding == TE_UTF16BE,
+                       m_string16);
+        m_string.clear();
+        return;
+    }
+
+    m_raw = false;
+    binary_to_string(m_encoding, m_binary.data() + skip, m_binary.size() - skip, m_string);
+}
+
+bool TEMPLA_FILE::load(const string_t& filename)
+{
+    if (!templa_load_file(filename, m_binary))
+        return false;
+
+    detect_encoding();
+    detect_newline();
+    return true;
+}
+
+void TEMPLA_FILE::encode()
+{
+    TEMPLA_POOLED<binary_t> out;
+    if (m_raw && templa_is_utf16(m_encoding))
+        templa_encode_units(m_string16.data(), m_string16.size(), m_encoding == TE_UTF16BE,
+                            m_newline, m_bom, out.m_str);
+    else if (m_raw)
+        templa_encode_bytes(m_binary.data(), m_binary.size(), m_newline, m_bom, out.m_str);
+    else if (m_encoding != TE_BINARY)
+        templa_encode_text(m_string.data(), m_string.size(), m_encoding, m_newline, m_bom,
+                           out.m_str);
+    else
+        return;
+    m_binary.swap(out.m_str);
+}
+
+bool TEMPLA_FILE::save(const string_t& filename)
+{
+    encode();
+    return templa_save_file(filename, m_binary.data(), m_binary.size());
+}
+
+// A fast non-cryptographic 64-bit hash of contents that may arrive in
+// pieces, built like xxHash64: four lanes of 8 bytes, then the rest.
+struct TEMPLA_HASHER
+{
+    static const uint64_t P1 = 0x9E3779B185EBCA87ULL, P2 = 0xC2B2AE3D27D4EB4FULL,
+                          P3 = 0x165667B19E3779F9ULL, P4 = 0x85EBCA77C2B2AE63ULL;
+
+    uint64_t m_lanes[4] = { P1 + P2, P2, 0, 0 - P1 };
+    uint64_t m_size = 0;
+    uint8_t m_tail[32];
+
+    static uint64_t rotl(uint64_t value, int bits)
+    {
+        return (value << bits) | (value >> (64 - bits));
+    }
+
+    static uint64_t load(const uint8_t *p)
+    {
+        uint64_t value;
+        memcpy(&value, p, 8);
+        return value;
+    }
+
+    static uint64_t round(uint64_t lane, uint64_t value)
+    {
+        return rotl(lane + value * P2, 31) * P1;
+    }
+
+    void block(const uint8_t *p)
+    {
+        for (int i = 0; i < 4; ++i)
+            m_lanes[i] = round(m_lanes[i], load(p + 8 * i));
+    }
+
+    void update(const void *ptr, size_t size)
+    {
+        auto p = static_cast<const uint8_t*>(ptr);
+        size_t used = size_t(m_size % 32);
+        m_size += size;
+        if (used)
+        {
+            size_t count = std::min<size_t>(size, 32 - used);
+            memcpy(m_tail + used, p, count);
+            p += count;
+            size -= count;
+            if (used + count < 32)
+                return;
+            block(m_tail);
+        }
+        for (; size >= 32; p += 32, size -= 32)
+            block(p);
+        memcpy(m_tail, p, size);
+    }
+
+    uint64_t digest() const
+    {
+        uint64_t h = rotl(m_lanes[0], 1) + rotl(m_lanes[1], 7) +
+                     rotl(m_lanes[2], 12) + rotl(m_lanes[3], 18);
+        h += m_size;
+
+        size_t rest = size_t(m_size % 32), i = 0;
+        for (; i + 8 <= rest; i += 8)
+            h = rotl(h ^ round(0, load(m_tail + i)), 27) * P1 + P4;
+        for (; i < rest; ++i)
+            h = rotl(h ^ (m_tail[i] * P1), 11) * P2;
+
+        h ^= h >> 33;
+        h *= P2;
+        h ^= h >> 29;
+        h *= P3;
+        h ^= h >> 32;
+        return h;
+    }
+};
+
+static uint64_t templa_hash64(const void *ptr, size_t size)
+{
+    TEMPLA_HASHER hasher;
+    hasher.update(ptr, size);
+    return hasher.digest();
+}
+
+// What the last --incremental run made from each source file, kept in
+// TEMPLA_MANIFEST_NAME in the destination. A source is skipped if its
+// size and time (or contents) are as recorded, the mapping and the ignore
+// patterns are the same, and its output is still there.
+#define TEMPLA_MANIFEST_NAME L".templa-manifest"
+
+struct TEMPLA_MANIFEST_ENTRY
+{
+    uint64_t size = 0;
+    uint64_t mtime = 0;
+    uint64_t hash = 0;
+    uint64_t output_size = 0;
+    string_t output;
+};
+
+// The hash of what the outputs depend on besides the sources; a manifest
+// made with another one is not trusted.
+static uint64_t templa_manifest_config(const mapping_t& mapping, const string_list_t& ignore)
+{
+    TEMPLA_HASHER hasher;
+    auto add = [&](const string_t& str) {
+        hasher.update(str.data(), (str.size() + 1) * sizeof(wchar_t));
+    };
+    add(L"templa-manifest 2");
+    for (auto& pair : mapping)
+    {
+        add(pair.first);
+        add(pair.second);
+    }
+    add(L"");
+    for (auto& pattern : ignore)
+        add(pattern);
+    return hasher.digest();
+}
+
+struct TEMPLA_MANIFEST
+{
+    typedef std::unordered_map<string_t, TEMPLA_MANIFEST_ENTRY> map_t;
+
+    uint64_t m_config = 0;
+    bool m_valid = false;       // m_old was made with the same m_config
+    string_t m_root;            // the destination, ending with TEMPLA_PATH_SEP
+    map_t m_old, m_new;
+    std::mutex m_mutex;
+
+    TEMPLA_MANIFEST(uint64_t config, const string_t& root)
+        : m_config(config)
+        , m_root(root)
+    {
+    }
+
+    bool load(const string_t& filename);
+    bool save(const string_t& filename, const TEMPLA_OPTIONS& options);
+
+    // The entry of source if it can be trusted for output.
+    const TEMPLA_MANIFEST_ENTRY *find(const string_t& source, const string_t& output) const
+    {
+        if (!m_valid)
+            return NULL;
+        auto it = m_old.find(source);
+        if (it == m_old.end() || it->second.output != output)
+            return NULL;
+        return &it->second;
+    }
+
+    void record(const string_t& source, const TEMPLA_MANIFEST_ENTRY& entry)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_new[source] = entry;
+    }
+
+    void finish(const string_t& root, bool complete, string_list_t& removed);
+};
+
+// Whether output is a path relative to the destination that stays in it:
+// not absolute, and without "." or ".." parts.
+static bool templa_manifest_relative(const string_t& output)
+{
+    if (output.empty())
+        return false;
+#ifdef _WIN32
+    if (output.find_first_of(L":/") != string_t::npos)
+        return false;
+#endif
+
+    string_list_t parts;
+    str_split(parts, output, string_t(1, TEMPLA_PATH_SEP));
+    for (auto& part : parts)
+    {
+        if (part.empty() || part == L"." || part == L"..")
+            return false;
+    }
+    return true;
+}
+
+static bool templa_parse_hex(const char *& ptr, uint64_t& value)
+{
+    char *end;
+    value = strtoull(ptr, &end, 16);
+    if (end == ptr || *end != '\t')
+        return false;
+    ptr = end + 1;
+    return true;
+}
+
+// One line per source: size, time, hash and output size in hex, the
+// source and the output relative to m_root, separated by tabs. The first
+// line holds m_config. Outputs that would leave m_root are dropped.
+bool TEMPLA_MANIFEST::load(const string_t& filename)
+{
+    binary_t data;
+    if (!templa_load_file(filename, data))
+        return false;
+
+    string_list_t lines;
+    string_t text;
+    utf8_to_string(data.data(), data.size(), text, true);
+    str_split(lines, text, string_t(L"\n"));
+    if (lines.empty() || lines[0].compare(0, 16, L"templa-manifest\t") != 0)
+        return false;
+
+    m_valid = (wcstoull(lines[0].c_str() + 16, NULL, 16) == m_config);
+    for (size_t i = 1; i < lines.size(); ++i)
+    {
+        binary_t line;
+        string_to_utf8(lines[i].data(), lines[i].size(), line, true);
+
+        TEMPLA_MANIFEST_ENTRY entry;
+        const char *ptr = line.c_str();
+        if (!templa_parse_hex(ptr, entry.size) || !templa_parse_hex(ptr, entry.mtime) ||
+            !templa_parse_hex(ptr, entry.hash) || !templa_parse_hex(ptr, entry.output_size))
+        {
+            continue;
+        }
+
+        const char *tab = strchr(ptr, '\t');
+        if (!tab)
+            continue;
+
+        string_t source, output;
+        utf8_to_string(ptr, size_t(tab - ptr), source, true);
+        utf8_to_string(tab + 1, strlen(tab + 1), output, true);
+        if (!templa_manifest_relative(output))
+            continue;
+        entry.output = m_root + output;
+        m_old[source] = entry;
+    }
+    return true;
+}
+
+bool TEMPLA_MANIFEST::save(const string_t& filename, const TEMPLA_OPTIONS& options)
+{
+    binary_t data = "templa-manifest\t";
+    char buf[128];
+    snprintf(buf, sizeof(buf), "%llx\n", (unsigned long long)m_config);
+    data += buf;
+
+    binary_t source, output;
+    for (auto& pair : m_new)
+    {
+        auto& entry = pair.second;
+        if (pair.first.find_first_of(L"\t\n") != string_t::npos ||
+            entry.output.find_first_of(L"\t\n") != string_t::npos ||
+            entry.output.compare(0, m_root.size(), m_root) != 0 ||
+            !templa_manifest_relative(entry.output.substr(m_root.size())))
+        {
+            continue;   // not to be recorded; made again next time
+        }
+
+        string_to_utf8(pair.first.data(), pair.first.size(), source, true);
+        string_to_utf8(entry.output.data() + m_root.size(), entry.output.size() - m_root.size(),
+                       output, true);
+        snprintf(buf, sizeof(buf), "%llx\t%llx\t%llx\t%llx\t",
+                 (unsigned long long)entry.size, (unsigned long long)entry.mtime,
+                 (unsigned long long)entry.hash, (unsigned long long)entry.output_size);
+        data += buf;
+        data += source;
+        data += '\t';
+        data += output;
+        data += '\n';
+    }
+
+    std::string native;
+    return templa_save_file_at(templa_file_loc(filename, native), data.data(), data.size(), &options);
+}
+
+// Carry over the entries of other sources, and those under root that were
+// not reached if the run did not complete. Otherwise the outputs of the
+// sources under root that are gone (or now go elsewhere) are removed, and
+// added to removed; none are if the manifest was made with another config.
+void TEMPLA_MANIFEST::finish(const string_t& root, bool complete, string_list_t& removed)
+{
+    std::unordered_map<string_t, bool> outputs;
+    for (auto& pair : m_new)
+        outputs[pair.second.output] = true;
+
+    for (auto& pair : m_old)
+    {
+        auto& source = pair.first;
+        bool under_root = (source == root) ||
+                          (source.size() > root.size() && source.compare(0, root.size(), root) == 0 &&
+                           source[root.size()] == TEMPLA_PATH_SEP);
+        if (m_new.count(source))
+        {
+            // the output has been renamed
+            if (m_new[source].output == pair.second.output || outputs.count(pair.second.output))
+                continue;
+        }
+        else if (!under_root || !complete)
+        {
+            m_new[source] = pair.second;
+            if (!m_valid)
+                m_new[source].size = UINT64_MAX;  // keep the output, but make it again
+            continue;
+        }
+        else if (outputs.count(pair.second.output))
+        {
+            continue;
+        }
+
+        if (!m_valid)
+            continue;
+        std::string native;
+        if (templa_remove_file_at(templa_file_loc(pair.second.output, native)))
+            removed.push_back(pair.second.output);
+    }
+}
+
+// --dedup: the outputs made so far, by the identity of the source file
+// (for hard links to it) and by the size and hash of its contents. The
+// first source of each claims the key and publishes its output when done.
+enum TEMPLA_DEDUP_KIND
+{
+    TDK_FILE_ID,
+    TDK_CONTENTS,
+};
+
+struct TEMPLA_DEDUP
+{
+    typedef std::pair<uint64_t, uint64_t> key_t;
+
+    std::mutex m_mutex;
+    std::map<key_t, string_t> m_outputs[2];    // empty while being made
+
+    // The output made from key, if any. Otherwise claimed is set if the
+    // caller is the first to ask.
+    string_t find(TEMPLA_DEDUP_KIND kind, const key_t& key, bool& claimed)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        auto result = m_outputs[kind].insert(std::make_pair(key, string_t()));
+        claimed = result.second;
+        return result.first->second;
+    }
+
+    void publish(TEMPLA_DEDUP_KIND kind, const key_t& key, const string_t& output)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_outputs[kind][key] = output;
+    }
+};
+
+// --sync: the outputs of a run, made durable by finish. With TS_BATCH,
+// Linux syncs the file system of the destination in one call; elsewhere
+// each file is synced then. The folders are synced last, so that the
+// new names of the files are on the disk too.
+struct TEMPLA_SYNC_LIST
+{
+    TEMPLA_SYNC m_sync;
+    std::mutex m_mutex;
+    std::set<string_t> m_dirs;
+    std::vector<string_t> m_files;
+
+    explicit TEMPLA_SYNC_LIST(TEMPLA_SYNC sync) : m_sync(sync) { }
+
+    void add(const string_t& file)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_dirs.insert(dirname(file));
+#ifndef __linux__
+        if (m_sync == TS_BATCH)
+            m_files.push_back(file);
+#endif
+    }
+
+    bool finish(const string_t& destination)
+    {
+        bool ok = true;
+#ifdef _WIN32
+        for (auto& file : m_files)
+        {
+            HANDLE hFile = CreateFileW(file.c_str(), GENERIC_WRITE, FILE_SHARE_READ, NULL,
+                                       OPEN_EXISTING, 0, NULL);
+            if (hFile == INVALID_HANDLE_VALUE)
+                continue;   // removed since
+            ok = FlushFileBuffers(hFile) && ok;
+            CloseHandle(hFile);
+        }
+        (void)destination;  // the folders are journaled by NTFS
+#else
+#ifdef __linux__
+        if (m_sync == TS_BATCH)
+        {
+            int fd = open(string_to_native(destination).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            ok = fd >= 0 && syncfs(fd) == 0;
+            if (fd >= 0)
+                close(fd);
+            return ok;
+        }
+#else
+        (void)destination;
+#endif
+        for (auto& file : m_files)
+        {
+            int fd = open(string_to_native(file).c_str(), O_RDONLY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            ok = fsync(fd) == 0 && ok;
+            close(fd);
+        }
+        for (auto& dir : m_dirs)
+        {
+            int fd = open(dir.empty() ? "." : string_to_native(dir).c_str(),
+                          O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (fd < 0)
+                continue;
+            ok = fsync(fd) == 0 && ok;
+            close(fd);
+        }
+#endif
+        return ok;
+    }
+};
+
+#define TEMPLA_STATS_TOP 10    // the largest and the slowest files kept
+
+// The counters of one thread for TEMPLA_OPTIONS::stats. replacements is by
+// the index of the key in the mapping.
+struct TEMPLA_THREAD_STATS
+{
+    uint64_t phase_ns[TP_COUNT] = { 0 };
+    uint64_t files = 0;
+    uint64_t skipped = 0;
+    uint64_t ignored = 0;
+    uint64_t encodings[6] = { 0 };
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    std::vector<uint64_t> replacements;
+    std::vector<std::pair<string_t, uint64_t> > largest, slowest;
+};
+
+static uint64_t templa_now_ns(void)
+{
+    return uint64_t(std::chrono::duration_cast<std::chrono::nanoseconds>(
+        std::chrono::steady_clock::now().time_since_epoch()).count());
+}
+
+// Keep the TEMPLA_STATS_TOP largest values of top, the largest first.
+static void
+templa_stats_top(std::vector<std::pair<string_t, uint64_t> >& top, const string_t& name,
+                 uint64_t value)
+{
+    if (top.size() >= TEMPLA_STATS_TOP && top.back().second >= value)
+        return;
+    auto it = top.begin();
+    while (it != top.end() && it->second >= value)
+        ++it;
+    top.insert(it, std::make_pair(name, value));
+    if (top.size() > TEMPLA_STATS_TOP)
+        top.pop_back();
+}
+
+// The stats of a run. Each thread counts into its own TEMPLA_THREAD_STATS,
+// found through a thread_local cache, so the threads share nothing while
+// they work; merge() adds them up at the end.
+class TEMPLA_STATS_COLLECTOR
+{
+public:
+    explicit TEMPLA_STATS_COLLECTOR(size_t keys)
+        : m_id(++s_last_id)
+        , m_keys(keys)
+        , m_start(templa_now_ns())
+    {
+    }
+
+    TEMPLA_THREAD_STATS& local()
+    {
+        if (s_cache_id != m_id)
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_threads.emplace_back(new TEMPLA_THREAD_STATS);
+            m_threads.back()->replacements.resize(m_keys);
+            s_cache = m_threads.back().get();
+            s_cache_id = m_id;
+        }
+        return *s_cache;
+    }
+
+    // Call it after the threads are done. Runs that overlap may share stats.
+    void merge(TEMPLA_STATS& stats, const mapping_t& mapping) const
+    {
+        static std::mutex s_mutex;
+        std::lock_guard<std::mutex> lock(s_mutex);
+        stats.elapsed_ns += templa_now_ns() - m_start;
+        for (auto& thread : m_threads)
+        {
+            for (size_t i = 0; i < TP_COUNT; ++i)
+                stats.phase_ns[i] += thread->phase_ns[i];
+            stats.files += thread->files;
+            stats.skipped += thread->skipped;
+            stats.ignored += thread->ignored;
+            for (size_t i = 0; i < 6; ++i)
+                stats.encodings[i] += thread->encodings[i];
+            stats.bytes_in += thread->bytes_in;
+            stats.bytes_out += thread->bytes_out;
+
+            // the matchers count by the index of the key in mapping
+            size_t key = 0;
+            for (auto& pair : mapping)
+            {
+                if (thread->replacements[key])
+                    stats.replacements[pair.first] += thread->replacements[key];
+                ++key;
+            }
+
+            for (auto& pair : thread->largest)
+                templa_stats_top(stats.largest, pair.first, pair.second);
+            for (auto& pair : thread->slowest)
+                templa_stats_top(stats.slowest, pair.first, pair.second);
+        }
+    }
+
+protected:
+    uint64_t m_id;
+    size_t m_keys;
+    uint64_t m_start;
+    std::mutex m_mutex;
+    std::vector<std::unique_ptr<TEMPLA_THREAD_STATS> > m_threads;
+
+    static std::atomic<uint64_t> s_last_id;
+    static thread_local uint64_t s_cache_id;
+    static thread_local TEMPLA_THREAD_STATS *s_cache;
+};
+
+std::atomic<uint64_t> TEMPLA_STATS_COLLECTOR::s_last_id(0);
+thread_local uint64_t TEMPLA_STATS_COLLECTOR::s_cache_id = 0;
+thread_local TEMPLA_THREAD_STATS *TEMPLA_STATS_COLLECTOR::s_cache = NULL;
+
+// Adds the time to a phase of stats, if it is set; next() goes on to
+// another phase, or starts again after stop(). Without stats, the clock
+// is not read.
+class TEMPLA_PHASE_TIMER
+{
+public:
+    TEMPLA_PHASE_TIMER(TEMPLA_THREAD_STATS *stats, TEMPLA_PHASE phase)
+        : m_stats(stats)
+        , m_phase(phase)
+        , m_start(stats ? templa_now_ns() : 0)
+    {
+    }
+
+    ~TEMPLA_PHASE_TIMER()
+    {
+        stop();
+    }
+
+    void next(TEMPLA_PHASE phase)
+    {
+        if (!m_stats)
+            return;
+        uint64_t now = templa_now_ns();
+        if (m_phase != TP_COUNT)
+            m_stats->phase_ns[m_phase] += now - m_start;
+        m_phase = phase;
+        m_start = now;
+    }
+
+    void stop()
+    {
+        if (m_stats && m_phase != TP_COUNT)
+            m_stats->phase_ns[m_phase] += templa_now_ns() - m_start;
+        m_phase = TP_COUNT;
+    }
+
+protected:
+    TEMPLA_THREAD_STATS *m_stats;
+    TEMPLA_PHASE m_phase;
+    uint64_t m_start;
+};
+
+// Count a file that was converted or copied; ns is the time it took.
+static void
+templa_stats_file(TEMPLA_THREAD_STATS *stats, const string_t& file1, TEMPLA_ENCODING encoding,
+                  uint64_t bytes_in, uint64_t bytes_out, uint64_t ns)
+{
+    if (!stats)
+        return;
+    ++stats->files;
+    ++stats->encodings[encoding];
+    stats->bytes_in += bytes_in;
+    stats->bytes_out += bytes_out;
+    templa_stats_top(stats->largest, file1, bytes_in);
+    templa_stats_top(stats->slowest, file1, ns);
+}
+
+static void templa_vappend(std::string& str, const char *fmt, va_list va)
+{
+    va_list va2;
+    va_copy(va2, va);
+    int cch = vsnprintf(NULL, 0, fmt, va2);
+    va_end(va2);
+    if (cch > 0)
+    {
+        size_t size = str.size();
+        str.resize(size + cch + 1);
+        vsnprintf(&str[size], cch + 1, fmt, va);
+        str.resize(size + cch);
+    }
+}
+
+static void templa_append(std::string& str, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    templa_vappend(str, fmt, va);
+    va_end(va);
+}
+
+#define TEMPLA_LOG_BUFFER (256 * 1024)
+#define TEMPLA_REPORT_INTERVAL (100 * 1000 * 1000)  // nanoseconds
+
+// TR_LOG: the log is written when TEMPLA_LOG_BUFFER bytes are pending, or
+// at most TEMPLA_REPORT_INTERVAL after a line comes, so a terminal still
+// follows. A thread of its own writes the lines that nothing comes after.
+class TEMPLA_LOG_REPORTER : public TEMPLA_REPORTER
+{
+public:
+    TEMPLA_LOG_REPORTER()
+        : m_thread(&TEMPLA_LOG_REPORTER::run, this)
+    {
+    }
+
+    ~TEMPLA_LOG_REPORTER()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_one();
+        m_thread.join();
+        write();
+    }
+
+    void log(const char *text, size_t size)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        uint64_t now = templa_now_ns();
+        if (m_buffer.empty())
+        {
+            m_pending = now;
+            m_wake.notify_one();
+        }
+        m_buffer.append(text, size);
+        if (m_buffer.size() >= TEMPLA_LOG_BUFFER || now - m_written >= TEMPLA_REPORT_INTERVAL)
+            write();
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        write();
+    }
+
+protected:
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::string m_buffer;
+    uint64_t m_written = 0;
+    uint64_t m_pending = 0;     // when m_buffer stopped being empty
+    bool m_quit = false;
+    std::thread m_thread;       // last, as it uses the others
+
+    // With m_mutex locked.
+    void write()
+    {
+        fwrite(m_buffer.data(), 1, m_buffer.size(), stdout);
+        fflush(stdout);
+        m_buffer.clear();
+        m_written = templa_now_ns();
+    }
+
+    void run()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        while (!m_quit)
+        {
+            if (m_buffer.empty())
+            {
+                m_wake.wait(lock);
+                continue;
+            }
+
+            uint64_t elapsed = templa_now_ns() - m_pending;
+            if (elapsed >= TEMPLA_REPORT_INTERVAL)
+                write();
+            else
+                m_wake.wait_for(lock, std::chrono::nanoseconds(TEMPLA_REPORT_INTERVAL - elapsed));
+        }
+    }
+};
+
+class TEMPLA_QUIET_REPORTER : public TEMPLA_REPORTER
+{
+public:
+    void log(const char *, size_t)
+    {
+    }
+};
+
+// TR_PROGRESS: the line is drawn again at most every TEMPLA_REPORT_INTERVAL,
+// by whichever thread finishes a file then.
+class TEMPLA_PROGRESS_REPORTER : public TEMPLA_REPORTER
+{
+public:
+    TEMPLA_PROGRESS_REPORTER()
+        : m_files(0), m_bytes(0), m_total_files(0), m_total_bytes(0)
+        , m_start(templa_now_ns()), m_drawn(0)
+    {
+    }
+
+    void log(const char *, size_t)
+    {
+    }
+
+    void total(uint64_t files, uint64_t bytes)
+    {
+        m_total_files += files;
+        m_total_bytes += bytes;
+    }
+
+    void file_done(uint64_t bytes)
+    {
+        ++m_files;
+        m_bytes += bytes;
+
+        uint64_t now = templa_now_ns();
+        if (now - m_drawn < TEMPLA_REPORT_INTERVAL)
+            return;
+        std::unique_lock<std::mutex> lock(m_mutex, std::try_to_lock);
+        if (lock.owns_lock() && now - m_drawn >= TEMPLA_REPORT_INTERVAL)
+            draw(now);
+    }
+
+    void flush()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (m_files)
+        {
+            draw(templa_now_ns());
+            fputc('\n', stderr);
+        }
+        m_width = 0;
+    }
+
+protected:
+    std::atomic<uint64_t> m_files, m_bytes, m_total_files, m_total_bytes;
+    uint64_t m_start;
+    std::atomic<uint64_t> m_drawn;
+    std::mutex m_mutex;
+    size_t m_width = 0;
+
+    void draw(uint64_t now)
+    {
+        m_drawn = now;
+        uint64_t files = m_files, bytes = m_bytes;
+        uint64_t total_files = m_total_files, total_bytes = m_total_bytes;
+        double seconds = (now - m_start) / 1e9, rate = seconds > 0 ? bytes / seconds : 0;
+
+        std::string line;
+        templa_append(line, "%llu", (unsigned long long)files);
+        if (total_files)
+            templa_append(line, "/%llu", (unsigned long long)total_files);
+        templa_append(line, " files, %.1f", bytes / 1048576.0);
+        if (total_files)
+            templa_append(line, "/%.1f", total_bytes / 1048576.0);
+        templa_append(line, " MiB, %.1f MiB/s", rate / 1048576.0);
+        if (total_files && rate > 0 && total_bytes > bytes)
+        {
+            unsigned eta = unsigned((total_bytes - bytes) / rate + 0.5);
+            templa_append(line, ", ETA %u:%02u", eta / 60, eta % 60);
+        }
+
+        // blank out the rest of a longer line
+        size_t width = line.size();
+        if (line.size() < m_width)
+            line.append(m_width - line.size(), ' ');
+        m_width = width;
+        fprintf(stderr, "\r%s", line.c_str());
+        fflush(stderr);
+    }
+};
+
+std::unique_ptr<TEMPLA_REPORTER> templa_new_reporter(TEMPLA_REPORT report)
+{
+    switch (report)
+    {
+    case TR_QUIET:
+        return std::unique_ptr<TEMPLA_REPORTER>(new TEMPLA_QUIET_REPORTER);
+    case TR_PROGRESS:
+        return std::unique_ptr<TEMPLA_REPORTER>(new TEMPLA_PROGRESS_REPORTER);
+    case TR_LOG:
+        break;
+    }
+    return std::unique_ptr<TEMPLA_REPORTER>(new TEMPLA_LOG_REPORTER);
+}
+
+// The mapping and the ignore patterns, compiled once for any number of
+// runs (see TEMPLA_JOB). It is not changed after it is made.
+struct TEMPLA_COMPILED
+{
+    mapping_t mapping;
+    TEMPLA_GLOBSET ignore;
+    templa_matcher_t matcher;           // filenames and decoded text
+    TEMPLA_MATCHER<char> matcher8;      // UTF-8 and ASCII bytes
+    TEMPLA_MATCHER<char16_t> matcher16; // UTF-16 code units
+    bool ascii_values = true;           // no replacement needs non-ASCII
+    uint64_t manifest_config;           // see TEMPLA_MANIFEST
+
+    TEMPLA_COMPILED(const mapping_t& mapping_, const string_list_t& ignore_)
+        : mapping(mapping_)
+        , ignore(ignore_)
+        , manifest_config(templa_manifest_config(mapping_, ignore_))
+    {
+        templa_compile_mapping(matcher, mapping);
+        templa_compile_mapping(matcher8, mapping);
+        templa_compile_mapping(matcher16, mapping);
+        for (auto& pair : mapping)
+        {
+            for (auto ch : pair.second)
+            {
+                if (uint32_t(ch) >= 0x80)
+                    ascii_values = false;
+            }
+        }
+    }
+};
+
+// What a run needs, prepared once by templa() and shared by every entry.
+struct TEMPLA_CONTEXT
+{
+    std::shared_ptr<const TEMPLA_COMPILED> compiled;
+    const TEMPLA_GLOBSET& ignore;
+    const TEMPLA_OPTIONS& options;
+    templa_canceler_t canceler;
+    templa_callback_t callback = NULL;  // with callback_data (TEMPLA_JOB)
+    void *callback_data = NULL;
+    const templa_matcher_t& matcher;
+    const TEMPLA_MATCHER<char>& matcher8;
+    const TEMPLA_MATCHER<char16_t>& matcher16;
+    bool ascii_values;
+    TEMPLA_MANIFEST *manifest = NULL;   // --incremental
+    TEMPLA_DEDUP *dedup = NULL;         // --dedup
+    TEMPLA_SYNC_LIST *sync_list = NULL; // --sync
+    TEMPLA_JOB_SHARED *job = NULL;      // the thread pool of a TEMPLA_JOB
+    mutable TEMPLA_COPY_SUPPORT copy_support;
+    std::unique_ptr<TEMPLA_STATS_COLLECTOR> stats;  // if options.stats
+    TEMPLA_REPORTER *reporter;          // options.reporter, or own_reporter
+    std::unique_ptr<TEMPLA_REPORTER> own_reporter;
+    mutable std::atomic<uint64_t> files_done, bytes_done;   // for callback
+
+    TEMPLA_CONTEXT(const std::shared_ptr<const TEMPLA_COMPILED>& compiled_,
+                   const TEMPLA_OPTIONS& options_, templa_canceler_t canceler_,
+                   TEMPLA_REPORTER *reporter_ = NULL)
+        : compiled(compiled_)
+        , ignore(compiled_->ignore)
+        , options(options_)
+        , canceler(canceler_)
+        , matcher(compiled_->matcher)
+        , matcher8(compiled_->matcher8)
+        , matcher16(compiled_->matcher16)
+        , ascii_values(compiled_->ascii_values)
+        , reporter(reporter_ ? reporter_ : options_.reporter)
+        , files_done(0)
+        , bytes_done(0)
+    {
+        if (options.stats)
+            stats.reset(new TEMPLA_STATS_COLLECTOR(compiled->mapping.size()));
+        if (!reporter)
+        {
+            own_reporter = templa_new_reporter(TR_LOG);
+            reporter = own_reporter.get();
+        }
+    }
+
+    TEMPLA_CONTEXT(const mapping_t& mapping, const string_list_t& ignore_,
+                   const TEMPLA_OPTIONS& options_, templa_canceler_t canceler_)
+        : TEMPLA_CONTEXT(std::make_shared<TEMPLA_COMPILED>(mapping, ignore_), options_, canceler_)
+    {
+    }
+
+    ~TEMPLA_CONTEXT()
+    {
+        reporter->flush();
+    }
+
+    bool canceled() const
+    {
+        if (canceler && canceler())
+            return true;
+        return callback && callback(callback_data, files_done, bytes_done);
+    }
+
+    // A file is converted, copied or up to date.
+    void file_done(uint64_t bytes) const
+    {
+        if (callback)
+        {
+            ++files_done;
+            bytes_done += bytes;
+        }
+        reporter->file_done(bytes);
+    }
+
+    // The counters of the calling thread, or NULL without stats.
+    TEMPLA_THREAD_STATS *thread_stats() const
+    {
+        return stats ? &stats->local() : NULL;
+    }
+};
+
+static void
+templa_map_filename(string_t& filename, const templa_matcher_t& matcher)
+{
+    matcher.replace(filename);
+    templa_validate_filename(filename);
+}
+
+// Append to log if it is given, or else pass to the reporter of the run.
+static void templa_log(const TEMPLA_CONTEXT& context, std::string *log, const char *fmt, ...)
+{
+    va_list va;
+    va_start(va, fmt);
+    if (log)
+    {
+        templa_vappend(*log, fmt, va);
+    }
+    else
+    {
+        std::string text;
+        templa_vappend(text, fmt, va);
+        context.reporter->log(text.data(), text.size());
+    }
+    va_end(va);
+}
+
+static const char *templa_encoding_name(TEMPLA_ENCODING encoding)
+{
+    switch (encoding)
+    {
+    case TE_BINARY: return "binary";
+    case TE_UTF8: return "UTF-8";
+    case TE_UTF16: return "UTF-16";
+    case TE_UTF16BE: return "UTF-16 BE";
+    case TE_ANSI: return "ANSI";
+    case TE_ASCII: return "ASCII";
+    }
+    return "";
+}
+
+// The length of the longest prefix of ptr[0, size) that does not end in
+// the middle of a character.
+static size_t templa_decodable_size(TEMPLA_ENCODING encoding, const char *ptr, size_t size)
+{
+    auto p = reinterpret_cast<const uint8_t*>(ptr);
+    switch (encoding)
+    {
+    case TE_UTF16:
+    case TE_UTF16BE:
+        size &= ~size_t(1);
+        if (size >= 2)
+        {
+            uint32_t last = (encoding == TE_UTF16BE) ? ((p[size - 2] << 8) | p[size - 1])
+                                                     : (p[size - 2] | (p[size - 1] << 8));
+            if (0xD800 <= last && last <= 0xDBFF)
+                size -= 2;
+        }
+        return size;
+
+    case TE_UTF8:
+        for (size_t back = 1; back <= 3 && back <= size; ++back)
+        {
+            uint8_t byte = p[size - back];
+            if ((byte & 0xC0) == 0x80)
+                continue;
+            size_t len = (byte >= 0xF0) ? 4 : (byte >= 0xE0) ? 3 : (byte >= 0xC0) ? 2 : 1;
+            return (len > back) ? size - back : size;
+        }
+        return size;
+
+#ifdef _WIN32
+    case TE_ANSI:
+    case TE_ASCII:
+        {
+            size_t i = 0;
+            while (i < size)
+                i += IsDBCSLeadByte(p[i]) ? 2 : 1;
+            return (i > size) ? size - 1 : size;
+        }
+#endif
+
+    default:
+        return size;
+    }
+}
+
+// The replace stage of a stream. Text is appended to m_input; process
+// moves what is final to out, keeping back the units that a key could
+// still span and a CR that may start a CR LF.
+template <typename T_CHAR>
+struct TEMPLA_TEXT_STREAM
+{
+    typedef std::basic_string<T_CHAR> string_type;
+
+    const TEMPLA_MATCHER<T_CHAR>& m_matcher;
+    string_type m_input;
+    bool m_cr = false;
+
+    explicit TEMPLA_TEXT_STREAM(const TEMPLA_MATCHER<T_CHAR>& matcher)
+        : m_matcher(matcher)
+    {
+    }
+
+    void process(bool last, string_type& out, uint64_t *counts = NULL)
+    {
+        out.clear();
+        if (m_cr)
+            out += T_CHAR('\r');
+        m_cr = false;
+
+        size_t keep = m_matcher.max_length() ? m_matcher.max_length() - 1 : 0;
+        size_t limit = m_input.size();
+        if (!last)
+            limit = (limit > keep) ? limit - keep : 0;
+
+        size_t done = m_matcher.replace_stream(m_input.data(), m_input.size(), limit, out, counts);
+        m_input.erase(0, done);
+
+        if (!last && !out.empty() && out[out.size() - 1] == T_CHAR('\r'))
+        {
+            out.resize(out.size() - 1);
+            m_cr = true;
+        }
+    }
+};
+
+#define TEMPLA_STREAM_SAMPLE (64 * 1024)
+#define TEMPLA_STREAM_CHUNK (1024 * 1024)
+
+// Convert a large file chunk by chunk, so that the memory use does not
+// depend on the file size. The encoding and the newline are detected from
+// the first TEMPLA_STREAM_SAMPLE bytes.
+static TEMPLA_RET
+templa_file_stream(const string_t& file1, const string_t& file2, TEMPLA_READER& reader,
+                   TEMPLA_FILE_LOC loc2, const TEMPLA_CONTEXT& context, std::string *log,
+                   TEMPLA_HASHER *hasher)
+{
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    uint64_t start = stats ? templa_now_ns() : 0;
+    uint64_t *counts = stats ? stats->replacements.data() : NULL;
+    TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+
+    binary_t pending(TEMPLA_STREAM_SAMPLE, 0);
+    ptrdiff_t got = reader.read(&pending[0], pending.size());
+    if (got < 0)
+    {
+        fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+    bool eof = (size_t(got) < pending.size());
+    pending.resize(size_t(got));
+    if (hasher)
+        hasher->update(pending.data(), pending.size());
+
+    TEMPLA_FILE file;
+    {
+        // don't let a character cut at the end of the sample decide
+        size_t size = pending.size();
+        while (!eof)
+        {
+            size_t cut = templa_decodable_size(TE_UTF8, pending.data(), size) & ~size_t(1);
+            if (cut == size)
+                break;
+            size = cut;
+        }
+        file.m_binary.assign(pending, 0, size);
+    }
+    timer.next(TP_DETECT);
+    file.m_raw = !context.options.force_decode;
+    file.detect_encoding();
+    if (file.m_raw && file.m_encoding == TE_ASCII && !context.ascii_values)
+    {
+        file.m_raw = false;
+        file.decode();      // detect_newline looks at the text then
+    }
+    timer.next(TP_NEWLINE);
+    file.detect_newline();
+    timer.next(TP_WRITE);
+    file.m_binary.clear();
+    file.m_string.clear();
+    file.m_string16.clear();
+
+    TEMPLA_ENCODING encoding = file.m_encoding;
+    if (file.m_bom)
+        pending.erase(0, (encoding == TE_UTF8) ? 3 : 2);
+
+    templa_log(context, log, "%ls --> %ls [%s]\n", file1.c_str(), file2.c_str(),
+               templa_encoding_name(encoding));
+
+    TEMPLA_WRITER writer;
+    if (!writer.open(loc2, &context.options))
+    {
+        fprintf(stderr, "ERROR: Cannot write file '%ls'\n", file2.c_str());
+        return TEMPLA_RET_WRITEERROR;
+    }
+
+    bool ok = true;
+    uint64_t written = 0;
+    if (file.m_bom)
+    {
+        size_t bom_size;
+        const char *bom = templa_bom(encoding, bom_size);
+        ok = writer.write(bom, bom_size);
+        written += bom_size;
+    }
+
+    TEMPLA_TEXT_STREAM<char> bytes(context.matcher8);
+    TEMPLA_TEXT_STREAM<char16_t> units(context.matcher16);
+    TEMPLA_TEXT_STREAM<wchar_t> text(context.matcher);
+    binary_t replaced8, out8;
+    std::u16string replaced16;
+    string_t replaced;
+
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    while (ok)
+    {
+        if (context.canceled())
+        {
+            ret = TEMPLA_RET_CANCELED;
+            break;
+        }
+
+        if (!eof && pending.size() < TEMPLA_STREAM_CHUNK)
+        {
+            timer.next(TP_READ);
+            size_t size = pending.size();
+            pending.resize(TEMPLA_STREAM_CHUNK);
+            got = reader.read(&pending[size], pending.size() - size);
+            if (got < 0)
+            {
+                fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
+                ret = TEMPLA_RET_READERROR;
+                break;
+            }
+            eof = (size + size_t(got) < pending.size());
+            pending.resize(size + size_t(got));
+            if (hasher)
+                hasher->update(pending.data() + size, size_t(got));
+        }
+
+        if (encoding == TE_BINARY)
+        {
+            timer.next(TP_WRITE);
+            ok = writer.write(pending.data(), pending.size());
+            written += pending.size();
+            pending.clear();
+        }
+        else if (file.m_raw && templa_is_utf16(encoding))
+        {
+            timer.next(TP_DECODE);
+            size_t size = eof ? pending.size() : (pending.size() & ~size_t(1));
+            TEMPLA_POOLED<std::u16string> decoded;
+            utf16_to_units(pending.data(), size, encoding == TE_UTF16BE, decoded.m_str);
+            units.m_input += decoded.m_str;
+            pending.erase(0, size);
+            timer.next(TP_REPLACE);
+            units.process(eof, replaced16, counts);
+            timer.next(TP_ENCODE);
+            templa_encode_units(replaced16.data(), replaced16.size(), encoding == TE_UTF16BE,
+                                file.m_newline, false, out8);
+            timer.next(TP_WRITE);
+            ok = writer.write(out8.data(), out8.size());
+            written += out8.size();
+        }
+        else if (file.m_raw)
+        {
+            timer.next(TP_REPLACE);
+            bytes.m_input += pending;
+            pending.clear();
+            bytes.process(eof, replaced8, counts);
+            timer.next(TP_ENCODE);
+            templa_encode_bytes(replaced8.data(), replaced8.size(), file.m_newline, false, out8);
+            timer.next(TP_WRITE);
+            ok = writer.write(out8.data(), out8.size());
+            written += out8.size();
+        }
+        else
+        {
+            timer.next(TP_DECODE);
+            size_t size = pending.size();
+            if (!eof)
+                size = templa_decodable_size(encoding, pending.data(), size);
+            TEMPLA_POOLED<string_t> decoded;
+            binary_to_string(encoding, pending.data(), size, decoded.m_str);
+            text.m_input += decoded.m_str;
+            pending.erase(0, size);
+            timer.next(TP_REPLACE);
+            text.process(eof, replaced, counts);
+            timer.next(TP_ENCODE);
+            templa_encode_text(replaced.data(), replaced.size(), encoding, file.m_newline,
+                               false, out8);
+            timer.next(TP_WRITE);
+            ok = writer.write(out8.data(), out8.size());
+            written += out8.size();
+        }
+
+        if (eof)
+            break;
+    }
+
+    timer.next(TP_WRITE);
+    if (!writer.close(ok && ret == TEMPLA_RET_OK))
+        ok = false;
+    timer.stop();
+
+    if (!ok && ret == TEMPLA_RET_OK)
+    {
+        fprintf(stderr, "ERROR: Cannot write file '%ls'\n", file2.c_str());
+        ret = TEMPLA_RET_WRITEERROR;
+    }
+
+    // an atomic write leaves the last output as it was
+    if (ret != TEMPLA_RET_OK && !context.options.atomic)
+        templa_remove_file_at(loc2);
+
+    if (ret == TEMPLA_RET_OK && stats)
+        templa_stats_file(stats, file1, encoding, reader.m_size, written, templa_now_ns() - start);
+    if (ret == TEMPLA_RET_OK)
+        context.file_done(reader.m_size);
+    return ret;
+}
+
+static void
+templa_record(const string_t& file1, TEMPLA_FILE_LOC loc2, TEMPLA_MANIFEST_ENTRY& entry,
+              const TEMPLA_CONTEXT& context)
+{
+    if (templa_file_size_at(loc2, entry.output_size))
+        context.manifest->record(file1, entry);
+}
+
+static TEMPLA_RET
+templa_up_to_date(const string_t& file1, TEMPLA_MANIFEST_ENTRY& entry,
+                  const TEMPLA_MANIFEST_ENTRY& last, const TEMPLA_CONTEXT& context,
+                  std::string *log)
+{
+    templa_log(context, log, "%ls --> %ls [up to date]\n", file1.c_str(), entry.output.c_str());
+    if (context.stats)
+        ++context.thread_stats()->skipped;
+    context.file_done(entry.size);
+    entry.hash = last.hash;
+    entry.output_size = last.output_size;
+    context.manifest->record(file1, entry);
+    return TEMPLA_RET_OK;
+}
+
+static void templa_written(const string_t& file2, const TEMPLA_CONTEXT& context)
+{
+    if (context.sync_list)
+        context.sync_list->add(file2);
+}
+
+// Make loc2 from output, made before from the same contents: a hard link
+// if asked, or else a clone or a copy.
+static bool
+templa_copy_output(const string_t& output, TEMPLA_FILE_LOC loc2, const TEMPLA_CONTEXT& context)
+{
+    const TEMPLA_OPTIONS& options = context.options;
+    std::string native;
+    TEMPLA_FILE_LOC loc1 = templa_file_loc(output, native);
+
+    // loc2 may be a link to output made by the last run
+    if (options.hardlinks || !options.atomic)
+        templa_remove_file_at(loc2);
+    if (options.hardlinks)
+    {
+#ifdef _WIN32
+        if (CreateHardLinkW(loc2.path, loc1.path, NULL))
+            return true;
+#else
+        if (linkat(loc1.dirfd, loc1.name, loc2.dirfd, loc2.name, 0) == 0)
+            return true;
+#endif
+    }
+
+    TEMPLA_READER reader;
+    TEMPLA_VIEW view;
+    return reader.open(loc1) && view.load(reader) &&
+           templa_copy_file_at(loc1, reader, view, loc2, &options, &context.copy_support);
+}
+
+// Try to make the output of a duplicate source from an earlier output.
+static bool
+templa_file_dedup(const string_t& file1, const string_t& file2, const string_t& output,
+                  TEMPLA_FILE_LOC loc2, TEMPLA_MANIFEST_ENTRY& entry,
+                  const TEMPLA_CONTEXT& context, std::string *log)
+{
+    if (output.empty() || output == file2 ||
+        !templa_copy_output(output, loc2, context))
+        return false;
+    templa_written(file2, context);
+
+    templa_log(context, log, "%ls --> %ls [same as %ls]\n", file1.c_str(), file2.c_str(),
+               output.c_str());
+    if (context.stats)
+        ++context.thread_stats()->skipped;
+    context.file_done(entry.size);
+    if (context.manifest)
+        templa_record(file1, loc2, entry, context);
+    return true;
+}
+
+// Detect the encoding of the contents and replace the keys. Returns false
+// if the output would be the same as the input.
+static bool
+templa_convert(const char *ptr, size_t size, const TEMPLA_CONTEXT& context, TEMPLA_FILE& file)
+{
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    uint64_t *counts = stats ? stats->replacements.data() : NULL;
+    TEMPLA_PHASE_TIMER timer(stats, TP_DETECT);
+
+    file.m_encoding = templa_detect_encoding(ptr, size, file.m_bom);
+
+    size_t skip = 0;
+    if (file.m_bom)
+        skip = (file.m_encoding == TE_UTF8) ? 3 : 2;
+    ptr += skip;
+    size -= skip;
+
+    // ASCII files are written in the ANSI code page if a value needs it;
+    // UTF-16 is replaced in code units, without decoding the pairs
+    file.m_raw = !context.options.force_decode &&
+                 (file.m_encoding == TE_UTF8 || templa_is_utf16(file.m_encoding) ||
+                  (file.m_encoding == TE_ASCII && context.ascii_values));
+
+    bool changed = false, uniform;
+    if (file.m_raw && templa_is_utf16(file.m_encoding))
+    {
+        timer.next(TP_DECODE);
+        utf16_to_units(ptr, size, file.m_encoding == TE_UTF16BE, file.m_string16);
+        timer.next(TP_NEWLINE);
+        file.m_newline = templa_scan_newlines(file.m_string16.data(), file.m_string16.size(),
+                                              uniform);
+        timer.next(TP_REPLACE);
+        changed = context.matcher16.replace(file.m_string16, counts) > 0 || !uniform;
+    }
+    else if (file.m_raw)
+    {
+        timer.next(TP_NEWLINE);
+        file.m_newline = templa_scan_newlines(ptr, size, uniform);
+        timer.next(TP_REPLACE);
+        changed = context.matcher8.replace(ptr, size, file.m_binary, counts) > 0;
+        if (!changed && !uniform)
+            file.m_binary.assign(ptr, size);
+        changed = changed || !uniform;
+    }
+    else if (file.m_encoding != TE_BINARY)
+    {
+        timer.next(TP_DECODE);
+        binary_to_string(file.m_encoding, ptr, size, file.m_string);
+        timer.next(TP_NEWLINE);
+        file.m_newline = templa_scan_newlines(file.m_string.data(), file.m_string.size(), uniform);
+        timer.next(TP_REPLACE);
+        changed = context.matcher.replace(file.m_string, counts) > 0 || !uniform;
+    }
+    return changed;
+}
+
+static TEMPLA_RET
+templa_file(const string_t& file1, const string_t& file2, const string_t& basename1,
+            TEMPLA_FILE_LOC loc1, TEMPLA_FILE_LOC loc2, const TEMPLA_CONTEXT& context,
+            std::string *log = NULL)
+{
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    if (context.ignore.match(basename1))
+    {
+        templa_log(context, log, "%ls [ignored]\n", file1.c_str());
+        if (stats)
+            ++stats->ignored;
+        return TEMPLA_RET_OK;
+    }
+
+    uint64_t start = stats ? templa_now_ns() : 0;
+    TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+    TEMPLA_READER reader;
+    if (!reader.open(loc1))
+    {
+        fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+    timer.stop();
+
+    TEMPLA_MANIFEST_ENTRY entry;
+    entry.size = reader.m_size;
+    const TEMPLA_MANIFEST_ENTRY *last = NULL;
+    if (context.manifest)
+    {
+        entry.mtime = reader.m_mtime;
+        entry.output = file2;
+        last = context.manifest->find(file1, file2);
+
+        uint64_t output_size;
+        if (last && (!templa_file_size_at(loc2, output_size) || output_size != last->output_size))
+            last = NULL;
+        if (last && last->size == entry.size && last->mtime == entry.mtime)
+            return templa_up_to_date(file1, entry, *last, context, log);
+    }
+
+    // hard links to one file are made once
+    TEMPLA_DEDUP::key_t file_id(reader.m_id[0], reader.m_id[1]), contents;
+    bool file_id_claimed = false, contents_claimed = false;
+    if (context.dedup && reader.m_links > 1)
+    {
+        auto output = context.dedup->find(TDK_FILE_ID, file_id, file_id_claimed);
+        if (templa_file_dedup(file1, file2, output, loc2, entry, context, log))
+            return TEMPLA_RET_OK;
+    }
+
+    if (context.options.stream_size && reader.m_size >= context.options.stream_size)
+    {
+        TEMPLA_HASHER hasher;
+        TEMPLA_RET ret = templa_file_stream(file1, file2, reader, loc2, context, log,
+                                            context.manifest ? &hasher : NULL);
+        if (ret == TEMPLA_RET_OK && context.manifest)
+        {
+            entry.hash = hasher.digest();
+            templa_record(file1, loc2, entry, context);
+        }
+        if (ret == TEMPLA_RET_OK && file_id_claimed)
+            context.dedup->publish(TDK_FILE_ID, file_id, file2);
+        if (ret == TEMPLA_RET_OK)
+            templa_written(file2, context);
+        return ret;
+    }
+
+    timer.next(TP_READ);
+    TEMPLA_VIEW view;
+    if (!view.load(reader))
+    {
+        fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+    timer.stop();
+
+    if (context.manifest || context.dedup)
+    {
+        // touched, but the same contents
+        entry.hash = templa_hash64(view.m_ptr, view.m_size);
+        if (last && last->size == entry.size && last->hash == entry.hash)
+            return templa_up_to_date(file1, entry, *last, context, log);
+    }
+
+    if (context.dedup)
+    {
+        contents = TEMPLA_DEDUP::key_t(view.m_size, entry.hash);
+        auto output = context.dedup->find(TDK_CONTENTS, contents, contents_claimed);
+        if (templa_file_dedup(file1, file2, output, loc2, entry, context, log))
+        {
+            if (file_id_claimed)
+                context.dedup->publish(TDK_FILE_ID, file_id, file2);
+            return TEMPLA_RET_OK;
+        }
+    }
+
+    // Find out whether anything changes before making the output, so that
+    // binary files and files without keys are copied as they are.
+    TEMPLA_FILE file;
+    bool changed = templa_convert(view.m_ptr, view.m_size, context, file);
+
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    templa_log(context, log, "%ls --> %ls [%s]\n", file1.c_str(), file2.c_str(),
+               templa_encoding_name(file.m_encoding));
+
+    bool ok;
+    if (changed)
+    {
+        timer.next(TP_ENCODE);
+        file.encode();
+        timer.next(TP_WRITE);
+        ok = templa_save_file_at(loc2, file.m_binary.data(), file.m_binary.size(), &context.options);
+    }
+    else
+    {
+        timer.next(TP_WRITE);
+        ok = templa_copy_file_at(loc1, reader, view, loc2, &context.options,
+                                 &context.copy_support);
+    }
+    timer.stop();
+
+    if (!ok)
+    {
+        fprintf(stderr, "ERROR: Cannot write file '%ls'\n", file2.c_str());
+        return TEMPLA_RET_WRITEERROR;
+    }
+    templa_written(file2, context);
+
+    if (stats)
+    {
+        templa_stats_file(stats, file1, file.m_encoding, view.m_size,
+                          changed ? file.m_binary.size() : view.m_size, templa_now_ns() - start);
+    }
+    context.file_done(view.m_size);
+    if (context.manifest)
+        templa_record(file1, loc2, entry, context);
+    if (file_id_claimed)
+        context.dedup->publish(TDK_FILE_ID, file_id, file2);
+    if (contents_claimed)
+        context.dedup->publish(TDK_CONTENTS, contents, file2);
+
+    return TEMPLA_RET_OK;
+}
+
+#ifdef _WIN32
+static TEMPLA_RET
+templa_dir(string_t dir1, string_t dir2, const TEMPLA_CONTEXT& context)
+{
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    add_backslash(dir1);
+    add_backslash(dir2);
+
+    templa_log(context, NULL, "%ls --> %ls [DIR]\n", dir1.c_str(), dir2.c_str());
+
+    auto spec = dir1;
+    spec += L'*';
+
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = FindFirstFileW(spec.c_str(), &find);
+    if (hFind == INVALID_HANDLE_VALUE)
+    {
+        fprintf(stderr, "ERROR: '%ls': Not a directory\n", dir1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    do
+    {
+        if (context.canceled())
+        {
+            ret = TEMPLA_RET_CANCELED;
+            break;
+        }
+
+        auto filename1 = find.cFileName;
+        if (filename1[0] == L'.')
+        {
+            if (filename1[1] == 0)
+                continue;
+            if (filename1[1] == L'.' && filename1[2] == 0)
+                continue;
+        }
+
+        auto file1 = dir1 + filename1;
+        string_t filename2 = filename1;
+        templa_map_filename(filename2, context.matcher);
+
+        auto file2 = dir2 + filename2;
+
+        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+        {
+            if (!PathIsDirectoryW(file2.c_str()) && !CreateDirectoryW(file2.c_str(), NULL))
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", file2.c_str());
+                ret = TEMPLA_RET_WRITEERROR;
+                break;
+            }
+            ret = templa_dir(file1, file2, context);
+            if (ret != TEMPLA_RET_OK)
+                break;
+        }
+        else
+        {
+            ret = templa_file(file1, file2, filename1, { file1.c_str() }, { file2.c_str() },
+                              context);
+            if (ret != TEMPLA_RET_OK)
+                break;
+        }
+    } while (FindNextFileW(hFind, &find));
+
+    FindClose(hFind);
+    return ret;
+}
+#else
+// One level of the directory walk. Entries are opened relative to the
+// directory descriptors, so paths are never re-resolved from the root;
+// file1 and file2 are kept only for messages, truncated back to cch1 and
+// cch2 before each entry is appended.
+// A source folder and the folders above it in the walk. A link to a folder
+// leads back to one of them if it loops; such a link is not followed.
+struct TEMPLA_DIR_ID
+{
+    dev_t dev = 0;
+    ino_t ino = 0;
+    std::shared_ptr<const TEMPLA_DIR_ID> parent;
+};
+
+// The identity of the folder fd below parent, or NULL if it is parent or
+// one of the folders above it.
+static std::shared_ptr<const TEMPLA_DIR_ID>
+templa_dir_id(int fd, const std::shared_ptr<const TEMPLA_DIR_ID>& parent)
+{
+    auto id = std::make_shared<TEMPLA_DIR_ID>();
+    struct stat st;
+    if (fstat(fd, &st) == 0)
+    {
+        for (auto above = parent.get(); above; above = above->parent.get())
+        {
+            if (above->dev == st.st_dev && above->ino == st.st_ino)
+                return NULL;
+        }
+        id->dev = st.st_dev;
+        id->ino = st.st_ino;
+    }
+    id->parent = parent;
+    return id;
+}
+
+struct TEMPLA_DIR_FRAME
+{
+    DIR *dir1;
+    int fd2;
+    size_t cch1;
+    size_t cch2;
+    std::shared_ptr<const TEMPLA_DIR_ID> id;
+};
+
+static TEMPLA_RET
+templa_dir(string_t dir1, string_t dir2, const TEMPLA_CONTEXT& context)
+{
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    add_backslash(dir1);
+    add_backslash(dir2);
+
+    templa_log(context, NULL, "%ls --> %ls [DIR]\n", dir1.c_str(), dir2.c_str());
+
+    int fd1 = open(string_to_native(dir1).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    DIR *pdir1 = (fd1 >= 0) ? fdopendir(fd1) : NULL;
+    if (!pdir1)
+    {
+        if (fd1 >= 0)
+            close(fd1);
+        fprintf(stderr, "ERROR: '%ls': Not a directory\n", dir1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+
+    int fd2 = open(string_to_native(dir2).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (fd2 < 0)
+    {
+        closedir(pdir1);
+        fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", dir2.c_str());
+        return TEMPLA_RET_WRITEERROR;
+    }
+
+    std::vector<TEMPLA_DIR_FRAME> stack;
+    stack.push_back({ pdir1, fd2, dir1.size(), dir2.size(), templa_dir_id(fd1, NULL) });
+
+    string_t file1 = dir1, file2 = dir2, filename1, filename2;
+    std::string native2;
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    while (!stack.empty())
+    {
+        const TEMPLA_DIR_FRAME& frame = stack.back();
+
+        TEMPLA_PHASE_TIMER timer(stats, TP_ENUMERATE);
+        errno = 0;
+        struct dirent *entry = readdir(frame.dir1);
+        timer.stop();
+        if (!entry)
+        {
+            if (errno)
+            {
+                file1.resize(frame.cch1);
+                fprintf(stderr, "ERROR: Cannot read folder '%ls'\n", file1.c_str());
+                ret = TEMPLA_RET_READERROR;
+                break;
+            }
+            closedir(frame.dir1);
+            close(frame.fd2);
+            stack.pop_back();
+            continue;
+        }
+
+        if (context.canceled())
+        {
+            ret = TEMPLA_RET_CANCELED;
+            break;
+        }
+
+        auto name1 = entry->d_name;
+        if (name1[0] == '.')
+        {
+            if (name1[1] == 0)
+                continue;
+            if (name1[1] == '.' && name1[2] == 0)
+                continue;
+        }
+
+        filename1 = native_to_string(name1);
+        filename2 = filename1;
+        templa_map_filename(filename2, context.matcher);
+        native2 = string_to_native(filename2);
+
+        file1.resize(frame.cch1);
+        file1 += filename1;
+        file2.resize(frame.cch2);
+        file2 += filename2;
+
+        int fd1 = dirfd(frame.dir1);
+        bool is_dir = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+        {
+            struct stat st;
+            is_dir = (fstatat(fd1, name1, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        }
+
+        if (!is_dir)
+        {
+            ret = templa_file(file1, file2, filename1, { fd1, name1 }, { frame.fd2, native2.c_str() },
+                              context);
+            if (ret != TEMPLA_RET_OK)
+                break;
+            continue;
+        }
+
+        int sub1 = openat(fd1, name1, O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        DIR *psub1 = (sub1 >= 0) ? fdopendir(sub1) : NULL;
+        if (!psub1)
+        {
+            if (sub1 >= 0)
+                close(sub1);
+            fprintf(stderr, "ERROR: '%ls%lc': Not a directory\n", file1.c_str(), TEMPLA_PATH_SEP);
+            ret = TEMPLA_RET_READERROR;
+            break;
+        }
+
+        auto id = templa_dir_id(sub1, frame.id);
+        if (!id)
+        {
+            closedir(psub1);
+            templa_log(context, NULL, "%ls [loop]\n", file1.c_str());
+            continue;
+        }
+
+        int sub2 = -1;
+        if (mkdirat(frame.fd2, native2.c_str(), 0777) == 0 || errno == EEXIST)
+            sub2 = openat(frame.fd2, native2.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (sub2 < 0)
+        {
+            closedir(psub1);
+            fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", file2.c_str());
+            ret = TEMPLA_RET_WRITEERROR;
+            break;
+        }
+
+        file1 += TEMPLA_PATH_SEP;
+        file2 += TEMPLA_PATH_SEP;
+
+        if (context.canceled())
+        {
+            closedir(psub1);
+            close(sub2);
+            ret = TEMPLA_RET_CANCELED;
+            break;
+        }
+
+        templa_log(context, NULL, "%ls --> %ls [DIR]\n", file1.c_str(), file2.c_str());
+        stack.push_back({ psub1, sub2, file1.size(), file2.size(), id });
+    }
+
+    for (auto& frame : stack)
+    {
+        closedir(frame.dir1);
+        close(frame.fd2);
+    }
+
+    return ret;
+}
+#endif
+
+// A work-stealing thread pool. Each worker pushes and pops its own tasks
+// at the back of its deque (depth-first), and idle workers steal from the
+// front of the others (breadth-first).
+class TEMPLA_THREAD_POOL
+{
+public:
+    typedef std::function<void()> task_t;
+
+    explicit TEMPLA_THREAD_POOL(size_t threads)
+    {
+        if (threads < 1)
+            threads = 1;
+        for (size_t i = 0; i < threads; ++i)
+            m_queues.emplace_back(new QUEUE);
+        for (size_t i = 0; i < threads; ++i)
+            m_threads.emplace_back(&TEMPLA_THREAD_POOL::worker, this, i);
+    }
+
+    ~TEMPLA_THREAD_POOL()
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            m_quit = true;
+        }
+        m_wake.notify_all();
+        for (auto& thread : m_threads)
+            thread.join();
+    }
+
+    void submit(task_t task)
+    {
+        size_t index = (s_pool == this) ? s_index : (m_next++ % m_queues.size());
+        {
+            std::lock_guard<std::mutex> lock(m_queues[index]->mutex);
+            m_queues[index]->tasks.push_back(std::move(task));
+        }
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+            ++m_queued;
+        }
+        m_wake.notify_one();
+    }
+
+    // Wait until every submitted task (and the tasks they submit) is done.
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_pending == 0; });
+    }
+
+protected:
+    struct QUEUE
+    {
+        std::mutex mutex;
+        std::deque<task_t> tasks;
+    };
+    std::vector<std::unique_ptr<QUEUE> > m_queues;
+    std::vector<std::thread> m_threads;
+    std::mutex m_mutex;
+    std::condition_variable m_wake;
+    std::condition_variable m_idle;
+    size_t m_pending = 0;   // submitted but not finished
+    size_t m_queued = 0;    // submitted but not started
+    size_t m_next = 0;
+    bool m_quit = false;
+
+    static thread_local TEMPLA_THREAD_POOL *s_pool;
+    static thread_local size_t s_index;
+
+    bool take(size_t index, task_t& task)
+    {
+        {
+            QUEUE& own = *m_queues[index];
+            std::lock_guard<std::mutex> lock(own.mutex);
+            if (!own.tasks.empty())
+            {
+                task = std::move(own.tasks.back());
+                own.tasks.pop_back();
+                return true;
+            }
+        }
+
+        for (size_t i = 1; i < m_queues.size(); ++i)
+        {
+            QUEUE& other = *m_queues[(index + i) % m_queues.size()];
+            std::lock_guard<std::mutex> lock(other.mutex);
+            if (!other.tasks.empty())
+            {
+                task = std::move(other.tasks.front());
+                other.tasks.pop_front();
+                return true;
+            }
+        }
+
+        return false;
+    }
+
+    void worker(size_t index)
+    {
+        s_pool = this;
+        s_index = index;
+
+        for (;;)
+        {
+            {
+                std::unique_lock<std::mutex> lock(m_mutex);
+                m_wake.wait(lock, [this] { return m_quit || m_queued > 0; });
+                if (m_quit)
+                    return;
+            }
+
+            task_t task;
+            if (!take(index, task))
+                continue;
+
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                --m_queued;
+            }
+
+            task();
+
+            bool idle;
+            {
+                std::lock_guard<std::mutex> lock(m_mutex);
+                idle = (--m_pending == 0);
+            }
+            if (idle)
+                m_idle.notify_all();
+        }
+    }
+};
+
+thread_local TEMPLA_THREAD_POOL *TEMPLA_THREAD_POOL::s_pool = NULL;
+thread_local size_t TEMPLA_THREAD_POOL::s_index = 0;
+
+// The tasks of one run on a pool that other runs may share. wait() returns
+// when these are done, whatever else the pool has.
+class TEMPLA_TASK_GROUP
+{
+public:
+    explicit TEMPLA_TASK_GROUP(TEMPLA_THREAD_POOL& pool) : m_pool(pool) { }
+
+    void submit(TEMPLA_THREAD_POOL::task_t task)
+    {
+        {
+            std::lock_guard<std::mutex> lock(m_mutex);
+            ++m_pending;
+        }
+        m_pool.submit(std::bind(&TEMPLA_TASK_GROUP::call, this, std::move(task)));
+    }
+
+    void wait()
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_idle.wait(lock, [this] { return m_pending == 0; });
+    }
+
+protected:
+    TEMPLA_THREAD_POOL& m_pool;
+    std::mutex m_mutex;
+    std::condition_variable m_idle;
+    size_t m_pending = 0;
+
+    void call(const TEMPLA_THREAD_POOL::task_t& task)
+    {
+        task();
+
+        // notified with the lock held, as the group may go once it is idle
+        std::lock_guard<std::mutex> lock(m_mutex);
+        if (--m_pending == 0)
+            m_idle.notify_all();
+    }
+};
+
+// What the runs of a TEMPLA_JOB share, made when the first one needs it.
+struct TEMPLA_JOB_SHARED
+{
+    std::mutex mutex;
+    std::unique_ptr<TEMPLA_REPORTER> reporter;
+    std::unique_ptr<TEMPLA_THREAD_POOL> pool;   // last, as its tasks use the others
+
+    // The reporter of a run: the one given to it, options.reporter, or the
+    // log of the job.
+    TEMPLA_REPORTER *get_reporter(TEMPLA_REPORTER *given, const TEMPLA_OPTIONS& options)
+    {
+        if (given)
+            return given;
+        if (options.reporter)
+            return options.reporter;
+
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!reporter)
+            reporter = templa_new_reporter(TR_LOG);
+        return reporter.get();
+    }
+
+    TEMPLA_THREAD_POOL& get_pool(size_t jobs)
+    {
+        std::lock_guard<std::mutex> lock(mutex);
+        if (!pool)
+            pool.reset(new TEMPLA_THREAD_POOL(jobs));
+        return *pool;
+    }
+};
+
+// The source and destination of a directory, shared by the tasks of its
+// entries.
+#ifdef _WIN32
+    typedef string_t native_string_t;
+
+    struct TEMPLA_DIR_PAIR
+    {
+        string_t dir1;
+        string_t dir2;
+    };
+#else
+    typedef std::string native_string_t;
+
+    struct TEMPLA_DIR_PAIR
+    {
+        int fd1 = -1;
+        int fd2 = -1;
+        std::shared_ptr<const TEMPLA_DIR_ID> id;    // of fd1
+
+        ~TEMPLA_DIR_PAIR()
+        {
+            if (fd1 >= 0)
+                close(fd1);
+            if (fd2 >= 0)
+                close(fd2);
+        }
+    };
+#endif
+
+struct TEMPLA_DIR_ENTRY
+{
+    native_string_t name;
+    bool is_dir;
+};
+
+static bool
+templa_read_dir(const TEMPLA_DIR_PAIR& pair, std::vector<TEMPLA_DIR_ENTRY>& entries)
+{
+    entries.clear();
+
+#ifdef _WIN32
+    WIN32_FIND_DATAW find;
+    HANDLE hFind = FindFirstFileW((pair.dir1 + L'*').c_str(), &find);
+    if (hFind == INVALID_HANDLE_VALUE)
+        return false;
+
+    do
+    {
+        auto name = find.cFileName;
+        if (name[0] == L'.' && (name[1] == 0 || (name[1] == L'.' && name[2] == 0)))
+            continue;
+        entries.push_back({ name, !!(find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY) });
+    } while (FindNextFileW(hFind, &find));
+
+    FindClose(hFind);
+    return true;
+#else
+    int fd = dup(pair.fd1);
+    DIR *pdir = (fd >= 0) ? fdopendir(fd) : NULL;
+    if (!pdir)
+    {
+        if (fd >= 0)
+            close(fd);
+        return false;
+    }
+    rewinddir(pdir);
+
+    bool ok = true;
+    for (;;)
+    {
+        errno = 0;
+        struct dirent *entry = readdir(pdir);
+        if (!entry)
+        {
+            ok = (errno == 0);
+            break;
+        }
+
+        auto name = entry->d_name;
+        if (name[0] == '.' && (name[1] == 0 || (name[1] == '.' && name[2] == 0)))
+            continue;
+
+        bool is_dir = (entry->d_type == DT_DIR);
+        if (entry->d_type == DT_UNKNOWN || entry->d_type == DT_LNK)
+        {
+            struct stat st;
+            is_dir = (fstatat(pair.fd1, name, &st, 0) == 0 && S_ISDIR(st.st_mode));
+        }
+        entries.push_back({ name, is_dir });
+    }
+
+    closedir(pdir);
+    return ok;
+#endif
+}
+
+// The output of one entry. Directory nodes get their children while they
+// are enumerated; the nodes are printed depth-first as they complete, so
+// the log is in the same order as a sequential run.
+struct TEMPLA_LOG_NODE
+{
+    std::string text;
+    std::vector<std::unique_ptr<TEMPLA_LOG_NODE> > children;
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    bool done = false;
+    bool skipped = false;
+    bool printed = false;
+};
+
+class TEMPLA_PARALLEL_DIR
+{
+public:
+    // On the pool of the job of context if any, else on a pool of its own.
+    TEMPLA_PARALLEL_DIR(const TEMPLA_CONTEXT& context, size_t jobs)
+        : m_context(context)
+        , m_own_pool(context.job ? NULL : new TEMPLA_THREAD_POOL(jobs))
+        , m_pool(context.job ? context.job->get_pool(jobs) : *m_own_pool)
+    {
+    }
+
+    // Every folder with pending entries holds two descriptors, so the
+    // caller may want to raise RLIMIT_NOFILE first.
+    TEMPLA_RET run(const string_t& dir1, const string_t& dir2)
+    {
+        m_cursor.push_back(&m_root);
+        m_pool.submit([=] { open_dir(NULL, native_string_t(), native_string_t(), dir1, dir2, &m_root); });
+        m_pool.wait();
+        return m_halted ? m_ret : TEMPLA_RET_OK;
+    }
+
+protected:
+    const TEMPLA_CONTEXT& m_context;
+    std::unique_ptr<TEMPLA_THREAD_POOL> m_own_pool;
+    TEMPLA_TASK_GROUP m_pool;
+    std::mutex m_mutex;
+    TEMPLA_LOG_NODE m_root;
+    std::vector<TEMPLA_LOG_NODE *> m_cursor;
+    std::vector<size_t> m_cursor_index;
+    std::atomic<bool> m_stop { false };
+    TEMPLA_RET m_stop_ret = TEMPLA_RET_OK;
+    TEMPLA_RET m_ret = TEMPLA_RET_OK;
+    bool m_halted = false;
+
+    bool begin(TEMPLA_LOG_NODE *node)
+    {
+        if (!m_stop)
+            return true;
+
+        std::lock_guard<std::mutex> lock(m_mutex);
+        node->skipped = node->done = true;
+        flush();
+        return false;
+    }
+
+    void finish(TEMPLA_LOG_NODE *node, TEMPLA_RET ret)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        node->ret = ret;
+        node->done = true;
+        if (ret != TEMPLA_RET_OK && !m_stop)
+        {
+            m_stop_ret = ret;
+            m_stop = true;
+        }
+        flush();
+    }
+
+    // Print what is complete in traversal order, stopping at the first
+    // failure like a sequential run does.
+    void flush()
+    {
+        while (!m_halted && !m_cursor.empty())
+        {
+            TEMPLA_LOG_NODE *node = m_cursor.back();
+            if (!node->printed)
+            {
+                if (!node->done)
+                    return;
+
+                m_context.reporter->log(node->text.data(), node->text.size());
+                node->printed = true;
+                m_cursor_index.push_back(0);
+
+                if (node->skipped || node->ret != TEMPLA_RET_OK)
+                {
+                    m_ret = node->skipped ? m_stop_ret : node->ret;
+                    m_halted = true;
+                    return;
+                }
+            }
+
+            size_t& index = m_cursor_index.back();
+            if (index < node->children.size())
+            {
+                m_cursor.push_back(node->children[index++].get());
+                continue;
+            }
+
+            node->children.clear();
+            m_cursor.pop_back();
+            m_cursor_index.pop_back();
+        }
+    }
+
+    void open_dir(std::shared_ptr<TEMPLA_DIR_PAIR> parent, native_string_t name1,
+                  native_string_t name2, string_t dir1, string_t dir2, TEMPLA_LOG_NODE *node)
+    {
+        if (!begin(node))
+            return;
+
+        if (m_context.canceled())
+        {
+            finish(node, TEMPLA_RET_CANCELED);
+            return;
+        }
+
+        auto pair = std::make_shared<TEMPLA_DIR_PAIR>();
+#ifdef _WIN32
+        pair->dir1 = dir1;
+        pair->dir2 = dir2;
+        if (parent && !PathIsDirectoryW(dir2.c_str()) && !CreateDirectoryW(dir2.c_str(), NULL))
+        {
+            fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", dir2.c_str());
+            finish(node, TEMPLA_RET_WRITEERROR);
+            return;
+        }
+
+        templa_append(node->text, "%ls --> %ls [DIR]\n", dir1.c_str(), dir2.c_str());
+#else
+        if (parent)
+            pair->fd1 = openat(parent->fd1, name1.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        else
+            pair->fd1 = open(string_to_native(dir1).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+        if (pair->fd1 < 0)
+        {
+            fprintf(stderr, "ERROR: '%ls': Not a directory\n", dir1.c_str());
+            finish(node, TEMPLA_RET_READERROR);
+            return;
+        }
+
+        pair->id = templa_dir_id(pair->fd1, parent ? parent->id : NULL);
+        if (!pair->id)
+        {
+            templa_append(node->text, "%ls [loop]\n", dir1.substr(0, dir1.size() - 1).c_str());
+            finish(node, TEMPLA_RET_OK);
+            return;
+        }
+
+        if (parent)
+        {
+            if (mkdirat(parent->fd2, name2.c_str(), 0777) == 0 || errno == EEXIST)
+                pair->fd2 = openat(parent->fd2, name2.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (pair->fd2 < 0)
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", dir2.c_str());
+                finish(node, TEMPLA_RET_WRITEERROR);
+                return;
+            }
+        }
+
+        templa_append(node->text, "%ls --> %ls [DIR]\n", dir1.c_str(), dir2.c_str());
+
+        if (!parent)
+        {
+            pair->fd2 = open(string_to_native(dir2).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (pair->fd2 < 0)
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", dir2.c_str());
+                finish(node, TEMPLA_RET_WRITEERROR);
+                return;
+            }
+        }
+#endif
+
+        TEMPLA_PHASE_TIMER timer(m_context.thread_stats(), TP_ENUMERATE);
+        std::vector<TEMPLA_DIR_ENTRY> entries;
+        bool ok = templa_read_dir(*pair, entries);
+        timer.stop();
+        if (!ok)
+        {
+            fprintf(stderr, "ERROR: '%ls': Not a directory\n", dir1.c_str());
+            finish(node, TEMPLA_RET_READERROR);
+            return;
+        }
+
+        for (auto& entry : entries)
+        {
+            if (m_stop)
+                break;
+
+#ifdef _WIN32
+            string_t filename1 = entry.name;
+#else
+            string_t filename1 = native_to_string(entry.name.c_str());
+#endif
+            string_t filename2 = filename1;
+            templa_map_filename(filename2, m_context.matcher);
+
+            string_t file1 = dir1 + filename1, file2 = dir2 + filename2;
+#ifdef _WIN32
+            native_string_t native2 = filename2;
+#else
+            native_string_t native2 = string_to_native(filename2);
+#endif
+
+            node->children.emplace_back(new TEMPLA_LOG_NODE);
+            TEMPLA_LOG_NODE *child = node->children.back().get();
+
+            if (entry.is_dir)
+            {
+                file1 += TEMPLA_PATH_SEP;
+                file2 += TEMPLA_PATH_SEP;
+                m_pool.submit([=] {
+                    open_dir(pair, entry.name, native2, file1, file2, child);
+                });
+            }
+            else
+            {
+                m_pool.submit([=] {
+                    if (!begin(child))
+                        return;
+#ifdef _WIN32
+                    TEMPLA_FILE_LOC loc1 = { file1.c_str() }, loc2 = { file2.c_str() };
+#else
+                    TEMPLA_FILE_LOC loc1 = { pair->fd1, entry.name.c_str() };
+                    TEMPLA_FILE_LOC loc2 = { pair->fd2, native2.c_str() };
+#endif
+                    finish(child, templa_file(file1, file2, filename1, loc1, loc2,
+                                              m_context, &child->text));
+                });
+            }
+        }
+
+        finish(node, TEMPLA_RET_OK);
+    }
+};
+
+static TEMPLA_RET
+templa_dir_parallel(string_t dir1, string_t dir2, const TEMPLA_CONTEXT& context, size_t jobs)
+{
+    add_backslash(dir1);
+    add_backslash(dir2);
+
+    TEMPLA_PARALLEL_DIR walker(context, jobs);
+    return walker.run(dir1, dir2);
+}
+
+bool templa_validate_filename(string_t& filename)
+{
+    bool ret = false;
+
+    str_trim_left(filename, L" \t\r\n\x3000");
+    str_trim_right(filename, L" .\t\r\n\x3000");
+
+    if (filename.empty())
+        filename = L"_";
+
+    // Replace invalid characters
+    for (auto& ch : filename)
+    {
+        switch (ch)
+        {
+        case '\\': case '/': case ':': case '*': case '?':
+        case '"': case '<': case '>': case '|':
+            ch = '_';
+            ret = true;
+            break;
+        }
+    }
+
+    // Check invalida names
+    if (templa_lstrcmpi(filename.c_str(), L"CON") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"PRN") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"AUX") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"NUL") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM0") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM1") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM2") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM3") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM4") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM5") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM6") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM7") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM8") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"COM9") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT0") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT1") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT2") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT3") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT4") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT5") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT6") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT7") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT8") == 0 ||
+        templa_lstrcmpi(filename.c_str(), L"LPT9") == 0)
+    {
+        ret = true;
+        filename += L'_';
+    }
+
+    if (filename == L".")
+    {
+        ret = true;
+        filename = L"_";
+    }
+    else if (filename == L"..")
+    {
+        ret = true;
+        filename = L"__";
+    }
+
+    return ret;
+}
+
+static bool templa_path_exists(const string_t& path)
+{
+#ifdef _WIN32
+    return PathFileExistsW(path.c_str());
+#else
+    struct stat st;
+    return stat(string_to_native(path).c_str(), &st) == 0;
+#endif
+}
+
+static bool templa_path_is_dir(const string_t& path)
+{
+#ifdef _WIN32
+    return PathIsDirectoryW(path.c_str());
+#else
+    struct stat st;
+    return stat(string_to_native(path).c_str(), &st) == 0 && S_ISDIR(st.st_mode);
+#endif
+}
+
+static bool templa_make_dir(const string_t& path)
+{
+    if (templa_path_is_dir(path))
+        return true;
+#ifdef _WIN32
+    return CreateDirectoryW(path.c_str(), NULL);
+#else
+    return mkdir(string_to_native(path).c_str(), 0777) == 0;
+#endif
+}
+
+// Get the full pathname, with a trailing separator if it is a directory.
+static string_t templa_full_path(const string_t& path)
+{
+#ifdef _WIN32
+    WCHAR szPath[MAX_PATH];
+    GetFullPathNameW(path.c_str(), _countof(szPath), szPath, NULL);
+    if (PathIsDirectoryW(szPath))
+        PathAddBackslash(szPath);
+    return szPath;
+#else
+    string_t ret = path;
+    if (char *resolved = realpath(string_to_native(path).c_str(), NULL))
+    {
+        ret = native_to_string(resolved);
+        free(resolved);
+    }
+    if (templa_path_is_dir(ret))
+        add_backslash(ret);
+    return ret;
+#endif
+}
+
+TEMPLA_RET
+templa(string_t source, string_t destination, const mapping_t& mapping,
+       const string_list_t& ignore, templa_canceler_t canceler)
+{
+    return templa(source, destination, mapping, ignore, TEMPLA_OPTIONS(), canceler);
+}
+
+// Check the source and the destination, and normalize them: no trailing
+// separator on source, one on destination.
+static TEMPLA_RET templa_check_paths(string_t& source, string_t& destination)
+{
+    backslash_to_slash(source);
+    backslash_to_slash(destination);
+
+    while (source.size() > 1 && source[source.size() - 1] == TEMPLA_PATH_SEP)
+        source.resize(source.size() - 1);
+
+    if (!templa_path_exists(source))
+    {
+        fprintf(stderr, "ERROR: File '%ls' not found\n", source.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+
+    if (!templa_path_is_dir(destination))
+    {
+        fprintf(stderr, "ERROR: '%ls' is not a directory\n", destination.c_str());
+        return TEMPLA_RET_WRITEERROR;
+    }
+
+    {
+        string_t src = templa_full_path(source), dest = templa_full_path(destination);
+
+#ifdef _WIN32
+        if (templa_lstrcmpi(src.c_str(), dest.c_str()) == 0)
+#else
+        if (src == dest)
+#endif
+        {
+            fprintf(stderr, "ERROR: Destination '%ls' is same as source\n", src.c_str());
+            return TEMPLA_RET_LOGICALERROR;
+        }
+
+        if (dest.find(src) == 0)
+        {
+            fprintf(stderr, "ERROR: Source '%ls' contains destination '%ls'\n",
+                    src.c_str(), dest.c_str());
+            return TEMPLA_RET_LOGICALERROR;
+        }
+    }
+
+    add_backslash(destination);
+    return TEMPLA_RET_OK;
+}
+
+// Run body for source with the manifest of destination (--incremental),
+// the table of --dedup and the list of --sync in place.
+static TEMPLA_RET
+templa_run(const string_t& source, const string_t& destination, TEMPLA_CONTEXT& context,
+           const std::function<TEMPLA_RET()>& body)
+{
+    TEMPLA_MANIFEST manifest(context.compiled->manifest_config, destination);
+    auto manifest_file = destination + TEMPLA_MANIFEST_NAME;
+    if (context.options.incremental)
+    {
+        manifest.load(manifest_file);
+        context.manifest = &manifest;
+    }
+
+    TEMPLA_DEDUP dedup;
+    if (context.options.dedup || context.options.hardlinks)
+        context.dedup = &dedup;
+
+    TEMPLA_SYNC_LIST sync_list(context.options.sync);
+    if (context.options.sync != TS_NONE)
+        context.sync_list = &sync_list;
+
+    TEMPLA_RET ret = body();
+    context.manifest = NULL;
+    context.dedup = NULL;
+    context.sync_list = NULL;
+
+    if (context.options.incremental)
+    {
+        string_list_t removed;
+        manifest.finish(source, ret == TEMPLA_RET_OK, removed);
+        for (auto& output : removed)
+            templa_log(context, NULL, "%ls [removed]\n", output.c_str());
+        if (manifest.save(manifest_file, context.options))
+        {
+            sync_list.add(manifest_file);
+        }
+        else
+        {
+            fprintf(stderr, "ERROR: Cannot write file '%ls'\n", manifest_file.c_str());
+            if (ret == TEMPLA_RET_OK)
+                ret = TEMPLA_RET_WRITEERROR;
+        }
+    }
+
+    TEMPLA_PHASE_TIMER timer(context.thread_stats(), TP_WRITE);
+    if (context.options.sync != TS_NONE && !sync_list.finish(destination))
+    {
+        fprintf(stderr, "ERROR: Cannot sync '%ls'\n", destination.c_str());
+        if (ret == TEMPLA_RET_OK)
+            ret = TEMPLA_RET_WRITEERROR;
+    }
+    timer.stop();
+
+    if (context.stats)
+        context.stats->merge(*context.options.stats, context.compiled->mapping);
+    return ret;
+}
+
+static size_t templa_jobs(const TEMPLA_OPTIONS& options)
+{
+    if (options.jobs)
+        return options.jobs;
+    return std::max(1u, std::thread::hardware_concurrency());
+}
+
+static TEMPLA_RET
+templa_plan_dir(const TEMPLA_DIR_PAIR& pair, const string_t& dir1, const string_t& dir2,
+                const TEMPLA_CONTEXT& context, templa_plan_t& plan)
+{
+    std::vector<TEMPLA_DIR_ENTRY> entries;
+    if (!templa_read_dir(pair, entries))
+    {
+        fprintf(stderr, "ERROR: '%ls': Not a directory\n", dir1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+
+    for (auto& entry : entries)
+    {
+#ifdef _WIN32
+        string_t filename1 = entry.name;
+#else
+        string_t filename1 = native_to_string(entry.name.c_str());
+#endif
+        string_t filename2 = filename1;
+        templa_map_filename(filename2, context.matcher);
+
+        TEMPLA_PLAN_ITEM item;
+        item.source = dir1 + filename1;
+        item.destination = dir2 + filename2;
+
+        if (entry.is_dir)
+        {
+            TEMPLA_DIR_PAIR child;
+#ifdef _WIN32
+            child.dir1 = item.source + TEMPLA_PATH_SEP;
+#else
+            child.fd1 = openat(pair.fd1, entry.name.c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+            if (child.fd1 >= 0)
+            {
+                child.id = templa_dir_id(child.fd1, pair.id);
+                if (!child.id)
+                {
+                    item.type = TPT_LOOP;
+                    plan.push_back(item);
+                    continue;
+                }
+            }
+#endif
+            item.type = TPT_DIR;
+            item.source += TEMPLA_PATH_SEP;
+            item.destination += TEMPLA_PATH_SEP;
+            plan.push_back(item);
+
+            TEMPLA_RET ret = templa_plan_dir(child, item.source, item.destination, context, plan);
+            if (ret != TEMPLA_RET_OK)
+                return ret;
+            continue;
+        }
+
+        if (context.ignore.match(filename1))
+        {
+            item.type = TPT_IGNORED;
+            plan.push_back(item);
+            continue;
+        }
+
+#ifdef _WIN32
+        struct _stati64 st;
+        if (_wstati64(item.source.c_str(), &st) == 0)
+            item.size = uint64_t(st.st_size);
+#else
+        struct stat st;
+        if (fstatat(pair.fd1, entry.name.c_str(), &st, 0) == 0)
+        {
+            item.size = uint64_t(st.st_size);
+            item.order = uint64_t(st.st_ino);
+        }
+#endif
+        plan.push_back(item);
+    }
+
+    return TEMPLA_RET_OK;
+}
+
+// templa_make_plan for checked paths.
+static TEMPLA_RET
+templa_make_plan(const string_t& source, const string_t& destination,
+                 const TEMPLA_CONTEXT& context, templa_plan_t& plan)
+{
+    plan.clear();
+
+    TEMPLA_PLAN_ITEM root;
+    root.source = source;
+    root.destination = basename(source);
+    templa_map_filename(root.destination, context.matcher);
+    root.destination = destination + root.destination;
+
+    if (context.ignore.match(basename(source)))
+    {
+        root.type = TPT_IGNORED;
+        plan.push_back(root);
+        return TEMPLA_RET_OK;
+    }
+
+    if (!templa_path_is_dir(source))
+    {
+        TEMPLA_READER reader;
+        std::string native;
+        if (reader.open(templa_file_loc(source, native)))
+            root.size = reader.m_size;
+        plan.push_back(root);
+        return TEMPLA_RET_OK;
+    }
+
+    root.type = TPT_DIR;
+    add_backslash(root.source);
+    add_backslash(root.destination);
+    plan.push_back(root);
+
+    TEMPLA_DIR_PAIR pair;
+#ifdef _WIN32
+    pair.dir1 = root.source;
+#else
+    pair.fd1 = open(string_to_native(root.source).c_str(), O_RDONLY | O_DIRECTORY | O_CLOEXEC);
+    if (pair.fd1 >= 0)
+        pair.id = templa_dir_id(pair.fd1, NULL);
+#endif
+    return templa_plan_dir(pair, root.source, root.destination, context, plan);
+}
+
+TEMPLA_RET
+templa_make_plan(string_t source, string_t destination, const mapping_t& mapping,
+                 const string_list_t& ignore, templa_plan_t& plan)
+{
+    TEMPLA_RET ret = templa_check_paths(source, destination);
+    if (ret != TEMPLA_RET_OK)
+        return ret;
+
+    TEMPLA_OPTIONS options;
+    TEMPLA_CONTEXT context(mapping, ignore, options, NULL);
+    return templa_make_plan(source, destination, context, plan);
+}
+
+static void templa_print_plan(const templa_plan_t& plan)
+{
+    for (auto& item : plan)
+    {
+        switch (item.type)
+        {
+        case TPT_FILE:
+            printf("%ls --> %ls [%llu bytes]\n", item.source.c_str(), item.destination.c_str(),
+                   (unsigned long long)item.size);
+            break;
+        case TPT_DIR:
+            printf("%ls --> %ls [DIR]\n", item.source.c_str(), item.destination.c_str());
+            break;
+        case TPT_IGNORED:
+            printf("%ls [ignored]\n", item.source.c_str());
+            break;
+        case TPT_LOOP:
+            printf("%ls [loop]\n", item.source.c_str());
+            break;
+        }
+    }
+}
+
+#ifdef TEMPLA_HAVE_IO_URING
+// Files up to this size are batched through io_uring.
+#define TEMPLA_URING_FILE_SIZE (64 * 1024)
+
+// Convert small files with a round of io_uring requests for each step: the
+// sources are opened, read and closed, then the outputs opened, written and
+// closed. A file that fails any step is done again by templa_file, which
+// reports the error.
+static void
+templa_file_batch(TEMPLA_URING& ring, const TEMPLA_PLAN_ITEM *const *items, size_t count,
+                  const TEMPLA_CONTEXT& context, std::string *logs, TEMPLA_RET *rets)
+{
+    struct BATCH_FILE
+    {
+        std::string native1, native2;
+        int fd = -1;
+        bool sync = false;
+        struct statx stat;
+        binary_t data;
+        TEMPLA_FILE file;
+        bool changed = false;
+        uint64_t ns = 0;
+    };
+    std::vector<BATCH_FILE> files(count);
+    std::vector<int> results(count * 2);    // the opens, reads and writes, then the rest
+    bool ok = ring.capacity() >= count * 2;
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+
+    // the sources, and the links of the outputs
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        BATCH_FILE& file = files[i];
+        file.native1 = string_to_native(items[i]->source);
+        file.native2 = string_to_native(items[i]->destination);
+        file.stat.stx_nlink = 1;
+        auto sqe = ring.prepare(IORING_OP_OPENAT, AT_FDCWD, file.native1.c_str(), 0, 0, i);
+        sqe->open_flags = O_RDONLY | O_CLOEXEC;
+        ring.prepare(IORING_OP_STATX, AT_FDCWD, file.native2.c_str(), STATX_NLINK,
+                           uint64_t(uintptr_t(&file.stat)), count + i);
+    }
+    ok = ok && ring.run(results);
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        files[i].fd = results[i];
+        // an output with hard links is replaced, not written through
+        files[i].sync = files[i].fd < 0 || (results[count + i] == 0 && files[i].stat.stx_nlink > 1);
+    }
+
+    // one more byte than planned tells whether the file has grown
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        BATCH_FILE& file = files[i];
+        if (file.fd < 0)
+            continue;
+        if (!file.sync)
+        {
+            file.data.resize(size_t(items[i]->size) + 1);
+            auto sqe = ring.prepare(IORING_OP_READ, file.fd, &file.data[0],
+                                    uint32_t(file.data.size()), 0, i);
+            sqe->flags = IOSQE_IO_HARDLINK;
+        }
+        ring.prepare(IORING_OP_CLOSE, file.fd, NULL, 0, 0, count + i);
+        file.fd = -1;
+    }
+    ok = ok && ring.run(results);
+    timer.stop();
+
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        BATCH_FILE& file = files[i];
+        if (file.sync)
+            continue;
+        if (results[i] < 0 || uint64_t(results[i]) > items[i]->size)
+        {
+            file.sync = true;
+            continue;
+        }
+        file.data.resize(size_t(results[i]));
 
+        if (context.canceled())
+        {
+            rets[i] = TEMPLA_RET_CANCELED;
+            for (size_t k = i + 1; k < count; ++k)
+                files[k].sync = true;
+            count = i;
+            break;
+        }
+
+        uint64_t start = stats ? templa_now_ns() : 0;
+        file.changed = templa_convert(file.data.data(), file.data.size(), context, file.file);
+        if (file.changed)
+        {
+            TEMPLA_PHASE_TIMER encode_timer(stats, TP_ENCODE);
+            file.file.encode();
+        }
+        if (stats)
+            file.ns = templa_now_ns() - start;
+        templa_log(context, &logs[i], "%ls --> %ls [%s]\n", items[i]->source.c_str(),
+                   items[i]->destination.c_str(), templa_encoding_name(file.file.m_encoding));
+
+        auto sqe = ring.prepare(IORING_OP_OPENAT, AT_FDCWD, file.native2.c_str(), 0666, 0, i);
+        sqe->open_flags = O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC;
+    }
+    timer.next(TP_WRITE);
+    ok = ok && ring.run(results);
+    timer.stop();
+
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        BATCH_FILE& file = files[i];
+        if (file.sync)
+            continue;
+        file.fd = results[i];
+        if (file.fd < 0)
+        {
+            file.sync = true;
+            continue;
+        }
+
+        const binary_t& output = file.changed ? file.file.m_binary : file.data;
+        auto sqe = ring.prepare(IORING_OP_WRITE, file.fd, output.data(),
+                                uint32_t(output.size()), 0, i);
+        sqe->flags = IOSQE_IO_HARDLINK;
+        ring.prepare(IORING_OP_CLOSE, file.fd, NULL, 0, 0, count + i);
+        file.fd = -1;
+    }
+    timer.next(TP_WRITE);
+    ok = ok && ring.run(results);
+    timer.stop();
+
+    for (size_t i = 0; ok && i < count; ++i)
+    {
+        BATCH_FILE& file = files[i];
+        const binary_t& output = file.changed ? file.file.m_binary : file.data;
+        if (!file.sync && (results[i] != int(output.size()) || results[count + i] < 0))
+            file.sync = true;
+        if (!file.sync)
+        {
+            templa_stats_file(stats, items[i]->source, file.file.m_encoding, file.data.size(),
+                              output.size(), file.ns);
+            context.file_done(file.data.size());
+        }
+    }
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (!ok || files[i].sync)
+        {
+            if (files[i].fd >= 0)
+                ::close(files[i].fd);
+            logs[i].clear();
+            std::string native1, native2;
+            rets[i] = templa_file(items[i]->source, items[i]->destination,
+                                  basename(items[i]->source),
+                                  templa_file_loc(items[i]->source, native1),
+                                  templa_file_loc(items[i]->destination, native2),
+                                  context, &logs[i]);
+        }
+    }
+}
+#endif  // def TEMPLA_HAVE_IO_URING
+
+// The log of the files of a plan. Whatever order they finish in, it is
+// printed in the order of the files, up to the first failure.
+class TEMPLA_PLAN_LOG
+{
+public:
+    std::atomic<bool> m_stop;   // set on the first failure
+
+    TEMPLA_PLAN_LOG(size_t count, TEMPLA_REPORTER *reporter)
+        : m_stop(false), m_reporter(reporter), m_logs(count), m_rets(count, TEMPLA_RET_OK)
+        , m_done(count, false)
+    {
+    }
+
+    std::string *log(size_t i)
+    {
+        return &m_logs[i];
+    }
+
+    void finish(size_t i, TEMPLA_RET ret)
+    {
+        finish(i, i + 1, &ret);
+    }
+
+    void finish(size_t first, size_t last, const TEMPLA_RET *rets)
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        for (size_t i = first; i < last; ++i)
+        {
+            m_rets[i] = rets[i - first];
+            m_done[i] = true;
+            if (m_rets[i] != TEMPLA_RET_OK)
+                m_stop = true;
+        }
+
+        while (m_printed < m_done.size() && m_done[m_printed] && m_ret == TEMPLA_RET_OK)
+        {
+            m_reporter->log(m_logs[m_printed].data(), m_logs[m_printed].size());
+            std::string().swap(m_logs[m_printed]);
+            m_ret = m_rets[m_printed++];
+        }
+    }
+
+    TEMPLA_RET result()
+    {
+        return m_ret;
+    }
+
+protected:
+    TEMPLA_REPORTER *m_reporter;
+    std::mutex m_mutex;
+    std::vector<std::string> m_logs;
+    std::vector<TEMPLA_RET> m_rets;
+    std::vector<bool> m_done;
+    size_t m_printed = 0;
+    TEMPLA_RET m_ret = TEMPLA_RET_OK;
+};
+
+// Convert the files of a plan by jobs threads, taking them in order.
+static TEMPLA_RET
+templa_run_plan_files(const std::vector<const TEMPLA_PLAN_ITEM *>& files,
+                      const TEMPLA_CONTEXT& context, size_t jobs)
+{
+    TEMPLA_PLAN_LOG log(files.size(), context.reporter);
+    std::atomic<size_t> next(0);
+
+    // The work is taken in units: one file, or a run of small files that
+    // go through io_uring together.
+    size_t depth = 0;
+#ifdef TEMPLA_HAVE_IO_URING
+    if (!context.manifest && !context.dedup && !context.sync_list && !context.options.atomic)
+        depth = std::min<size_t>(context.options.uring_depth, 1024);
+#endif
+    std::vector<size_t> units;
+    for (size_t i = 0; i < files.size(); )
+    {
+        units.push_back(i++);
+#ifdef TEMPLA_HAVE_IO_URING
+        if (depth && files[i - 1]->size <= TEMPLA_URING_FILE_SIZE)
+        {
+            for (size_t k = 1; k < depth && i < files.size(); ++k, ++i)
+            {
+                if (files[i]->size > TEMPLA_URING_FILE_SIZE)
+                    break;
+            }
+        }
+#endif
+    }
+    units.push_back(files.size());
+
+    auto work = [&]() {
+#ifdef TEMPLA_HAVE_IO_URING
+        TEMPLA_URING ring;
+        bool batch = depth > 1 && ring.open(unsigned(depth * 2));
+#endif
+        for (;;)
+        {
+            size_t unit = next++;
+            if (unit + 1 >= units.size() || log.m_stop)
+                return;
+
+            size_t first = units[unit], last = units[unit + 1];
+            std::vector<TEMPLA_RET> unit_rets(last - first, TEMPLA_RET_OK);
+#ifdef TEMPLA_HAVE_IO_URING
+            if (batch && last - first > 1)
+            {
+                templa_file_batch(ring, &files[first], last - first, context,
+                                  log.log(first), &unit_rets[0]);
+            }
+            else
+#endif
+            for (size_t i = first; i < last; ++i)
+            {
+                const TEMPLA_PLAN_ITEM& item = *files[i];
+                std::string native1, native2;
+                unit_rets[i - first] = templa_file(item.source, item.destination,
+                                                   basename(item.source),
+                                                   templa_file_loc(item.source, native1),
+                                                   templa_file_loc(item.destination, native2),
+                                                   context, log.log(i));
+                if (unit_rets[i - first] != TEMPLA_RET_OK)
+                    break;
+            }
+
+            log.finish(first, last, &unit_rets[0]);
+        }
+    };
+
+    if (jobs <= 1)
+    {
+        work();
+    }
+    else if (context.job)
+    {
+        TEMPLA_TASK_GROUP group(context.job->get_pool(jobs));
+        for (size_t i = 0; i < jobs; ++i)
+            group.submit(work);
+        group.wait();
+    }
+    else
+    {
+        std::vector<std::thread> threads;
+        for (size_t i = 0; i < jobs; ++i)
+            threads.emplace_back(work);
+        for (auto& thread : threads)
+            thread.join();
+    }
+
+    return log.result();
+}
+
+// A queue between two stages of the pipeline. It holds up to m_budget
+// bytes of data, or one item however large.
+template <typename T_ITEM>
+class TEMPLA_PIPE
+{
+public:
+    explicit TEMPLA_PIPE(size_t budget) : m_budget(budget) { }
+
+    void push(T_ITEM&& item, size_t bytes)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_full.wait(lock, [&]() { return m_items.empty() || m_bytes + bytes <= m_budget; });
+        m_bytes += bytes;
+        m_items.emplace_back(std::move(item), bytes);
+        m_not_empty.notify_one();
+    }
+
+    // Returns false once the pipe is closed and empty.
+    bool pop(T_ITEM& item)
+    {
+        std::unique_lock<std::mutex> lock(m_mutex);
+        m_not_empty.wait(lock, [&]() { return !m_items.empty() || m_closed; });
+        if (m_items.empty())
+            return false;
+        item = std::move(m_items.front().first);
+        m_bytes -= m_items.front().second;
+        m_items.pop_front();
+        m_not_full.notify_all();
+        return true;
+    }
+
+    void close()
+    {
+        std::lock_guard<std::mutex> lock(m_mutex);
+        m_closed = true;
+        m_not_empty.notify_all();
+    }
+
+protected:
+    std::mutex m_mutex;
+    std::condition_variable m_not_full, m_not_empty;
+    std::deque<std::pair<T_ITEM, size_t> > m_items;
+    size_t m_bytes = 0;
+    size_t m_budget;
+    bool m_closed = false;
+};
+
+struct TEMPLA_PIPE_ITEM
+{
+    size_t index = 0;
+    bool whole = false;     // too large to hold; templa_file does it in the writer
+    binary_t data;          // the contents, then the output
+    uint64_t size = 0;      // of the contents
+};
+
+// Convert the files of a plan in stages that overlap: a reader thread,
+// jobs threads that convert, and a writer. Each queue between them holds
+// half of options.pipeline_size.
+static TEMPLA_RET
+templa_run_plan_pipeline(const std::vector<const TEMPLA_PLAN_ITEM *>& files,
+                         const TEMPLA_CONTEXT& context, size_t jobs)
+{
+    TEMPLA_PLAN_LOG log(files.size(), context.reporter);
+    size_t budget = size_t(std::min<uint64_t>(context.options.pipeline_size / 2, SIZE_MAX));
+    TEMPLA_PIPE<TEMPLA_PIPE_ITEM> read_pipe(budget), write_pipe(budget);
+    uint64_t stream_size = context.options.stream_size;
+
+    std::thread reader([&]() {
+        TEMPLA_THREAD_STATS *stats = context.thread_stats();
+        for (size_t i = 0; i < files.size() && !log.m_stop; ++i)
+        {
+            TEMPLA_PIPE_ITEM item;
+            item.index = i;
+
+            std::string native;
+            TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+            TEMPLA_READER reader;
+            bool ok = reader.open(templa_file_loc(files[i]->source, native));
+            item.whole = ok && stream_size && reader.m_size >= stream_size;
+            ok = ok && (item.whole || reader.read_all(item.data));
+            timer.stop();
+            if (!ok)
+            {
+                fprintf(stderr, "ERROR: Cannot read file '%ls'\n", files[i]->source.c_str());
+                log.finish(i, TEMPLA_RET_READERROR);
+                break;
+            }
+
+            size_t bytes = item.data.size();
+            item.size = bytes;
+            read_pipe.push(std::move(item), bytes);
+        }
+        read_pipe.close();
+    });
+
+    std::atomic<size_t> converters(jobs);
+    auto convert = [&]() {
+        TEMPLA_THREAD_STATS *stats = context.thread_stats();
+        TEMPLA_PIPE_ITEM item;
+        while (read_pipe.pop(item))
+        {
+            if (log.m_stop)
+                continue;
+            if (context.canceled())
+            {
+                log.finish(item.index, TEMPLA_RET_CANCELED);
+                continue;
+            }
+
+            if (!item.whole)
+            {
+                const TEMPLA_PLAN_ITEM& plan_item = *files[item.index];
+                uint64_t start = stats ? templa_now_ns() : 0, size = item.data.size();
+                TEMPLA_FILE file;
+                if (templa_convert(item.data.data(), item.data.size(), context, file))
+                {
+                    TEMPLA_PHASE_TIMER timer(stats, TP_ENCODE);
+                    file.encode();
+                    item.data.swap(file.m_binary);
+                }
+                templa_log(context, log.log(item.index), "%ls --> %ls [%s]\n",
+                           plan_item.source.c_str(), plan_item.destination.c_str(),
+                           templa_encoding_name(file.m_encoding));
+                if (stats)
+                {
+                    templa_stats_file(stats, plan_item.source, file.m_encoding, size,
+                                      item.data.size(), templa_now_ns() - start);
+                }
+            }
+
+            size_t bytes = item.data.size();
+            write_pipe.push(std::move(item), bytes);
+        }
+        if (--converters == 0)
+            write_pipe.close();
+    };
+
+    std::vector<std::thread> threads;
+    for (size_t i = 0; i < jobs; ++i)
+        threads.emplace_back(convert);
+
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    TEMPLA_PIPE_ITEM item;
+    while (write_pipe.pop(item))
+    {
+        if (log.m_stop)
+            continue;
+
+        const TEMPLA_PLAN_ITEM& plan_item = *files[item.index];
+        std::string native1, native2;
+        TEMPLA_FILE_LOC loc2 = templa_file_loc(plan_item.destination, native2);
+        TEMPLA_RET ret = TEMPLA_RET_OK;
+        if (item.whole)
+        {
+            ret = templa_file(plan_item.source, plan_item.destination, basename(plan_item.source),
+                              templa_file_loc(plan_item.source, native1), loc2, context,
+                              log.log(item.index));
+        }
+        else
+        {
+            TEMPLA_PHASE_TIMER timer(stats, TP_WRITE);
+            if (!templa_save_file_at(loc2, item.data.data(), item.data.size(), &context.options))
+            {
+                fprintf(stderr, "ERROR: Cannot write file '%ls'\n", plan_item.destination.c_str());
+                ret = TEMPLA_RET_WRITEERROR;
+            }
+            else
+            {
+                templa_written(plan_item.destination, context);
+                context.file_done(item.size);
+            }
+        }
+        log.finish(item.index, ret);
+    }
+
+    reader.join();
+    for (auto& thread : threads)
+        thread.join();
+    return log.result();
+}
+
+// templa_run_plan with a context.
+static TEMPLA_RET templa_run_plan(const templa_plan_t& plan, const TEMPLA_CONTEXT& context)
+{
+    // every folder first, parents before children
+    std::vector<const TEMPLA_PLAN_ITEM *> files;
+    uint64_t bytes = 0;
+    for (auto& item : plan)
+    {
+        if (context.canceled())
+            return TEMPLA_RET_CANCELED;
+
+        switch (item.type)
+        {
+        case TPT_FILE:
+            files.push_back(&item);
+            bytes += item.size;
+            break;
+        case TPT_DIR:
+            if (!templa_make_dir(item.destination))
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", item.destination.c_str());
+                return TEMPLA_RET_WRITEERROR;
+            }
+            templa_log(context, NULL, "%ls --> %ls [DIR]\n", item.source.c_str(),
+                       item.destination.c_str());
+            break;
+        case TPT_IGNORED:
+            templa_log(context, NULL, "%ls [ignored]\n", item.source.c_str());
+            if (context.stats)
+                ++context.thread_stats()->ignored;
+            break;
+        case TPT_LOOP:
+            templa_log(context, NULL, "%ls [loop]\n", item.source.c_str());
+            break;
+        }
+    }
+
+    context.reporter->total(files.size(), bytes);
+
+    std::stable_sort(files.begin(), files.end(),
+        [](const TEMPLA_PLAN_ITEM *a, const TEMPLA_PLAN_ITEM *b) { return a->order < b->order; });
+
+    // --incremental and --dedup decide file by file whether to read at all
+    size_t jobs = templa_jobs(context.options);
+    if (context.options.pipeline_size && !context.manifest && !context.dedup)
+        return templa_run_plan_pipeline(files, context, jobs);
+    return templa_run_plan_files(files, context, jobs);
+}
+
+TEMPLA_RET
+templa_run_plan(const templa_plan_t& plan, const mapping_t& mapping,
+                const string_list_t& ignore, const TEMPLA_OPTIONS& options,
+                templa_canceler_t canceler)
+{
+    if (plan.empty())
+        return TEMPLA_RET_OK;
+
+    // the root is the first item
+    string_t source = plan[0].source, destination = plan[0].destination;
+    while (source.size() > 1 && source[source.size() - 1] == TEMPLA_PATH_SEP)
+        source.resize(source.size() - 1);
+    while (destination.size() > 1 && destination[destination.size() - 1] == TEMPLA_PATH_SEP)
+        destination.resize(destination.size() - 1);
+    destination = dirname(destination);
+
+    TEMPLA_CONTEXT context(mapping, ignore, options, canceler);
+    return templa_run(source, destination, context,
+                      [&]() { return templa_run_plan(plan, context); });
+}
+
+// templa() with a context.
+static TEMPLA_RET
+templa(string_t source, string_t destination, TEMPLA_CONTEXT& context)
+{
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    TEMPLA_RET ret = templa_check_paths(source, destination);
+    if (ret != TEMPLA_RET_OK)
+        return ret;
+
+    auto dirname1 = dirname(source);
+    auto basename1 = basename(source);
+    const TEMPLA_OPTIONS& options = context.options;
+
+    bool plan = options.plan_only || options.ordered || options.pipeline_size;
+#ifdef TEMPLA_HAVE_IO_URING
+    plan = plan || options.uring_depth > 1;     // the batches are taken from a plan
+#endif
+    if (plan)
+    {
+        templa_plan_t plan;
+        TEMPLA_PHASE_TIMER timer(context.thread_stats(), TP_ENUMERATE);
+        ret = templa_make_plan(source, destination, context, plan);
+        timer.stop();
+        if (ret != TEMPLA_RET_OK)
+            return ret;
+
+        if (options.plan_only)
+        {
+            templa_print_plan(plan);
+            return TEMPLA_RET_OK;
+        }
+
+        if (plan[0].type == TPT_IGNORED)
+            return templa_run_plan(plan, context);
+
+        return templa_run(source, destination, context,
+                          [&]() { return templa_run_plan(plan, context); });
+    }
+
+    if (context.ignore.match(basename1))
+    {
+        templa_log(context, NULL, "%ls [ignored]\n", source.c_str());
+        return TEMPLA_RET_OK;
+    }
+
+    auto dirname2 = destination;
+
+    auto basename2 = basename1;
+    templa_map_filename(basename2, context.matcher);
+
+    auto file2 = dirname2 + basename2;
+
+    return templa_run(source, destination, context, [&]() {
+        if (templa_path_is_dir(source))
+        {
+            if (!templa_make_dir(file2))
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", file2.c_str());
+                return TEMPLA_RET_WRITEERROR;
+            }
+
+            size_t jobs = templa_jobs(options);
+            if (jobs == 1)
+                return templa_dir(source, file2, context);
+            return templa_dir_parallel(source, file2, context, jobs);
+        }
+
+        std::string native1, native2;
+        return templa_file(source, file2, basename1, templa_file_loc(source, native1),
+                           templa_file_loc(file2, native2), context);
+    });
+}
+
+TEMPLA_RET
+templa(string_t source, string_t destination, const mapping_t& mapping,
+       const string_list_t& ignore, const TEMPLA_OPTIONS& options,
+       templa_canceler_t canceler)
+{
     if (canceler && canceler())
         return TEMPLA_RET_CANCELED;
 
+    TEMPLA_CONTEXT context(mapping, ignore, options, canceler);
+    return templa(source, destination, context);
+}
+
+TEMPLA_JOB::TEMPLA_JOB(const mapping_t& mapping, const string_list_t& ignore,
+                       const TEMPLA_OPTIONS& options)
+    : m_compiled(std::make_shared<TEMPLA_COMPILED>(mapping, ignore))
+    , m_shared(std::make_shared<TEMPLA_JOB_SHARED>())
+    , m_options(options)
+{
+}
+
+TEMPLA_RET
+TEMPLA_JOB::run(string_t source, string_t destination, templa_callback_t callback, void *data,
+                TEMPLA_REPORTER *reporter) const
+{
+    TEMPLA_CONTEXT context(m_compiled, m_options, NULL,
+                           m_shared->get_reporter(reporter, m_options));
+    context.callback = callback;
+    context.callback_data = data;
+    context.job = m_shared.get();
+    return templa(source, destination, context);
+}
+
+bool TEMPLA_JOB::convert(const binary_t& input, binary_t& output) const
+{
+    static TEMPLA_QUIET_REPORTER s_quiet;
+    TEMPLA_CONTEXT context(m_compiled, m_options, NULL, &s_quiet);
+    TEMPLA_FILE file;
+    if (!templa_convert(input.data(), input.size(), context, file))
+    {
+        output.assign(input);
+        return false;
+    }
+
+    file.encode();
+    output.assign(file.m_binary);
+    return true;
+}
+
+bool TEMPLA_MEMORY_FS::enumerate(const string_t& dir, std::vector<TEMPLA_VFS_ENTRY>& entries)
+{
+    // the names right below dir, from the files and from the folders; a
+    // subtree is skipped at once ('0' is the character after '/')
+    std::map<string_t, bool> names;
+    for (auto it = files.lower_bound(dir); it != files.end(); )
     {
-        const char *type;
-        switch (file.m_encoding)
+        if (it->first.compare(0, dir.size(), dir) != 0)
+            break;
+        size_t ich = it->first.find(L'/', dir.size());
+        if (ich == string_t::npos)
         {
-        case TE_BINARY: type = "binary"; break;
-        case TE_UTF8: type = "UTF-8"; break;
-        case TE_UTF16: type = "UTF-16"; break;
-        case TE_UTF16BE: type = "UTF-16 BE"; break;
-        case TE_ANSI: type = "ANSI"; break;
-        case TE_ASCII: type = "ASCII"; break;
+            names[it->first.substr(dir.size())] = false;
+            ++it;
+            continue;
         }
-        printf("%ls --> %ls [%s]\n", file1.c_str(), file2.c_str(), type);
+        auto name = it->first.substr(dir.size(), ich - dir.size());
+        names[name] = true;
+        it = files.lower_bound(dir + name + L'0');
+    }
+    for (auto it = dirs.upper_bound(dir); it != dirs.end(); )
+    {
+        if (it->compare(0, dir.size(), dir) != 0)
+            break;
+        size_t ich = it->find(L'/', dir.size());
+        auto name = it->substr(dir.size(), ich - dir.size());
+        names[name] = true;
+        it = dirs.lower_bound(dir + name + L'0');
+    }
+    if (names.empty() && !dir.empty() && !dirs.count(dir))
+        return false;
+
+    entries.clear();
+    for (auto& pair : names)
+        entries.push_back({ pair.first, pair.second });
+    return true;
+}
+
+bool TEMPLA_MEMORY_FS::read(const string_t& path, binary_t& data)
+{
+    auto it = files.find(path);
+    if (it == files.end())
+        return false;
+    data = it->second;
+    return true;
+}
+
+bool TEMPLA_MEMORY_FS::mkdir(const string_t& dir)
+{
+    dirs.insert(dir);
+    return true;
+}
+
+bool TEMPLA_MEMORY_FS::write(const string_t& path, binary_t& data)
+{
+    files[path].swap(data);
+    return true;
+}
+
+// Convert data of file1 and write it to file2 of sink. data is taken.
+static TEMPLA_RET
+templa_sink_file(TEMPLA_SINK& sink, const string_t& file1, const string_t& file2, binary_t& data,
+                 uint64_t start, const TEMPLA_CONTEXT& context)
+{
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    TEMPLA_PHASE_TIMER timer(stats, TP_COUNT);
+    TEMPLA_FILE file;
+    bool changed = templa_convert(data.data(), data.size(), context, file);
+
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    templa_log(context, NULL, "%ls --> %ls [%s]\n", file1.c_str(), file2.c_str(),
+               templa_encoding_name(file.m_encoding));
+
+    uint64_t size1 = data.size();
+    if (changed)
+    {
+        timer.next(TP_ENCODE);
+        file.encode();
+        data.swap(file.m_binary);
     }
+    uint64_t size2 = data.size();
 
-    if (!file.save(file2))
+    timer.next(TP_WRITE);
+    bool ok = sink.write(file2, data);
+    timer.stop();
+    if (!ok)
     {
         fprintf(stderr, "ERROR: Cannot write file '%ls'\n", file2.c_str());
         return TEMPLA_RET_WRITEERROR;
     }
 
+    if (stats)
+        templa_stats_file(stats, file1, file.m_encoding, size1, size2, templa_now_ns() - start);
+    context.file_done(size1);
     return TEMPLA_RET_OK;
 }
 
+// templa_file for a source and a sink. The paths are relative to their roots.
 static TEMPLA_RET
-templa_dir(string_t dir1, string_t dir2, const mapping_t& mapping,
-           const string_list_t& ignore, templa_canceler_t canceler)
+templa_vfs_file(TEMPLA_SOURCE& source, TEMPLA_SINK& sink, const string_t& file1,
+                const string_t& file2, const string_t& basename1, const TEMPLA_CONTEXT& context)
 {
-    if (canceler && canceler())
+    if (context.canceled())
         return TEMPLA_RET_CANCELED;
 
-    add_backslash(dir1);
-    add_backslash(dir2);
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    if (context.ignore.match(basename1))
+    {
+        templa_log(context, NULL, "%ls [ignored]\n", file1.c_str());
+        if (stats)
+            ++stats->ignored;
+        return TEMPLA_RET_OK;
+    }
 
-    printf("%ls --> %ls [DIR]\n", dir1.c_str(), dir2.c_str());
+    uint64_t start = stats ? templa_now_ns() : 0;
+    TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+    binary_t data;
+    if (!source.read(file1, data))
+    {
+        fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+    timer.stop();
 
-    auto spec = dir1;
-    spec += L'*';
+    return templa_sink_file(sink, file1, file2, data, start, context);
+}
 
-    WIN32_FIND_DATAW find;
-    HANDLE hFind = FindFirstFileW(spec.c_str(), &find);
-    if (hFind == INVALID_HANDLE_VALUE)
+// templa_dir for a source and a sink. dir1 and dir2 are "" or end with '/'.
+static TEMPLA_RET
+templa_vfs_dir(TEMPLA_SOURCE& source, TEMPLA_SINK& sink, const string_t& dir1,
+               const string_t& dir2, const TEMPLA_CONTEXT& context)
+{
+    if (context.canceled())
+        return TEMPLA_RET_CANCELED;
+
+    if (!dir1.empty())
+        templa_log(context, NULL, "%ls --> %ls [DIR]\n", dir1.c_str(), dir2.c_str());
+
+    std::vector<TEMPLA_VFS_ENTRY> entries;
+    TEMPLA_PHASE_TIMER timer(context.thread_stats(), TP_ENUMERATE);
+    bool ok = source.enumerate(dir1, entries);
+    timer.stop();
+    if (!ok)
     {
         fprintf(stderr, "ERROR: '%ls': Not a directory\n", dir1.c_str());
         return TEMPLA_RET_READERROR;
     }
 
-    TEMPLA_RET ret = TEMPLA_RET_OK;
-    do
+    for (auto& entry : entries)
     {
-        if (canceler && canceler())
+        string_t filename2 = entry.name;
+        templa_map_filename(filename2, context.matcher);
+
+        TEMPLA_RET ret;
+        if (entry.is_dir)
         {
-            ret = TEMPLA_RET_CANCELED;
-            break;
+            auto sub1 = dir1 + entry.name + L'/', sub2 = dir2 + filename2 + L'/';
+            if (!sink.mkdir(sub2))
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", sub2.c_str());
+                return TEMPLA_RET_WRITEERROR;
+            }
+            ret = templa_vfs_dir(source, sink, sub1, sub2, context);
         }
+        else
+        {
+            ret = templa_vfs_file(source, sink, dir1 + entry.name, dir2 + filename2, entry.name,
+                                  context);
+        }
+        if (ret != TEMPLA_RET_OK)
+            return ret;
+    }
+    return TEMPLA_RET_OK;
+}
 
-        auto filename1 = find.cFileName;
-        if (filename1[0] == L'.')
+// The walk is sequential; --incremental, --dedup, --sync and the plan
+// are for the disk and are not used here.
+TEMPLA_RET
+TEMPLA_JOB::run(TEMPLA_SOURCE& source, TEMPLA_SINK& sink, templa_callback_t callback,
+                void *data, TEMPLA_REPORTER *reporter) const
+{
+    TEMPLA_CONTEXT context(m_compiled, m_options, NULL,
+                           m_shared->get_reporter(reporter, m_options));
+    context.callback = callback;
+    context.callback_data = data;
+
+    TEMPLA_RET ret = templa_vfs_dir(source, sink, string_t(), string_t(), context);
+    if (context.stats)
+        context.stats->merge(*m_options.stats, m_compiled->mapping);
+    return ret;
+}
+
+// A path of the plan into one of a sink.
+static string_t templa_vfs_path(string_t path)
+{
+#ifdef _WIN32
+    std::replace(path.begin(), path.end(), TEMPLA_PATH_SEP, L'/');
+#endif
+    return path;
+}
+
+// templa_run_plan into a sink, one file after another.
+static TEMPLA_RET
+templa_plan_sink(const templa_plan_t& plan, TEMPLA_SINK& sink, const TEMPLA_CONTEXT& context)
+{
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    binary_t data;
+    for (auto& item : plan)
+    {
+        if (context.canceled())
+            return TEMPLA_RET_CANCELED;
+
+        auto file2 = templa_vfs_path(item.destination);
+        if (item.type == TPT_IGNORED)
         {
-            if (filename1[1] == 0)
-                continue;
-            if (filename1[1] == L'.' && filename1[2] == 0)
+            templa_log(context, NULL, "%ls [ignored]\n", item.source.c_str());
+            if (stats)
+                ++stats->ignored;
+            continue;
+        }
+        if (item.type == TPT_LOOP)
+        {
+            templa_log(context, NULL, "%ls [loop]\n", item.source.c_str());
+            continue;
+        }
+        if (item.type == TPT_DIR)
+        {
+            if (!sink.mkdir(file2))
+            {
+                fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", file2.c_str());
+                return TEMPLA_RET_WRITEERROR;
+            }
+            templa_log(context, NULL, "%ls --> %ls [DIR]\n", item.source.c_str(), file2.c_str());
+            continue;
+        }
+
+        uint64_t start = stats ? templa_now_ns() : 0;
+        TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+        if (!templa_load_file(item.source, data))
+        {
+            fprintf(stderr, "ERROR: Cannot read file '%ls'\n", item.source.c_str());
+            return TEMPLA_RET_READERROR;
+        }
+        timer.stop();
+
+        TEMPLA_RET ret = templa_sink_file(sink, item.source, file2, data, start, context);
+        if (ret != TEMPLA_RET_OK)
+            return ret;
+    }
+    return TEMPLA_RET_OK;
+}
+
+TEMPLA_RET
+TEMPLA_JOB::run(string_t source, TEMPLA_SINK& sink, templa_callback_t callback, void *data,
+                TEMPLA_REPORTER *reporter) const
+{
+    TEMPLA_CONTEXT context(m_compiled, m_options, NULL,
+                           m_shared->get_reporter(reporter, m_options));
+    context.callback = callback;
+    context.callback_data = data;
+
+    while (source.size() > 1 && source[source.size() - 1] == TEMPLA_PATH_SEP)
+        source.resize(source.size() - 1);
+
+    templa_plan_t plan;
+    TEMPLA_PHASE_TIMER timer(context.thread_stats(), TP_ENUMERATE);
+    TEMPLA_RET ret = templa_make_plan(source, string_t(), context, plan);
+    timer.stop();
+    if (ret == TEMPLA_RET_OK)
+        ret = templa_plan_sink(plan, sink, context);
+
+    if (context.stats)
+        context.stats->merge(*m_options.stats, m_compiled->mapping);
+    return ret;
+}
+
+#define TEMPLA_TAR_BLOCK 512
+
+// A number field of a tar header: octal digits and a NUL, or base-256
+// if it does not fit (as GNU tar does for sizes of 8 GiB or more).
+static void templa_tar_put_number(char *field, size_t width, uint64_t value)
+{
+    if (value >> (3 * (width - 1)))
+    {
+        memset(field, 0, width);
+        field[0] = char(0x80);
+        for (size_t i = width - 1; i > 0; --i, value >>= 8)
+            field[i] = char(value & 0xFF);
+        return;
+    }
+    field[width - 1] = 0;
+    for (size_t i = width - 1; i-- > 0; value >>= 3)
+        field[i] = char('0' + (value & 7));
+}
+
+static uint64_t templa_tar_get_number(const char *field, size_t width)
+{
+    uint64_t value = 0;
+    if (field[0] & 0x80)
+    {
+        for (size_t i = 1; i < width; ++i)
+            value = (value << 8) | uint8_t(field[i]);
+        return value;
+    }
+    size_t i = 0;
+    while (i < width && field[i] == ' ')
+        ++i;
+    for (; i < width && '0' <= field[i] && field[i] <= '7'; ++i)
+        value = (value << 3) | uint64_t(field[i] - '0');
+    return value;
+}
+
+// The sum of the header bytes, with the checksum field taken as spaces.
+static uint64_t templa_tar_checksum(const char *block, bool is_signed)
+{
+    uint64_t sum = 8 * ' ';
+    for (size_t i = 0; i < TEMPLA_TAR_BLOCK; ++i)
+    {
+        if (148 <= i && i < 156)
+            continue;
+        sum += is_signed ? uint64_t(int64_t(int8_t(block[i]))) : uint64_t(uint8_t(block[i]));
+    }
+    return sum;
+}
+
+static std::string templa_tar_get_string(const char *field, size_t width)
+{
+    return std::string(field, std::find(field, field + width, '\0'));
+}
+
+TEMPLA_TAR_WRITER::TEMPLA_TAR_WRITER(FILE *fp)
+    : m_fp(fp)
+    , m_mtime(uint64_t(time(NULL)))
+{
+}
+
+bool TEMPLA_TAR_WRITER::data(const char *ptr, size_t size)
+{
+    static const char zeros[TEMPLA_TAR_BLOCK] = { 0 };
+    size_t padding = (TEMPLA_TAR_BLOCK - size % TEMPLA_TAR_BLOCK) % TEMPLA_TAR_BLOCK;
+    return fwrite(ptr, 1, size, m_fp) == size && fwrite(zeros, 1, padding, m_fp) == padding;
+}
+
+bool TEMPLA_TAR_WRITER::header(const binary_t& name, char type, uint64_t size)
+{
+    char block[TEMPLA_TAR_BLOCK];
+    memset(block, 0, sizeof(block));
+
+    // a long name is split into the prefix and the name fields, or else
+    // given in a pax header before
+    size_t ich = binary_t::npos;
+    if (name.size() > 100)
+    {
+        ich = name.find('/', name.size() - 101);
+        if (ich == binary_t::npos || ich > 155 || ich + 1 >= name.size())
+        {
+            binary_t record = " path=" + name + "\n";
+            size_t length = record.size() + 1;
+            while (std::to_string(length).size() + record.size() != length)
+                length = std::to_string(length).size() + record.size();
+            record = std::to_string(length) + record;
+            if (!header("././@PaxHeader", 'x', record.size()) ||
+                !data(record.data(), record.size()))
+            {
+                return false;
+            }
+            ich = binary_t::npos;
+        }
+        else
+        {
+            memcpy(block + 345, name.data(), ich);
+        }
+    }
+    binary_t field = (ich == binary_t::npos) ? name.substr(0, 100) : name.substr(ich + 1);
+    memcpy(block, field.data(), field.size());
+
+    templa_tar_put_number(block + 100, 8, (type == '5') ? 0755 : 0644);
+    templa_tar_put_number(block + 108, 8, 0);
+    templa_tar_put_number(block + 116, 8, 0);
+    templa_tar_put_number(block + 124, 12, size);
+    templa_tar_put_number(block + 136, 12, m_mtime);
+    block[156] = type;
+    memcpy(block + 257, "ustar\0" "00", 8);
+    templa_tar_put_number(block + 148, 7, templa_tar_checksum(block, false));
+    block[155] = ' ';
+
+    return fwrite(block, 1, sizeof(block), m_fp) == sizeof(block);
+}
+
+bool TEMPLA_TAR_WRITER::mkdir(const string_t& dir)
+{
+    binary_t name;
+    string_to_utf8(dir.data(), dir.size(), name, true);
+    return header(name, '5', 0);
+}
+
+bool TEMPLA_TAR_WRITER::write(const string_t& path, binary_t& data)
+{
+    binary_t name;
+    string_to_utf8(path.data(), path.size(), name, true);
+    return header(name, '0', data.size()) && this->data(data.data(), data.size());
+}
+
+bool TEMPLA_TAR_WRITER::finish()
+{
+    static const char zeros[2 * TEMPLA_TAR_BLOCK] = { 0 };
+    return fwrite(zeros, 1, sizeof(zeros), m_fp) == sizeof(zeros) && fflush(m_fp) == 0;
+}
+
+// Reads a tar archive from a stream, a member at a time: next() gives the
+// header, then read() or skip() takes the contents.
+struct TEMPLA_TAR_READER
+{
+    FILE *m_fp;
+
+    TEMPLA_TAR_READER(FILE *fp) : m_fp(fp)
+    {
+    }
+
+    // 1 for a member, 0 at the end of the archive, or -1 if it is broken.
+    int next(binary_t& name, char& type, uint64_t& size)
+    {
+        binary_t long_name, data;
+        uint64_t long_size = UINT64_MAX;
+        for (;;)
+        {
+            char block[TEMPLA_TAR_BLOCK];
+            size_t got = fread(block, 1, sizeof(block), m_fp);
+            if (got == 0 && feof(m_fp))
+                return 0;   // no end blocks
+            if (got != sizeof(block))
+                return -1;
+            if (std::count(block, block + sizeof(block), '\0') == sizeof(block))
+                return 0;
+
+            uint64_t checksum = templa_tar_get_number(block + 148, 8);
+            if (checksum != templa_tar_checksum(block, false) &&
+                checksum != templa_tar_checksum(block, true))
+            {
+                return -1;
+            }
+
+            type = block[156];
+            size = templa_tar_get_number(block + 124, 12);
+            if (type == 'L' || type == 'x' || type == 'g' || type == 'K')
+            {
+                if (!read(size, data))
+                    return -1;
+                if (type == 'L')
+                    long_name = templa_tar_get_string(data.data(), data.size());
+                else if (type == 'x')
+                    parse_pax(data, long_name, long_size);
                 continue;
+            }
+
+            if (!long_name.empty())
+            {
+                name = long_name;
+            }
+            else
+            {
+                name = templa_tar_get_string(block, 100);
+                auto prefix = templa_tar_get_string(block + 345, 155);
+                if (memcmp(block + 257, "ustar", 5) == 0 && !prefix.empty())
+                    name = prefix + "/" + name;
+            }
+            if (long_size != UINT64_MAX)
+                size = long_size;
+            return 1;
         }
+    }
 
-        auto file1 = dir1 + filename1;
-        string_t filename2 = filename1;
-        for (auto& pair : mapping)
+    // The records of a pax header: "LENGTH KEY=VALUE\n".
+    static void parse_pax(const binary_t& data, binary_t& path, uint64_t& size)
+    {
+        size_t ich = 0;
+        while (ich < data.size())
         {
-            str_replace(filename2, pair.first, pair.second);
+            size_t length = size_t(strtoull(data.c_str() + ich, NULL, 10));
+            size_t space = data.find(' ', ich), equal = data.find('=', ich);
+            if (!length || ich + length > data.size() || space == binary_t::npos ||
+                equal == binary_t::npos || equal >= ich + length)
+            {
+                break;
+            }
+            auto key = data.substr(space + 1, equal - space - 1);
+            auto value = data.substr(equal + 1, ich + length - equal - 2);
+            if (key == "path")
+                path = value;
+            else if (key == "size")
+                size = strtoull(value.c_str(), NULL, 10);
+            ich += length;
         }
-        templa_validate_filename(filename2);
+    }
 
-        auto file2 = dir2 + filename2;
+    bool read(uint64_t size, binary_t& data)
+    {
+        if (size > SIZE_MAX)
+            return false;
+        data.resize(size_t(size));
+        if (size && fread(&data[0], 1, data.size(), m_fp) != data.size())
+            return false;
+        return skip_bytes((TEMPLA_TAR_BLOCK - size % TEMPLA_TAR_BLOCK) % TEMPLA_TAR_BLOCK);
+    }
 
-        if (find.dwFileAttributes & FILE_ATTRIBUTE_DIRECTORY)
+    bool skip(uint64_t size)
+    {
+        return skip_bytes((size + TEMPLA_TAR_BLOCK - 1) / TEMPLA_TAR_BLOCK * TEMPLA_TAR_BLOCK);
+    }
+
+    // by reading, as a pipe cannot seek
+    bool skip_bytes(uint64_t size)
+    {
+        char buf[16 * TEMPLA_TAR_BLOCK];
+        while (size)
         {
-            if (!PathIsDirectoryW(file2.c_str()) && !CreateDirectoryW(file2.c_str(), NULL))
+            size_t chunk = size_t(std::min<uint64_t>(size, sizeof(buf)));
+            if (fread(buf, 1, chunk, m_fp) != chunk)
+                return false;
+            size -= chunk;
+        }
+        return true;
+    }
+};
+
+// The name of a member as templa_dir would name it: each part mapped, and
+// "", "." and the leading '/' dropped. Empty for the root.
+static string_t
+templa_tar_map_name(const string_t& name, const TEMPLA_CONTEXT& context, string_t& basename1)
+{
+    string_list_t parts;
+    str_split(parts, name, string_t(L"/"));
+
+    string_t ret;
+    for (auto& part : parts)
+    {
+        if (part.empty() || part == L".")
+            continue;
+        basename1 = part;
+        templa_map_filename(part, context.matcher);
+        if (!ret.empty())
+            ret += L'/';
+        ret += part;
+    }
+    return ret;
+}
+
+static TEMPLA_RET templa_tar(FILE *input, TEMPLA_SINK& sink, const TEMPLA_CONTEXT& context)
+{
+    TEMPLA_THREAD_STATS *stats = context.thread_stats();
+    TEMPLA_TAR_READER tar(input);
+    binary_t name, data;
+    for (;;)
+    {
+        if (context.canceled())
+            return TEMPLA_RET_CANCELED;
+
+        uint64_t start = stats ? templa_now_ns() : 0;
+        TEMPLA_PHASE_TIMER timer(stats, TP_READ);
+        char type;
+        uint64_t size;
+        int got = tar.next(name, type, size);
+        if (got == 0)
+            return TEMPLA_RET_OK;
+        if (got < 0)
+        {
+            fprintf(stderr, "ERROR: Invalid tar archive\n");
+            return TEMPLA_RET_READERROR;
+        }
+
+        string_t file1, basename1;
+        utf8_to_string(name.data(), name.size(), file1, true);
+        string_t file2 = templa_tar_map_name(file1, context, basename1);
+
+        bool ok = true;
+        if (type == '5' && !file2.empty())
+        {
+            file2 += L'/';
+            if (!sink.mkdir(file2))
             {
                 fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", file2.c_str());
-                ret = TEMPLA_RET_WRITEERROR;
-                break;
+                return TEMPLA_RET_WRITEERROR;
             }
-            ret = templa_dir(file1, file2, mapping, ignore, canceler);
-            if (ret != TEMPLA_RET_OK)
-                break;
+            templa_log(context, NULL, "%ls --> %ls [DIR]\n", file1.c_str(), file2.c_str());
+            ok = tar.skip(size);
+        }
+        else if (type != '0' && type != '\0' && type != '7')
+        {
+            // links and special files
+            if (!file2.empty())
+                templa_log(context, NULL, "%ls [skipped]\n", file1.c_str());
+            ok = tar.skip(size);
+        }
+        else if (file2.empty() || context.ignore.match(basename1))
+        {
+            templa_log(context, NULL, "%ls [ignored]\n", file1.c_str());
+            if (stats)
+                ++stats->ignored;
+            ok = tar.skip(size);
         }
         else
         {
-            ret = templa_file(file1, file2, mapping, ignore, canceler);
+            if (!tar.read(size, data))
+            {
+                fprintf(stderr, "ERROR: Cannot read file '%ls'\n", file1.c_str());
+                return TEMPLA_RET_READERROR;
+            }
+            timer.stop();
+
+            TEMPLA_RET ret = templa_sink_file(sink, file1, file2, data, start, context);
             if (ret != TEMPLA_RET_OK)
-                break;
+                return ret;
         }
-    } while (FindNextFileW(hFind, &find));
 
-    FindClose(hFind);
+        if (!ok)
+        {
+            fprintf(stderr, "ERROR: Invalid tar archive\n");
+            return TEMPLA_RET_READERROR;
+        }
+    }
+}
+
+TEMPLA_RET
+TEMPLA_JOB::run_tar(FILE *input, TEMPLA_SINK& sink, templa_callback_t callback, void *data,
+                    TEMPLA_REPORTER *reporter) const
+{
+    TEMPLA_CONTEXT context(m_compiled, m_options, NULL,
+                           m_shared->get_reporter(reporter, m_options));
+    context.callback = callback;
+    context.callback_data = data;
+
+    TEMPLA_RET ret = templa_tar(input, sink, context);
+    if (context.stats)
+        context.stats->merge(*m_options.stats, m_compiled->mapping);
     return ret;
 }
 
-bool templa_validate_filename(string_t& filename)
+// A destination folder as a sink, for --tar-input. The folders of a file
+// are made if the archive does not have them.
+class TEMPLA_DISK_SINK : public TEMPLA_SINK
 {
-    bool ret = false;
+public:
+    TEMPLA_DISK_SINK(const string_t& root, const TEMPLA_OPTIONS& options)
+        : m_root(root)
+        , m_options(options)
+    {
+        add_backslash(m_root);
+    }
 
-    str_trim_left(filename, L" \t\r\n\x3000");
-    str_trim_right(filename, L" .\t\r\n\x3000");
+    bool mkdir(const string_t& dir)
+    {
+        return templa_make_dir(path(dir));
+    }
 
-    if (filename.empty())
-        filename = L"_";
+    bool write(const string_t& file, binary_t& data)
+    {
+        std::string native;
+        auto path2 = path(file);
+        if (templa_save_file_at(templa_file_loc(path2, native), data.data(), data.size(),
+                                &m_options))
+        {
+            return true;
+        }
 
-    // Replace invalid characters
-    for (auto& ch : filename)
+        for (size_t ich = file.find(L'/'); ich != string_t::npos; ich = file.find(L'/', ich + 1))
+            templa_make_dir(path(file.substr(0, ich)));
+        return templa_save_file_at(templa_file_loc(path2, native), data.data(), data.size(),
+                                   &m_options);
+    }
+
+protected:
+    string_t m_root;
+    const TEMPLA_OPTIONS& m_options;
+
+    string_t path(string_t file) const
     {
-        switch (ch)
+#ifdef _WIN32
+        std::replace(file.begin(), file.end(), L'/', TEMPLA_PATH_SEP);
+#endif
+        return m_root + file;
+    }
+};
+
+// A file of --tar-input or --tar-output, or "-" for the standard input or
+// output.
+static FILE *templa_open_tar(const string_t& filename, bool output)
+{
+    if (filename == L"-")
+    {
+        FILE *fp = output ? stdout : stdin;
+#ifdef _WIN32
+        _setmode(_fileno(fp), _O_BINARY);
+#endif
+        return fp;
+    }
+#ifdef _WIN32
+    return _wfopen(filename.c_str(), output ? L"wb" : L"rb");
+#else
+    return fopen(string_to_native(filename).c_str(), output ? "wb" : "rb");
+#endif
+}
+
+// templa_main with --tar-input and/or --tar-output.
+static TEMPLA_RET
+templa_main_tar(const string_t& input, const string_t& output, const std::vector<string_t>& files,
+                const mapping_t& mapping, const string_list_t& ignore,
+                const TEMPLA_OPTIONS& options)
+{
+    FILE *fp_in = NULL, *fp_out = NULL;
+    if (!input.empty() && !(fp_in = templa_open_tar(input, false)))
+    {
+        fprintf(stderr, "ERROR: Cannot read file '%ls'\n", input.c_str());
+        return TEMPLA_RET_READERROR;
+    }
+    if (!output.empty() && !(fp_out = templa_open_tar(output, true)))
+    {
+        fprintf(stderr, "ERROR: Cannot write file '%ls'\n", output.c_str());
+        if (fp_in && fp_in != stdin)
+            fclose(fp_in);
+        return TEMPLA_RET_WRITEERROR;
+    }
+
+    TEMPLA_JOB job(mapping, ignore, options);
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    if (!fp_out)
+    {
+        if (!templa_path_is_dir(files[0]))
         {
-        case '\\': case '/': case ':': case '*': case '?':
-        case '"': case '<': case '>': case '|':
-            ch = '_';
-            ret = true;
-            break;
+            fprintf(stderr, "ERROR: '%ls' is not a directory\n", files[0].c_str());
+            ret = TEMPLA_RET_WRITEERROR;
+        }
+        else
+        {
+            TEMPLA_DISK_SINK sink(files[0], options);
+            ret = job.run_tar(fp_in, sink);
         }
     }
-
-    // Check invalida names
-    if (lstrcmpiW(filename.c_str(), L"CON") == 0 ||
-        lstrcmpiW(filename.c_str(), L"PRN") == 0 ||
-        lstrcmpiW(filename.c_str(), L"AUX") == 0 ||
-        lstrcmpiW(filename.c_str(), L"NUL") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM0") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM1") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM2") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM3") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM4") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM5") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM6") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM7") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM8") == 0 ||
-        lstrcmpiW(filename.c_str(), L"COM9") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT0") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT1") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT2") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT3") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT4") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT5") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT6") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT7") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT8") == 0 ||
-        lstrcmpiW(filename.c_str(), L"LPT9") == 0)
+    else
     {
-        ret = true;
-        filename += L'_';
+        TEMPLA_TAR_WRITER tar(fp_out);
+        if (fp_in)
+            ret = job.run_tar(fp_in, tar);
+        for (size_t i = 0; i < files.size() && ret == TEMPLA_RET_OK; ++i)
+            ret = job.run(files[i], tar);
+        if (!tar.finish() && ret == TEMPLA_RET_OK)
+        {
+            fprintf(stderr, "ERROR: Cannot write file '%ls'\n", output.c_str());
+            ret = TEMPLA_RET_WRITEERROR;
+        }
     }
 
-    if (filename == L".")
+    if (fp_in && fp_in != stdin)
+        fclose(fp_in);
+    if (fp_out && fp_out != stdout && fclose(fp_out) != 0 && ret == TEMPLA_RET_OK)
     {
-        ret = true;
-        filename = L"_";
+        fprintf(stderr, "ERROR: Cannot write file '%ls'\n", output.c_str());
+        ret = TEMPLA_RET_WRITEERROR;
     }
-    else if (filename == L"..")
+    return ret;
+}
+
+bool templa_load_mapping(const string_t& filename, mapping_t& mapping)
+{
+    TEMPLA_FILE file;
+    if (!file.load(filename) || file.m_encoding == TE_BINARY)
+        return false;
+
+    string_list_t lines;
+    str_split(lines, file.m_string, string_t(L"\r\n"));
+    for (auto& line : lines)
     {
-        ret = true;
-        filename = L"__";
+        if (line.empty())
+            continue;
+
+        size_t ich = line.find(L'\t');
+        if (ich == line.npos)
+            return false;
+
+        mapping[line.substr(0, ich)] = line.substr(ich + 1);
     }
 
-    return ret;
+    return true;
 }
 
-TEMPLA_RET
-templa(string_t source, string_t destination, const mapping_t& mapping,
-       const string_list_t& ignore, templa_canceler_t canceler)
+static const char *const templa_phase_names[TP_COUNT] =
 {
-    if (canceler && canceler())
-        return TEMPLA_RET_CANCELED;
+    "enumerate", "read", "detect", "decode", "replace", "newline", "encode", "write",
+};
 
-    backslash_to_slash(source);
-    backslash_to_slash(destination);
+static std::string templa_stats_utf8(const string_t& str)
+{
+    binary_t ret;
+    string_to_utf8(str.data(), str.size(), ret);
+    return ret;
+}
+
+std::string templa_stats_text(const TEMPLA_STATS& stats)
+{
+    std::string ret;
+    templa_append(ret, "Files: %llu converted or copied, %llu skipped, %llu ignored\n",
+               (unsigned long long)stats.files, (unsigned long long)stats.skipped,
+               (unsigned long long)stats.ignored);
 
-    if (!PathFileExistsW(source.c_str()))
+    templa_append(ret, "Encodings:");
+    const char *sep = " ";
+    for (int i = 0; i < 6; ++i)
     {
-        fprintf(stderr, "ERROR: File '%ls' not found\n", source.c_str());
-        return TEMPLA_RET_READERROR;
+        if (!stats.encodings[i])
+            continue;
+        templa_append(ret, "%s%s %llu", sep, templa_encoding_name(TEMPLA_ENCODING(i)),
+                   (unsigned long long)stats.encodings[i]);
+        sep = ", ";
     }
+    templa_append(ret, "\n");
 
-    if (!PathIsDirectoryW(destination.c_str()))
+    templa_append(ret, "Bytes: %llu in, %llu out\n",
+               (unsigned long long)stats.bytes_in, (unsigned long long)stats.bytes_out);
+    templa_append(ret, "Time: %.3f s\n", stats.elapsed_ns / 1e9);
+    templa_append(ret, "Phases (summed over threads):\n");
+    for (int i = 0; i < TP_COUNT; ++i)
+        templa_append(ret, "  %-10s %.3f s\n", templa_phase_names[i], stats.phase_ns[i] / 1e9);
+
+    if (!stats.replacements.empty())
     {
-        fprintf(stderr, "ERROR: '%ls' is not a directory\n", destination.c_str());
-        return TEMPLA_RET_WRITEERROR;
+        templa_append(ret, "Replacements:\n");
+        for (auto& pair : stats.replacements)
+        {
+            templa_append(ret, "  %s: %llu\n", templa_stats_utf8(pair.first).c_str(),
+                       (unsigned long long)pair.second);
+        }
     }
-
+    if (!stats.largest.empty())
     {
-        WCHAR szPath1[MAX_PATH], szPath2[MAX_PATH];
-        GetFullPathNameW(source.c_str(), _countof(szPath1), szPath1, NULL);
-        GetFullPathNameW(destination.c_str(), _countof(szPath2), szPath2, NULL);
-        if (PathIsDirectoryW(szPath1))
-            PathAddBackslash(szPath1);
-        if (PathIsDirectoryW(szPath2))
-            PathAddBackslash(szPath2);
-
-        if (lstrcmpiW(szPath1, szPath2) == 0)
+        templa_append(ret, "Largest files:\n");
+        for (auto& pair : stats.largest)
         {
-            fprintf(stderr, "ERROR: Destination '%ls' is same as source\n", szPath1);
-            return TEMPLA_RET_LOGICALERROR;
+            templa_append(ret, "  %12llu bytes  %s\n", (unsigned long long)pair.second,
+                       templa_stats_utf8(pair.first).c_str());
         }
-
-        string_t src = szPath1, dest = szPath2;
-        if (dest.find(src) == 0)
+    }
+    if (!stats.slowest.empty())
+    {
+        templa_append(ret, "Slowest files:\n");
+        for (auto& pair : stats.slowest)
         {
-            fprintf(stderr, "ERROR: Source '%ls' contains destination '%ls'\n",
-                    src.c_str(), dest.c_str());
-            return TEMPLA_RET_LOGICALERROR;
+            templa_append(ret, "  %12.6f s  %s\n", pair.second / 1e9,
+                       templa_stats_utf8(pair.first).c_str());
         }
     }
+    return ret;
+}
 
-    add_backslash(destination);
-
-    auto dirname1 = dirname(source);
-    auto basename1 = basename(source);
-
-    for (auto& ignore_item : ignore)
+// A JSON string of str.
+static std::string templa_json_string(const string_t& str)
+{
+    std::string ret = "\"";
+    for (char ch : templa_stats_utf8(str))
     {
-        if (templa_wildcard(basename1, ignore_item))
+        if (ch == '"' || ch == '\\')
         {
-            printf("%ls [ignored]\n", source.c_str());
-            return TEMPLA_RET_OK;
+            ret += '\\';
+            ret += ch;
+        }
+        else if (uint8_t(ch) < 0x20)
+        {
+            templa_append(ret, "\\u%04x", unsigned(ch));
+        }
+        else
+        {
+            ret += ch;
         }
     }
+    ret += '"';
+    return ret;
+}
 
-    auto dirname2 = destination;
-
-    auto basename2 = basename1;
-    for (auto& pair : mapping)
+static void
+templa_json_top(std::string& ret, const char *name, const char *unit,
+                const std::vector<std::pair<string_t, uint64_t> >& top)
+{
+    templa_append(ret, "  \"%s\": [", name);
+    for (size_t i = 0; i < top.size(); ++i)
     {
-        str_replace(basename2, pair.first, pair.second);
+        templa_append(ret, "%s\n    { \"file\": %s, \"%s\": %llu }", i ? "," : "",
+                   templa_json_string(top[i].first).c_str(), unit,
+                   (unsigned long long)top[i].second);
     }
+    templa_append(ret, "%s]", top.empty() ? "" : "\n  ");
+}
 
-    templa_validate_filename(basename2);
+std::string templa_stats_json(const TEMPLA_STATS& stats)
+{
+    std::string ret = "{\n";
+    templa_append(ret, "  \"elapsed_ns\": %llu,\n", (unsigned long long)stats.elapsed_ns);
+    templa_append(ret, "  \"files\": %llu,\n", (unsigned long long)stats.files);
+    templa_append(ret, "  \"skipped\": %llu,\n", (unsigned long long)stats.skipped);
+    templa_append(ret, "  \"ignored\": %llu,\n", (unsigned long long)stats.ignored);
+    templa_append(ret, "  \"bytes_in\": %llu,\n", (unsigned long long)stats.bytes_in);
+    templa_append(ret, "  \"bytes_out\": %llu,\n", (unsigned long long)stats.bytes_out);
 
-    auto file2 = dirname2 + basename2;
+    templa_append(ret, "  \"encodings\": {");
+    for (int i = 0; i < 6; ++i)
+    {
+        templa_append(ret, "%s \"%s\": %llu", i ? "," : "", templa_encoding_name(TEMPLA_ENCODING(i)),
+                   (unsigned long long)stats.encodings[i]);
+    }
+    templa_append(ret, " },\n");
 
-    if (PathIsDirectoryW(source.c_str()))
+    templa_append(ret, "  \"phase_ns\": {");
+    for (int i = 0; i < TP_COUNT; ++i)
     {
-        if (!PathIsDirectoryW(file2.c_str()) && !CreateDirectoryW(file2.c_str(), NULL))
-        {
-            fprintf(stderr, "ERROR: Cannot create folder '%ls'\n", file2.c_str());
-            return TEMPLA_RET_WRITEERROR;
-        }
-        return templa_dir(source, file2, mapping, ignore, canceler);
+        templa_append(ret, "%s \"%s\": %llu", i ? "," : "", templa_phase_names[i],
+                   (unsigned long long)stats.phase_ns[i]);
+    }
+    templa_append(ret, " },\n");
+
+    templa_append(ret, "  \"replacements\": {");
+    const char *sep = "";
+    for (auto& pair : stats.replacements)
+    {
+        templa_append(ret, "%s\n    %s: %llu", sep, templa_json_string(pair.first).c_str(),
+                   (unsigned long long)pair.second);
+        sep = ",";
     }
+    templa_append(ret, "%s},\n", stats.replacements.empty() ? "" : "\n  ");
+
+    templa_json_top(ret, "largest", "bytes", stats.largest);
+    templa_append(ret, ",\n");
+    templa_json_top(ret, "slowest", "ns", stats.slowest);
+    templa_append(ret, "\n}\n");
+    return ret;
+}
 
-    return templa_file(source, file2, mapping, ignore, canceler);
+// Parse a size in bytes, with an optional K, M or G suffix.
+static bool templa_parse_size(const wchar_t *str, uint64_t& size)
+{
+    wchar_t *end;
+    size = wcstoull(str, &end, 10);
+    switch (*end)
+    {
+    case L'K': case L'k': size <<= 10; ++end; break;
+    case L'M': case L'm': size <<= 20; ++end; break;
+    case L'G': case L'g': size <<= 30; ++end; break;
+    }
+    return L'0' <= str[0] && str[0] <= L'9' && !*end;
 }
 
 TEMPLA_RET
@@ -723,6 +7295,12 @@ templa_main(int argc, wchar_t **argv)
     mapping_t mapping;
     std::vector<string_t> files;
     string_list_t ignore;
+    TEMPLA_OPTIONS options;
+    TEMPLA_REPORT report = TR_LOG;
+    TEMPLA_STATS stats;
+    bool stats_text = false;
+    string_t stats_json;
+    string_t tar_input, tar_output;
 
     str_split(ignore, string_t(L"q;*.bin;.git;.svn;.vs"), string_t(L";"));
 
@@ -758,6 +7336,25 @@ templa_main(int argc, wchar_t **argv)
             }
         }
 
+        if (arg == L"--mapping-file")
+        {
+            if (iarg + 1 < argc)
+            {
+                if (!templa_load_mapping(argv[iarg + 1], mapping))
+                {
+                    fprintf(stderr, "ERROR: Cannot load mapping file '%ls'\n", argv[iarg + 1]);
+                    return TEMPLA_RET_READERROR;
+                }
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '--mapping-file' requires one argument\n");
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
         if (arg == L"--ignore")
         {
             if (iarg + 1 < argc)
@@ -773,6 +7370,181 @@ templa_main(int argc, wchar_t **argv)
             }
         }
 
+        if (arg == L"--force-decode")
+        {
+            options.force_decode = true;
+            continue;
+        }
+
+        if (arg == L"--incremental")
+        {
+            options.incremental = true;
+            continue;
+        }
+
+        if (arg == L"--ordered")
+        {
+            options.ordered = true;
+            continue;
+        }
+
+        if (arg == L"--plan")
+        {
+            options.plan_only = true;
+            continue;
+        }
+
+        if (arg == L"--atomic")
+        {
+            options.atomic = true;
+            continue;
+        }
+
+        if (arg == L"--quiet" || arg == L"--progress")
+        {
+            report = (arg == L"--quiet") ? TR_QUIET : TR_PROGRESS;
+            continue;
+        }
+
+        if (arg == L"--stats")
+        {
+            stats_text = true;
+            continue;
+        }
+
+        if (arg == L"--stats-json")
+        {
+            if (iarg + 1 < argc)
+            {
+                stats_json = argv[iarg + 1];
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '--stats-json' requires one argument\n");
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
+        if (arg == L"--tar-input" || arg == L"--tar-output")
+        {
+            if (iarg + 1 < argc)
+            {
+                (arg == L"--tar-input" ? tar_input : tar_output) = argv[iarg + 1];
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '%ls' requires one argument\n", arg.c_str());
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
+        if (arg == L"--sync")
+        {
+            if (iarg + 1 < argc)
+            {
+                string_t mode = argv[iarg + 1];
+                if (mode == L"none")
+                    options.sync = TS_NONE;
+                else if (mode == L"file")
+                    options.sync = TS_FILE;
+                else if (mode == L"batch")
+                    options.sync = TS_BATCH;
+                else
+                {
+                    fprintf(stderr, "ERROR: Invalid sync mode '%ls'\n", argv[iarg + 1]);
+                    return TEMPLA_RET_SYNTAXERROR;
+                }
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '--sync' requires one argument\n");
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
+        if (arg == L"--dedup")
+        {
+            options.dedup = true;
+            continue;
+        }
+
+        if (arg == L"--hardlinks")
+        {
+            options.hardlinks = true;
+            continue;
+        }
+
+        if (arg == L"--stream-size" || arg == L"--pipeline")
+        {
+            if (iarg + 1 < argc)
+            {
+                uint64_t size;
+                if (!templa_parse_size(argv[iarg + 1], size))
+                {
+                    fprintf(stderr, "ERROR: Invalid size '%ls'\n", argv[iarg + 1]);
+                    return TEMPLA_RET_SYNTAXERROR;
+                }
+                (arg == L"--pipeline" ? options.pipeline_size : options.stream_size) = size;
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '%ls' requires one argument\n", arg.c_str());
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
+        if (arg == L"--jobs")
+        {
+            if (iarg + 1 < argc)
+            {
+                wchar_t *end;
+                unsigned long jobs = wcstoul(argv[iarg + 1], &end, 10);
+                if (!argv[iarg + 1][0] || *end || jobs < 1 || jobs > 1024)
+                {
+                    fprintf(stderr, "ERROR: Invalid number of jobs '%ls'\n", argv[iarg + 1]);
+                    return TEMPLA_RET_SYNTAXERROR;
+                }
+                options.jobs = unsigned(jobs);
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '--jobs' requires one argument\n");
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
+        if (arg == L"--io-uring")
+        {
+            if (iarg + 1 < argc)
+            {
+                wchar_t *end;
+                unsigned long depth = wcstoul(argv[iarg + 1], &end, 10);
+                if (!argv[iarg + 1][0] || *end || depth > 1024)
+                {
+                    fprintf(stderr, "ERROR: Invalid queue depth '%ls'\n", argv[iarg + 1]);
+                    return TEMPLA_RET_SYNTAXERROR;
+                }
+                options.uring_depth = unsigned(depth);
+                iarg += 1;
+                continue;
+            }
+            else
+            {
+                fprintf(stderr, "ERROR: Option '--io-uring' requires one argument\n");
+                return TEMPLA_RET_SYNTAXERROR;
+            }
+        }
+
         if (arg[0] == L'-')
         {
             fprintf(stderr, "ERROR: '%ls' is invalid option\n", arg.c_str());
@@ -782,20 +7554,86 @@ templa_main(int argc, wchar_t **argv)
         files.push_back(arg);
     }
 
-    if (files.size() <= 1)
+    // the sources, then the destination, unless they are tar archives
+    size_t count = files.size();
+    if (!tar_input.empty() && !tar_output.empty() && count)
+    {
+        fprintf(stderr, "ERROR: No files are needed with '--tar-input' and '--tar-output'\n");
+        return TEMPLA_RET_SYNTAXERROR;
+    }
+    if (!tar_input.empty() && tar_output.empty() && count != 1)
+    {
+        fprintf(stderr, "ERROR: Specify the destination only with '--tar-input'\n");
+        return TEMPLA_RET_SYNTAXERROR;
+    }
+    if (tar_input.empty() && !tar_output.empty() && !count)
+    {
+        fprintf(stderr, "ERROR: Specify one or more files\n");
+        return TEMPLA_RET_SYNTAXERROR;
+    }
+    if (tar_input.empty() && tar_output.empty() && count <= 1)
     {
         fprintf(stderr, "ERROR: Specify two or more files\n");
         return TEMPLA_RET_SYNTAXERROR;
     }
+    if (tar_output == L"-" && stats_json == L"-")
+    {
+        fprintf(stderr, "ERROR: '--stats-json -' cannot be used with '--tar-output -'\n");
+        return TEMPLA_RET_SYNTAXERROR;
+    }
+
+    // the log would be mixed into the archive
+    if (tar_output == L"-" && report == TR_LOG)
+        report = TR_QUIET;
 
-    size_t iLast = files.size() - 1;
-    auto& destination = files[iLast];
-    for (size_t i = 0; i < iLast; ++i)
+    if (stats_text || !stats_json.empty())
+        options.stats = &stats;
+    auto reporter = templa_new_reporter(report);
+    options.reporter = reporter.get();
+
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    if (!tar_input.empty() || !tar_output.empty())
     {
-        TEMPLA_RET ret = templa(files[i], destination, mapping, ignore);
-        if (ret != TEMPLA_RET_OK)
-            return ret;
+        ret = templa_main_tar(tar_input, tar_output, files, mapping, ignore, options);
+    }
+    else
+    {
+        size_t iLast = files.size() - 1;
+        auto& destination = files[iLast];
+        for (size_t i = 0; i < iLast && ret == TEMPLA_RET_OK; ++i)
+            ret = templa(files[i], destination, mapping, ignore, options);
     }
 
-    return TEMPLA_RET_OK;
+    if (stats_text)
+        fputs(templa_stats_text(stats).c_str(), stderr);
+    if (stats_json == L"-")
+    {
+        fflush(stdout);
+        fputs(templa_stats_json(stats).c_str(), stdout);
+    }
+    else if (!stats_json.empty() && !templa_save_file(stats_json, templa_stats_json(stats)))
+    {
+        fprintf(stderr, "ERROR: Cannot write file '%ls'\n", stats_json.c_str());
+        if (ret == TEMPLA_RET_OK)
+            ret = TEMPLA_RET_WRITEERROR;
+    }
+
+    return ret;
+}
+
+#ifndef _WIN32
+TEMPLA_RET
+templa_main(int argc, char **argv)
+{
+    std::vector<string_t> args(argc);
+    for (int iarg = 0; iarg < argc; ++iarg)
+        args[iarg] = native_to_string(argv[iarg]);
+
+    std::vector<wchar_t *> wargv;
+    for (auto& arg : args)
+        wargv.push_back(&arg[0]);
+    wargv.push_back(NULL);
+
+    return templa_main(argc, wargv.data());
 }
+#endif
@@ -2,13 +2,23 @@
 
 #include <string>
 #include <map>
+#include <set>
 #include <vector>
+#include <memory>
+#include <cstdio>
+#include <cstdint>
 
 typedef std::wstring string_t;
 typedef std::map<string_t, string_t> mapping_t;
 typedef std::vector<string_t> string_list_t;
 typedef std::string binary_t;
 
+#ifdef _WIN32
+    #define TEMPLA_PATH_SEP L'\\'
+#else
+    #define TEMPLA_PATH_SEP L'/'
+#endif
+
 const char *templa_get_version(void);
 const char *templa_get_usage(void);
 
@@ -22,14 +32,247 @@ enum TEMPLA_RET
     TEMPLA_RET_CANCELED,
 };
 
-typedef bool (*templa_canceler_t)(); // return true to cancel
+typedef bool (*templa_canceler_t)(); // return true to cancel; called from worker threads with jobs != 1
+
+enum TEMPLA_SYNC
+{
+    TS_NONE,    // leave the outputs to the system
+    TS_FILE,    // sync each output as it is written
+    TS_BATCH,   // sync them all once at the end
+};
+
+enum TEMPLA_PHASE
+{
+    TP_ENUMERATE,   // reading folders
+    TP_READ,
+    TP_DETECT,      // templa_detect_encoding
+    TP_DECODE,      // into string_t
+    TP_REPLACE,
+    TP_NEWLINE,     // counting the newlines
+    TP_ENCODE,      // back into bytes, with the newlines normalized
+    TP_WRITE,
+    TP_COUNT
+};
+
+// Counters and timings of runs (see TEMPLA_OPTIONS::stats). Times are in
+// nanoseconds and summed over the threads. Each run adds to them.
+struct TEMPLA_STATS
+{
+    uint64_t phase_ns[TP_COUNT] = { 0 };
+    uint64_t elapsed_ns = 0;        // wall clock
+    uint64_t files = 0;             // converted or copied
+    uint64_t skipped = 0;           // up to date, or made from a duplicate
+    uint64_t ignored = 0;
+    uint64_t encodings[6] = { 0 };  // files by TEMPLA_ENCODING
+    uint64_t bytes_in = 0;
+    uint64_t bytes_out = 0;
+    std::map<string_t, uint64_t> replacements;              // by key of the mapping
+    std::vector<std::pair<string_t, uint64_t> > largest;    // bytes, the largest first
+    std::vector<std::pair<string_t, uint64_t> > slowest;    // nanoseconds
+};
+
+// Reports of the stats, for people (--stats) and as JSON (--stats-json).
+std::string templa_stats_text(const TEMPLA_STATS& stats);
+std::string templa_stats_json(const TEMPLA_STATS& stats);
+
+// Where the log of runs goes (see TEMPLA_OPTIONS::reporter). log() gets
+// whole lines ("X --> Y [UTF-8]\n"), in the order of a sequential run and
+// one call at a time; file_done() may be called by several threads at once.
+class TEMPLA_REPORTER
+{
+public:
+    virtual ~TEMPLA_REPORTER() { }
+    virtual void log(const char *text, size_t size) = 0;
+    virtual void total(uint64_t /*files*/, uint64_t /*bytes*/) { }   // if a plan is made first
+    virtual void file_done(uint64_t /*bytes*/) { }  // converted, copied or up to date
+    virtual void flush() { }                        // at the end of each run
+};
+
+enum TEMPLA_REPORT
+{
+    TR_LOG,         // the log on stdout, written in large blocks
+    TR_QUIET,       // nothing
+    TR_PROGRESS,    // a progress line on stderr: files, bytes, throughput and ETA
+};
+
+std::unique_ptr<TEMPLA_REPORTER> templa_new_reporter(TEMPLA_REPORT report);
+
+struct TEMPLA_OPTIONS
+{
+    bool force_decode = false;  // decode UTF-8/ASCII text instead of replacing bytes
+    unsigned jobs = 0;          // worker threads for folders (0: number of CPUs)
+    uint64_t stream_size = 32 << 20;    // convert files this large in chunks (0: never)
+    bool incremental = false;   // skip sources unchanged since the last run (manifest in destination)
+    bool dedup = false;         // convert identical sources once; clone or copy the rest
+    bool hardlinks = false;     // dedup with hard links between the outputs
+    bool ordered = false;       // make a plan first, then read the files in on-disk order
+    bool plan_only = false;     // print the plan instead of running it (dry run)
+    uint64_t pipeline_size = 0; // read, convert and write in overlapping stages, this many bytes in flight (0: off)
+    unsigned uring_depth = 0;   // batch small files through io_uring, this many at a time (Linux; 0: off)
+    bool atomic = false;        // write each output under a temporary name, then rename it into place
+    TEMPLA_SYNC sync = TS_NONE; // make the outputs durable (folders are synced at the end)
+    TEMPLA_STATS *stats = NULL; // if set, counters and timings are added to it
+    TEMPLA_REPORTER *reporter = NULL;   // where the log goes (NULL: TR_LOG for each run or TEMPLA_JOB)
+};
 
 TEMPLA_RET
 templa(string_t source, string_t destination, const mapping_t& mapping,
        const string_list_t& ignore, templa_canceler_t canceler = NULL);
+TEMPLA_RET
+templa(string_t source, string_t destination, const mapping_t& mapping,
+       const string_list_t& ignore, const TEMPLA_OPTIONS& options,
+       templa_canceler_t canceler = NULL);
+
+// Called by the threads of a run with the files and bytes done so far and
+// the data given with it. Return true to cancel.
+typedef bool (*templa_callback_t)(void *data, uint64_t files, uint64_t bytes);
+
+// A tree of files to convert that is not on the disk (see TEMPLA_JOB::run).
+// Paths are relative to its root, with '/' between the parts; folders end
+// with '/', and the root is "".
+struct TEMPLA_VFS_ENTRY
+{
+    string_t name;
+    bool is_dir;
+};
+
+class TEMPLA_SOURCE
+{
+public:
+    virtual ~TEMPLA_SOURCE() { }
+    virtual bool enumerate(const string_t& dir, std::vector<TEMPLA_VFS_ENTRY>& entries) = 0;
+    virtual bool read(const string_t& path, binary_t& data) = 0;
+};
+
+// Where the outputs go. write() may take data by swapping it.
+class TEMPLA_SINK
+{
+public:
+    virtual ~TEMPLA_SINK() { }
+    virtual bool mkdir(const string_t& dir) = 0;
+    virtual bool write(const string_t& path, binary_t& data) = 0;
+};
+
+// Both in memory: files by path, and the folders ("a/", "a/b/"). Reading
+// does not need the folders of the files to be listed.
+class TEMPLA_MEMORY_FS : public TEMPLA_SOURCE, public TEMPLA_SINK
+{
+public:
+    std::map<string_t, binary_t> files;
+    std::set<string_t> dirs;
+
+    bool enumerate(const string_t& dir, std::vector<TEMPLA_VFS_ENTRY>& entries);
+    bool read(const string_t& path, binary_t& data);
+    bool mkdir(const string_t& dir);
+    bool write(const string_t& path, binary_t& data);
+};
+
+// A sink that writes a tar archive (ustar, with pax headers for long
+// names) to fp as the outputs come. finish() ends the archive.
+class TEMPLA_TAR_WRITER : public TEMPLA_SINK
+{
+public:
+    TEMPLA_TAR_WRITER(FILE *fp);
+    bool mkdir(const string_t& dir);
+    bool write(const string_t& path, binary_t& data);
+    bool finish();
+
+protected:
+    FILE *m_fp;
+    uint64_t m_mtime;
+    bool header(const binary_t& name, char type, uint64_t size);
+    bool data(const char *ptr, size_t size);
+};
+
+struct TEMPLA_COMPILED;
+struct TEMPLA_JOB_SHARED;
+
+// A mapping, ignore patterns and options compiled once, for services that
+// run the same job many times. run() may be called by several threads at
+// once; each call has its own callback and data, and may have its own
+// reporter (else options.reporter, which must then be thread-safe, or else
+// one log for the job). The folders are walked on one thread pool of the
+// job, made by the first run that needs it. The limit of open files is
+// left to the caller.
+class TEMPLA_JOB
+{
+public:
+    TEMPLA_JOB(const mapping_t& mapping, const string_list_t& ignore,
+               const TEMPLA_OPTIONS& options = TEMPLA_OPTIONS());
+
+    TEMPLA_RET run(string_t source, string_t destination, templa_callback_t callback = NULL,
+                   void *data = NULL, TEMPLA_REPORTER *reporter = NULL) const;
+
+    // The whole tree of source into the root of sink, without the disk.
+    // The names and the contents are converted as they are from a folder.
+    TEMPLA_RET run(TEMPLA_SOURCE& source, TEMPLA_SINK& sink, templa_callback_t callback = NULL,
+                   void *data = NULL, TEMPLA_REPORTER *reporter = NULL) const;
+
+    // A file or folder on the disk into sink, as into a destination folder.
+    TEMPLA_RET run(string_t source, TEMPLA_SINK& sink, templa_callback_t callback = NULL,
+                   void *data = NULL, TEMPLA_REPORTER *reporter = NULL) const;
+
+    // The members of the tar archive read from input, one at a time, into
+    // sink. The mapping is applied to each part of the member names.
+    TEMPLA_RET run_tar(FILE *input, TEMPLA_SINK& sink, templa_callback_t callback = NULL,
+                       void *data = NULL, TEMPLA_REPORTER *reporter = NULL) const;
+
+    // The contents of one file, converted as run() converts them. Returns
+    // false if output is input as it is. Nothing is logged.
+    bool convert(const binary_t& input, binary_t& output) const;
+
+    const TEMPLA_OPTIONS& options() const
+    {
+        return m_options;
+    }
+
+protected:
+    std::shared_ptr<const TEMPLA_COMPILED> m_compiled;
+    std::shared_ptr<TEMPLA_JOB_SHARED> m_shared;
+    TEMPLA_OPTIONS m_options;
+};
+
+enum TEMPLA_PLAN_TYPE
+{
+    TPT_FILE,
+    TPT_DIR,
+    TPT_IGNORED,
+    TPT_LOOP,       // a link to a folder above it, not followed
+};
+
+// One entry of a run: a source and where it goes, after the mapping and
+// templa_validate_filename. Folders end with a separator.
+struct TEMPLA_PLAN_ITEM
+{
+    TEMPLA_PLAN_TYPE type = TPT_FILE;
+    string_t source;
+    string_t destination;
+    uint64_t size = 0;
+    uint64_t order = 0;     // where the file lies on the disk (the inode number)
+};
+
+typedef std::vector<TEMPLA_PLAN_ITEM> templa_plan_t;
+
+// Enumerate what templa would do, without touching the destination. A
+// folder comes before its contents.
+TEMPLA_RET
+templa_make_plan(string_t source, string_t destination, const mapping_t& mapping,
+                 const string_list_t& ignore, templa_plan_t& plan);
+
+// Carry out a plan: create all the folders, then convert the files in the
+// order of TEMPLA_PLAN_ITEM::order.
+TEMPLA_RET
+templa_run_plan(const templa_plan_t& plan, const mapping_t& mapping,
+                const string_list_t& ignore, const TEMPLA_OPTIONS& options,
+                templa_canceler_t canceler = NULL);
 
 TEMPLA_RET templa_main(int argc, wchar_t **argv);
 
+bool templa_load_mapping(const string_t& filename, mapping_t& mapping);
+#ifndef _WIN32
+TEMPLA_RET templa_main(int argc, char **argv);
+#endif
+
 bool templa_load_file(const string_t& filename, binary_t& data);
 bool templa_save_file(const string_t& filename, const void *ptr, size_t data_size);
 
@@ -56,41 +299,186 @@ enum TEMPLA_NEWLINE
     TNL_UNKNOWN,
 };
 
+// Detect the encoding of the contents of a file. bom is set if it begins
+// with a byte order mark.
+TEMPLA_ENCODING templa_detect_encoding(const char *ptr, size_t size, bool& bom);
+
+// Transcoders between UTF-8/UTF-16 bytes and string_t (UTF-16 or UTF-32
+// by the size of wchar_t). Malformed UTF-8 becomes U+FFFD, or with escape,
+// U+DC80..U+DCFF that string_to_utf8 turns back into the same bytes.
+// utf8_to_string returns false if the input is not well-formed.
+bool utf8_to_string(const char *ptr, size_t size, string_t& ret, bool escape = false);
+void string_to_utf8(const wchar_t *ptr, size_t size, binary_t& ret, bool escape = false);
+void utf16_to_string(const char *ptr, size_t size, bool big_endian, string_t& ret);
+void string_to_utf16(const wchar_t *ptr, size_t size, bool big_endian, binary_t& ret);
+// UTF-16 bytes as they are into code units, without decoding the pairs.
+void utf16_to_units(const char *ptr, size_t size, bool big_endian, std::u16string& ret);
+
 struct TEMPLA_FILE
 {
     binary_t m_binary;
     string_t m_string;
+    std::u16string m_string16;
     TEMPLA_ENCODING m_encoding = TE_BINARY;
     TEMPLA_NEWLINE m_newline = TNL_UNKNOWN;
     bool m_bom = false;
+    // If set before detect_encoding, UTF-8 and ASCII text is left in
+    // m_binary (without BOM), and UTF-16 text is put in m_string16 as
+    // code units, instead of being decoded into m_string. It is cleared
+    // if the file is decoded.
+    bool m_raw = false;
+
+    // The buffers come from a pool of the thread and go back to it.
+    TEMPLA_FILE();
+    TEMPLA_FILE(const TEMPLA_FILE&) = default;
+    TEMPLA_FILE(TEMPLA_FILE&&) = default;
+    TEMPLA_FILE& operator=(const TEMPLA_FILE&) = default;
+    TEMPLA_FILE& operator=(TEMPLA_FILE&&) = default;
+    ~TEMPLA_FILE();
 
     bool load(const string_t& filename);
     bool save(const string_t& filename);
+    void decode();
+    void encode();
     void detect_encoding();
     void detect_newline();
 };
 
 bool templa_wildcard(const string_t& str, const string_t& pat, bool ignore_case = true);
 
-inline void str_replace(string_t& data, const string_t& from, const string_t& to)
+// A set of wildcard patterns compiled once, answering whether any of them
+// matches a name (ignoring case, like templa_wildcard) in a single pass.
+// Literals, "prefix*" and "*suffix" are looked up directly; the rest run
+// as one bit-parallel automaton, so '*' never backtracks.
+struct TEMPLA_GLOBSET
 {
-    if (from.empty())
-        return;
+    TEMPLA_GLOBSET() { }
+    explicit TEMPLA_GLOBSET(const string_list_t& patterns);
 
-    size_t i = 0;
-    for (;;)
+    void add(const string_t& pattern);
+    bool match(const string_t& str) const;
+    bool empty() const { return m_empty; }
+
+protected:
+    struct TRIE
     {
-        i = data.find(from, i);
-        if (i == string_t::npos)
-            break;
-        data.replace(i, from.size(), to);
-        i += to.size();
-    }
+        std::vector<std::map<wchar_t, uint32_t> > m_next;
+        std::vector<bool> m_end;
+
+        TRIE() : m_next(1), m_end(1, false) { }
+        void add(const wchar_t *ptr, size_t size, bool reverse);
+        bool match(const wchar_t *ptr, size_t size, bool reverse) const;
+    };
+    bool m_empty = true;
+    std::vector<string_t> m_literals;   // sorted
+    TRIE m_prefixes, m_suffixes;
+
+    // Automaton: the states of each pattern are a run of bits, one for
+    // each character or '?' matched so far plus a final one. On each
+    // character, a state moves on if its token matches and stays if a
+    // '*' comes before it.
+    size_t m_bits = 0;
+    std::vector<uint64_t> m_start, m_final, m_stay;
+    std::vector<std::vector<uint64_t> > m_tokens;   // by character class
+    uint32_t m_ascii[128] = { 0 };                  // class of ASCII characters
+    std::map<wchar_t, uint32_t> m_classes;          // and of the others (0: none)
+
+    void add_automaton(const string_t& pattern);
+};
+
+// Multi-pattern replacer (Aho-Corasick). All keys are searched in a single
+// pass; the leftmost match wins, then the longest one, and replaced text
+// is never searched again.
+template <typename T_CHAR>
+struct TEMPLA_MATCHER
+{
+    typedef std::basic_string<T_CHAR> string_type;
+
+    // key is where the matches of from are counted (see replace); if from
+    // was added before, its to and key are replaced.
+    void add(const string_type& from, const string_type& to, uint32_t key);
+    void compile();
+
+    bool empty() const { return m_to.empty(); }
+    size_t max_length() const { return m_max_length; }
+
+    // Returns the number of replacements. If none, ret is not touched.
+    // counts, if given, is incremented at the key of each match.
+    size_t replace(const T_CHAR *ptr, size_t size, string_type& ret,
+                   uint64_t *counts = NULL) const;
+    size_t replace(string_type& str, uint64_t *counts = NULL) const;
+
+    // For text that arrives in pieces. Appends ptr[0, n) to ret with the
+    // matches starting before limit replaced, and returns n (n >= limit).
+    // The rest is passed again in front of the next piece; limit should
+    // leave max_length() - 1 units unless the input ends here.
+    size_t replace_stream(const T_CHAR *ptr, size_t size, size_t limit, string_type& ret,
+                          uint64_t *counts = NULL) const;
+
+protected:
+    struct NODE
+    {
+        uint32_t fail = 0;
+        uint32_t output = 0;    // the longest key ending here, or zero
+        uint32_t depth = 0;
+        uint32_t value = 0;     // index of m_to if this node ends a key
+        bool terminal = false;
+        uint32_t first_edge = 0;
+        uint32_t num_edges = 0;
+    };
+    std::vector<NODE> m_nodes;
+    std::vector<std::pair<T_CHAR, uint32_t> > m_edges;
+    std::vector<std::map<T_CHAR, uint32_t> > m_trie;
+    std::vector<string_type> m_to;
+    std::vector<uint32_t> m_keys;   // by index of m_to
+    uint32_t m_root[256] = { 0 };
+    size_t m_max_length = 0;
+
+    uint32_t find_edge(uint32_t state, T_CHAR ch) const;
+    uint32_t next(uint32_t state, T_CHAR ch) const;
+};
+
+typedef TEMPLA_MATCHER<wchar_t> templa_matcher_t;
+
+void templa_compile_mapping(templa_matcher_t& matcher, const mapping_t& mapping);
+void templa_compile_mapping(TEMPLA_MATCHER<char>& matcher, const mapping_t& mapping); // UTF-8
+void templa_compile_mapping(TEMPLA_MATCHER<char16_t>& matcher, const mapping_t& mapping);
+
+// Replace all occurrences of from with to, and return the count. The
+// matches are located first (with SSE2/AVX2 where available), then the
+// result is built once in a buffer of the final size. T_CHAR is char,
+// wchar_t, char16_t or char32_t.
+template <typename T_CHAR>
+size_t str_replace(std::basic_string<T_CHAR>& data, const T_CHAR *from, size_t from_size,
+                   const T_CHAR *to, size_t to_size);
+
+// The code path str_replace looks for the matches with.
+enum TEMPLA_SIMD
+{
+    TSIMD_AUTO,     // the best one the CPU supports
+    TSIMD_SCALAR,
+    TSIMD_SSE2,
+    TSIMD_AVX2,
+};
+
+// Choose the code path of str_replace and return the previous one, for
+// tests and benchmarks. A path that is not available falls back to the
+// next one down.
+TEMPLA_SIMD templa_set_simd(TEMPLA_SIMD simd);
+
+template <typename T_CHAR>
+inline size_t
+str_replace(std::basic_string<T_CHAR>& data, const std::basic_string<T_CHAR>& from,
+            const std::basic_string<T_CHAR>& to)
+{
+    return str_replace(data, from.data(), from.size(), to.data(), to.size());
 }
 
-inline void str_replace(string_t& data, const wchar_t *from, const wchar_t *to)
+template <typename T_CHAR>
+inline size_t str_replace(std::basic_string<T_CHAR>& data, const T_CHAR *from, const T_CHAR *to)
 {
-    str_replace(data, string_t(from), string_t(to));
+    typedef std::char_traits<T_CHAR> traits_type;
+    return str_replace(data, from, traits_type::length(from), to, traits_type::length(to));
 }
 
 template <typename T_STR_CONTAINER>
@@ -112,17 +500,21 @@ str_split(T_STR_CONTAINER& container,
 
 inline void backslash_to_slash(string_t& string)
 {
+#ifdef _WIN32
     for (auto& ch : string)
     {
         if (ch == L'/')
             ch = L'\\';
     }
+#else
+    (void)string;
+#endif
 }
 
 inline void add_backslash(string_t& string)
 {
-    if (string.size() && string[string.size() - 1] != L'\\')
-        string += L'\\';
+    if (string.size() && string[string.size() - 1] != TEMPLA_PATH_SEP)
+        string += TEMPLA_PATH_SEP;
 }
 
 template <typename T_CHAR>
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <random>
+#include "../templa.hpp"
+
+static bool is_utf8(const std::string& bin)
+{
+    size_t i = 0;
+    while (i < bin.size())
+    {
+        uint32_t ch = uint8_t(bin[i]);
+        size_t len;
+        if (ch < 0x80)
+            len = 1;
+        else if (0xC2 <= ch && ch <= 0xDF)
+            len = 2, ch &= 0x1F;
+        else if (0xE0 <= ch && ch <= 0xEF)
+            len = 3, ch &= 0x0F;
+        else if (0xF0 <= ch && ch <= 0xF4)
+            len = 4, ch &= 0x07;
+        else
+            return false;
+
+        if (bin.size() - i < len)
+            return false;
+        for (size_t k = 1; k < len; ++k)
+        {
+            if ((uint8_t(bin[i + k]) & 0xC0) != 0x80)
+                return false;
+            ch = (ch << 6) | (uint8_t(bin[i + k]) & 0x3F);
+        }
+        if ((len == 3 && (ch < 0x800 || (0xD800 <= ch && ch <= 0xDFFF))) ||
+            (len == 4 && (ch < 0x10000 || ch > 0x10FFFF)))
+        {
+            return false;
+        }
+        i += len;
+    }
+    return true;
+}
+
+// The detection as it was done before, one property at a time.
+static TEMPLA_ENCODING reference(const std::string& bin)
+{
+    if (bin.compare(0, 3, "\xEF\xBB\xBF") == 0)
+        return TE_UTF8;
+    if (bin.compare(0, 2, "\xFF\xFE") == 0)
+        return TE_UTF16;
+    if (bin.compare(0, 2, "\xFE\xFF") == 0)
+        return TE_UTF16BE;
+
+    bool nul_even = false, nul_odd = false, high = false;
+    for (size_t i = 0; i < bin.size(); ++i)
+    {
+        if (bin[i] == 0)
+            ((i & 1) ? nul_odd : nul_even) = true;
+        if (bin[i] & 0x80)
+            high = true;
+    }
+
+    if (!nul_even && !nul_odd && !high)
+        return TE_ASCII;
+    if (nul_even && nul_odd)
+        return TE_BINARY;
+    if ((bin.size() & 1) == 0 && nul_odd)
+        return TE_UTF16;
+    if ((bin.size() & 1) == 0 && nul_even)
+        return TE_UTF16BE;
+    if (is_utf8(bin))
+        return TE_UTF8;
+    return TE_ANSI;
+}
+
+static TEMPLA_ENCODING detect(const std::string& bin)
+{
+    bool bom;
+    return templa_detect_encoding(bin.data(), bin.size(), bom);
+}
+
+static double throughput(const std::string& bin, TEMPLA_ENCODING expected)
+{
+    const int count = 8;
+    int detected = 0;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+        detected += (detect(bin) == expected);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    assert(detected == count);
+    return double(bin.size()) * count / elapsed.count() / 1e9;
+}
+
+int main(void)
+{
+    assert(detect("") == TE_ASCII);
+    assert(detect("abc\r\n") == TE_ASCII);
+    assert(detect("\xEF\xBB\xBF" "abc") == TE_UTF8);
+    assert(detect(std::string("\xFF\xFE" "a\0", 4)) == TE_UTF16);
+    assert(detect(std::string("a\0b\0", 4)) == TE_UTF16);
+    assert(detect(std::string("\0a\0b", 4)) == TE_UTF16BE);
+    assert(detect(std::string("a\0\0b", 4)) == TE_BINARY);
+    assert(detect("\xE6\x97\xA5\xE6\x9C\xAC") == TE_UTF8);
+    assert(detect("caf\xE9") == TE_ANSI);
+    assert(detect("\xED\xA0\x80") == TE_ANSI);     // surrogate
+    assert(detect("\xC0\xAF") == TE_ANSI);         // overlong
+    assert(detect("\xF4\x90\x80\x80") == TE_ANSI); // above U+10FFFF
+    assert(detect("\xE6\x97") == TE_ANSI);         // truncated
+
+    // random buffers around the block sizes, mostly text
+    std::mt19937 rng(1);
+    static const char *const pieces[] =
+    {
+        "a", "text ", "\r\n", "\xC3\xA9", "\xE6\x97\xA5", "\xF0\x9F\x98\x80",
+        "\xE6\x97", "\x80", "\xFF", "",
+    };
+    for (int n = 0; n < 200000; ++n)
+    {
+        std::string bin;
+        size_t length = rng() % 150;
+        unsigned kinds = 3 + rng() % 8;
+        while (bin.size() < length)
+        {
+            unsigned k = rng() % kinds;
+            if (k == 9)
+                bin += '\0';   // not in pieces
+            else
+                bin += pieces[k];
+        }
+        assert(detect(bin) == reference(bin));
+    }
+
+    std::string ascii, utf8, binary;
+    for (size_t i = 0; ascii.size() < (64 << 20); ++i)
+        ascii += "The quick brown fox jumps over the lazy dog.\r\n";
+    for (size_t i = 0; utf8.size() < (64 << 20); ++i)
+        utf8 += "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E text \xC3\xA9\r\n";
+    binary = ascii;
+    binary[1] = binary[2] = 0;
+
+    printf("ASCII: %.2f GB/s\n", throughput(ascii, TE_ASCII));
+    printf("UTF-8: %.2f GB/s\n", throughput(utf8, TE_UTF8));
+    printf("binary: %.2f GB/s\n", throughput(binary, TE_BINARY));
+
+    puts("OK");
+    return 0;
+}
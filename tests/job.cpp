@@ -0,0 +1,173 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <atomic>
+#include <thread>
+#include "test_util.hpp"
+
+static const size_t count = 20;
+static const size_t runs = 4;  // at once
+
+static string_t file_name(const string_t& dir, size_t i, const wchar_t *key)
+{
+    return dir + TEMPLA_PATH_SEP + L"f" + std::to_wstring(i) + L"_" + key + L".txt";
+}
+
+// A reporter of a library caller: it only counts.
+class COUNTER : public TEMPLA_REPORTER
+{
+public:
+    std::atomic<uint64_t> m_files, m_lines;
+
+    COUNTER() : m_files(0), m_lines(0)
+    {
+    }
+
+    void log(const char *text, size_t size)
+    {
+        for (size_t i = 0; i < size; ++i)
+            m_lines += (text[i] == '\n');
+    }
+
+    void file_done(uint64_t)
+    {
+        ++m_files;
+    }
+};
+
+struct PROGRESS
+{
+    uint64_t files = 0;
+    uint64_t cancel_after = UINT64_MAX;
+};
+
+// The threads of the process, or 0 where that cannot be told.
+static size_t thread_count(void)
+{
+    size_t ret = 0;
+#ifdef __linux__
+    if (FILE *fp = fopen("/proc/self/status", "r"))
+    {
+        char line[256];
+        while (fgets(line, sizeof(line), fp))
+        {
+            if (strncmp(line, "Threads:", 8) == 0)
+                ret = strtoul(line + 8, NULL, 10);
+        }
+        fclose(fp);
+    }
+#endif
+    return ret;
+}
+
+static std::atomic<size_t> s_max_threads(0);
+
+static bool callback(void *data, uint64_t files, uint64_t)
+{
+    auto progress = static_cast<PROGRESS *>(data);
+    progress->files = files;
+
+    size_t threads = thread_count(), max_threads = s_max_threads;
+    while (threads > max_threads && !s_max_threads.compare_exchange_weak(max_threads, threads))
+        ;
+    return files >= progress->cancel_after;
+}
+
+// The same job from several threads at once, each into its own folder.
+static void run_concurrently(const TEMPLA_JOB& job, const string_t& work, const string_t& source)
+{
+    std::vector<std::thread> threads;
+    COUNTER counters[runs];
+    PROGRESS progress[runs];
+    s_max_threads = 0;
+    for (size_t k = 0; k < runs; ++k)
+    {
+        make_dir(work + TEMPLA_PATH_SEP + L"out" + std::to_wstring(k));
+        threads.emplace_back([&, k]() {
+            string_t destination = work + TEMPLA_PATH_SEP + L"out" + std::to_wstring(k);
+            for (int repeat = 0; repeat < 3; ++repeat)
+            {
+                TEMPLA_RET ret = job.run(source, destination, callback, &progress[k], &counters[k]);
+                assert(ret == TEMPLA_RET_OK);
+            }
+        });
+    }
+    for (auto& thread : threads)
+        thread.join();
+
+    // the runs share the threads of the job: main, the callers and the pool
+    assert(s_max_threads <= 1 + runs + job.options().jobs);
+
+    for (size_t k = 0; k < runs; ++k)
+    {
+        // a line for the folder, one for each file and one for data.bin
+        assert(counters[k].m_files == count * 3);
+        assert(counters[k].m_lines == (count + 2) * 3);
+        assert(progress[k].files > 0 && progress[k].files <= count);
+
+        string_t output = work + TEMPLA_PATH_SEP + L"out" + std::to_wstring(k) +
+                          TEMPLA_PATH_SEP + L"src";
+        for (size_t i = 0; i < count; ++i)
+        {
+            binary_t data;
+            bool ok = templa_load_file(file_name(output, i, L"bar"), data);
+            assert(ok && data == "int bar;\n");
+            remove_file(file_name(output, i, L"bar"));
+        }
+        remove_dir(output);
+    }
+}
+
+int main(void)
+{
+    string_t work = L"job.tmp", source = work + TEMPLA_PATH_SEP + L"src";
+    make_dir(work);
+    make_dir(source);
+    for (size_t i = 0; i < count; ++i)
+    {
+        bool ok = templa_save_file(file_name(source, i, L"foo"), std::string("int foo;\n"));
+        assert(ok);
+    }
+    bool ok = templa_save_file(source + TEMPLA_PATH_SEP + L"data.bin", std::string("foo"));
+    assert(ok);
+
+    mapping_t mapping;
+    mapping[L"foo"] = L"bar";
+    string_list_t ignore;
+    ignore.push_back(L"*.bin");
+    TEMPLA_OPTIONS options;
+    options.jobs = 1;
+    TEMPLA_JOB job(mapping, ignore, options);
+    run_concurrently(job, work, source);
+
+    // folders walked, or plans run, on the pool of the job
+    options.jobs = 3;
+    run_concurrently(TEMPLA_JOB(mapping, ignore, options), work, source);
+    options.ordered = true;
+    run_concurrently(TEMPLA_JOB(mapping, ignore, options), work, source);
+
+    // canceled by the callback
+    COUNTER counter;
+    PROGRESS cancel;
+    cancel.cancel_after = 5;
+    string_t destination = work + TEMPLA_PATH_SEP + L"out0";
+    TEMPLA_RET ret = job.run(source, destination, callback, &cancel, &counter);
+    assert(ret == TEMPLA_RET_CANCELED);
+    assert(counter.m_files == 5);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        remove_file(file_name(source, i, L"foo"));
+        remove_file(file_name(destination + TEMPLA_PATH_SEP + L"src", i, L"bar"));
+    }
+    remove_file(source + TEMPLA_PATH_SEP + L"data.bin");
+    remove_dir(destination + TEMPLA_PATH_SEP + L"src");
+    for (size_t k = 0; k < runs; ++k)
+        remove_dir(work + TEMPLA_PATH_SEP + L"out" + std::to_wstring(k));
+    remove_dir(source);
+    remove_dir(work);
+
+    puts("OK");
+    return 0;
+}
@@ -0,0 +1,112 @@
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cassert>
+#include <atomic>
+#include <new>
+#include "../templa.hpp"
+
+// Every allocation of the program is counted, with the bytes still live.
+static std::atomic<uint64_t> s_allocations(0), s_live(0);
+static const size_t header = 16;
+
+void *operator new(size_t size)
+{
+    auto ptr = static_cast<char *>(malloc(header + size));
+    if (!ptr)
+        throw std::bad_alloc();
+    memcpy(ptr, &size, sizeof(size));
+    ++s_allocations;
+    s_live += size;
+    return ptr + header;
+}
+
+void operator delete(void *ptr) noexcept
+{
+    if (!ptr)
+        return;
+    auto block = static_cast<char *>(ptr) - header;
+    size_t size;
+    memcpy(&size, block, sizeof(size));
+    s_live -= size;
+    free(block);
+}
+
+void operator delete(void *ptr, size_t) noexcept
+{
+    operator delete(ptr);
+}
+
+static void put_utf16(binary_t& bin, const char *text, bool big_endian)
+{
+    for (; *text; ++text)
+    {
+        bin += big_endian ? '\0' : *text;
+        bin += big_endian ? *text : '\0';
+    }
+}
+
+int main(void)
+{
+    mapping_t mapping;
+    mapping[L"foo"] = L"bar";
+    mapping[L"Hello"] = L"Goodbye, world";
+    TEMPLA_JOB job(mapping, string_list_t());
+
+    // files of each kind, of several sizes, and what they become
+    std::vector<binary_t> contents, expected;
+    for (size_t lines : { 1, 50, 2000 })
+    {
+        binary_t ascii, utf8 = "\xEF\xBB\xBF", utf16 = "\xFF\xFE", utf16be = "\xFE\xFF", ansi;
+        binary_t ascii2, utf82 = utf8, utf162 = utf16, utf16be2 = utf16be, ansi2;
+        for (size_t i = 0; i < lines; ++i)
+        {
+            ascii += "Hello, foo!\r\n";
+            ascii2 += "Goodbye, world, bar!\r\n";
+            utf8 += "foo \xC3\xA9t\xC3\xA9\r\n";
+            utf82 += "bar \xC3\xA9t\xC3\xA9\r\n";
+            put_utf16(utf16, "Hello foo\r\n", false);
+            put_utf16(utf162, "Goodbye, world bar\r\n", false);
+            put_utf16(utf16be, "Hello foo\r\n", true);
+            put_utf16(utf16be2, "Goodbye, world bar\r\n", true);
+            ansi += "foo \xE9t\xE9\r\n";
+            ansi2 += "bar \xE9t\xE9\r\n";
+        }
+        contents.insert(contents.end(), { ascii, utf8, utf16, utf16be, ansi });
+        expected.insert(expected.end(), { ascii2, utf82, utf162, utf16be2, ansi2 });
+    }
+
+    std::vector<binary_t> output(contents.size());
+    auto convert_all = [&]() {
+        for (size_t i = 0; i < contents.size(); ++i)
+        {
+            bool changed = job.convert(contents[i], output[i]);
+            assert(changed);
+        }
+    };
+
+    // once the buffers have grown, converting allocates nothing
+    for (int round = 0; round < 2; ++round)
+        convert_all();
+    assert(output == expected);
+    uint64_t allocations = s_allocations;
+    for (int round = 0; round < 100; ++round)
+        convert_all();
+    assert(s_allocations == allocations);
+    assert(output == expected);
+
+    // a huge file does not stay in the pool
+    uint64_t live = s_live;
+    binary_t huge, result;
+    while (huge.size() < (16 << 20))
+        huge += "Hello, foo!\r\n";
+    job.convert(huge, result);
+    result.clear();
+    result.shrink_to_fit();
+    huge.clear();
+    huge.shrink_to_fit();
+    assert(s_live <= live);
+
+    puts("OK");
+    return 0;
+}
@@ -0,0 +1,147 @@
+#include <cstdio>
+#include <cassert>
+#include <random>
+#include "../templa.hpp"
+
+// Replace the non-overlapping occurrences from left to right, one position at a time.
+template <typename T_CHAR>
+static size_t reference(std::basic_string<T_CHAR>& data, const std::basic_string<T_CHAR>& from,
+                        const std::basic_string<T_CHAR>& to)
+{
+    if (from.empty())
+        return 0;
+
+    std::basic_string<T_CHAR> ret;
+    size_t count = 0;
+    for (size_t i = 0; i < data.size(); )
+    {
+        if (data.compare(i, from.size(), from) == 0)
+        {
+            ret += to;
+            i += from.size();
+            ++count;
+        }
+        else
+        {
+            ret += data[i++];
+        }
+    }
+    data.swap(ret);
+    return count;
+}
+
+template <typename T_CHAR>
+static std::basic_string<T_CHAR> widen(const char *str)
+{
+    std::basic_string<T_CHAR> ret;
+    while (*str)
+        ret += T_CHAR(static_cast<unsigned char>(*str++));
+    return ret;
+}
+
+// Check str_replace against the reference with every code path.
+template <typename T_CHAR>
+static void check(const std::basic_string<T_CHAR>& data, const std::basic_string<T_CHAR>& from,
+                  const std::basic_string<T_CHAR>& to)
+{
+    std::basic_string<T_CHAR> expected = data;
+    size_t expected_count = reference(expected, from, to);
+
+    static const TEMPLA_SIMD paths[] = { TSIMD_SCALAR, TSIMD_SSE2, TSIMD_AVX2, TSIMD_AUTO };
+    for (auto simd : paths)
+    {
+        templa_set_simd(simd);
+        std::basic_string<T_CHAR> actual = data;
+        size_t count = str_replace(actual, from, to);
+        assert(count == expected_count);
+        assert(actual == expected);
+    }
+}
+
+template <typename T_CHAR>
+static void check(const char *data, const char *from, const char *to)
+{
+    check(widen<T_CHAR>(data), widen<T_CHAR>(from), widen<T_CHAR>(to));
+}
+
+template <typename T_CHAR>
+static void test(void)
+{
+    // An empty FROM replaces nothing.
+    check<T_CHAR>("", "", "x");
+    check<T_CHAR>("abc", "", "x");
+
+    // FROM longer than the data.
+    check<T_CHAR>("", "a", "x");
+    check<T_CHAR>("ab", "abc", "x");
+
+    // Overlapping candidates are taken from the left.
+    check<T_CHAR>("aaaa", "aaa", "aa");
+    check<T_CHAR>("aaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaaa", "aaa", "aa");
+    check<T_CHAR>("abababababababababababababababababababababababa", "aba", "");
+
+    // The same length, replaced in place.
+    check<T_CHAR>("foo bar foo", "foo", "baz");
+    check<T_CHAR>("xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", "x", "y");
+
+    // A single hit at every position of data of lengths around the 16 and
+    // 32 byte blocks, so that it falls before, across and after the end of
+    // a block and in the scalar tail.
+    const size_t lanes = 32 / sizeof(T_CHAR);
+    for (size_t from_size = 1; from_size <= 5; ++from_size)
+    {
+        std::basic_string<T_CHAR> from(from_size, T_CHAR('a'));
+        from.back() = T_CHAR('b');
+        for (size_t size = from_size; size <= 3 * lanes + from_size; ++size)
+        {
+            for (size_t pos = 0; pos + from_size <= size; ++pos)
+            {
+                std::basic_string<T_CHAR> data(size, T_CHAR('.'));
+                data.replace(pos, from_size, from);
+                check(data, from, widen<T_CHAR>("<>"));
+                check(data, from, std::basic_string<T_CHAR>(from_size, T_CHAR('X')));
+            }
+        }
+    }
+
+    // Random data of a few letters, so that hits are frequent and overlap.
+    std::mt19937 rng(1);
+    for (int i = 0; i < 20000; ++i)
+    {
+        std::basic_string<T_CHAR> data, from, to;
+        for (size_t size = rng() % (4 * lanes); size > 0; --size)
+            data += T_CHAR('a' + rng() % 3);
+        for (size_t size = 1 + rng() % 4; size > 0; --size)
+            from += T_CHAR('a' + rng() % 3);
+        for (size_t size = rng() % 5; size > 0; --size)
+            to += T_CHAR('a' + rng() % 3);
+        check(data, from, to);
+    }
+
+    // Code units whose bytes look like other ones.
+    std::basic_string<T_CHAR> data(2 * lanes, T_CHAR(-1));
+    std::basic_string<T_CHAR> from(2, T_CHAR(-1));
+    check(data, from, widen<T_CHAR>("x"));
+    data[lanes - 1] = T_CHAR(0x7F);
+    check(data, from, widen<T_CHAR>("x"));
+
+    templa_set_simd(TSIMD_AUTO);
+}
+
+int main(void)
+{
+    test<char>();
+    test<wchar_t>();
+    test<char16_t>();
+    test<char32_t>();
+
+    std::u16string u16 = u"abcb";
+    assert(str_replace(u16, u"b", u"xx") == 2);
+    assert(u16 == u"axxcxx");
+    std::u32string u32 = U"\U0001F600b\U0001F600";
+    assert(str_replace(u32, U"\U0001F600", U"a") == 2);
+    assert(u32 == U"aba");
+
+    puts("OK");
+    return 0;
+}
@@ -0,0 +1,129 @@
+#include <cstdio>
+#include <cstring>
+#include <cstdlib>
+#include <cassert>
+#include <chrono>
+#include <random>
+#include "test_util.hpp"
+
+// A tree of small files, 100 to a folder, with the keys in some of them.
+static const size_t files_per_dir = 100;
+
+static string_t dir_name(const string_t& root, size_t dir)
+{
+    return root + TEMPLA_PATH_SEP + L"d" + std::to_wstring(dir);
+}
+
+static string_t file_name(const string_t& root, size_t i)
+{
+    return dir_name(root, i / files_per_dir) + TEMPLA_PATH_SEP + L"f" + std::to_wstring(i) + L".txt";
+}
+
+static void remove_tree(const string_t& root, size_t count)
+{
+    for (size_t i = 0; i < count; ++i)
+        remove_file(file_name(root, i));
+    for (size_t dir = 0; dir * files_per_dir < count; ++dir)
+        remove_dir(dir_name(root, dir));
+    remove_dir(root);
+}
+
+static void make_tree(const string_t& root, size_t count)
+{
+    std::mt19937 rng(1);
+    make_dir(root);
+    for (size_t i = 0; i < count; ++i)
+    {
+        if (i % files_per_dir == 0)
+            make_dir(dir_name(root, i / files_per_dir));
+
+        binary_t data;
+        size_t size = 100 + rng() % 4000;
+        while (data.size() < size)
+            data += (rng() % 4 == 0) ? "int foo(void);\n" : "static int x = 0;\n";
+        if (rng() % 16 == 0)
+            data[1] = data[2] = 0;     // binary
+        bool ok = templa_save_file(file_name(root, i), data);
+        assert(ok);
+    }
+}
+
+static double run(const string_t& source, const string_t& destination, unsigned depth,
+                  uint64_t pipeline_size = 0, TEMPLA_STATS *stats = NULL)
+{
+    mapping_t mapping;
+    mapping[L"foo"] = L"bar";
+    string_list_t ignore;
+    TEMPLA_OPTIONS options;
+    options.ordered = true;
+    options.uring_depth = depth;
+    options.pipeline_size = pipeline_size;
+    options.stats = stats;
+
+    auto start = std::chrono::steady_clock::now();
+    TEMPLA_RET ret = templa(source, destination, mapping, ignore, options);
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    assert(ret == TEMPLA_RET_OK);
+    return elapsed.count();
+}
+
+int main(int argc, char **argv)
+{
+    // the benchmark is a 50k-file tree; the test passes a smaller count
+    size_t count = (argc > 1) ? size_t(atol(argv[1])) : 50000;
+    const unsigned depth = 64;
+    string_t work = L"smallfiles.tmp", source = work + TEMPLA_PATH_SEP + L"src";
+    string_t out1 = work + TEMPLA_PATH_SEP + L"sync", out2 = work + TEMPLA_PATH_SEP + L"uring";
+    string_t out3 = work + TEMPLA_PATH_SEP + L"pipeline";
+
+    make_dir(work);
+    make_tree(source, count);
+    make_dir(out1);
+    make_dir(out2);
+    make_dir(out3);
+
+    // twice each, the second time over the outputs of the first
+    double sync = 1e9, uring = 1e9, pipeline = 1e9;
+    TEMPLA_STATS stats[3];
+    for (int i = 0; i < 2; ++i)
+    {
+        sync = std::min(sync, run(source, out1, 0, 0, &stats[0]));
+        uring = std::min(uring, run(source, out2, depth, 0, &stats[1]));
+        pipeline = std::min(pipeline, run(source, out3, 0, 1 << 20, &stats[2]));
+    }
+
+    // the stats are the same whichever way the files go
+    for (auto& each : stats)
+    {
+        assert(each.files == count * 2);
+        assert(each.bytes_in == stats[0].bytes_in && each.bytes_out == stats[0].bytes_out);
+        assert(each.replacements == stats[0].replacements);
+        assert(each.largest.size() == std::min<size_t>(count, 10));
+    }
+    assert(stats[0].replacements[L"foo"] > 0);
+
+    for (size_t i = 0; i < count; ++i)
+    {
+        binary_t data1, data2, data3;
+        bool ok = templa_load_file(file_name(out1 + TEMPLA_PATH_SEP + L"src", i), data1) &&
+                  templa_load_file(file_name(out2 + TEMPLA_PATH_SEP + L"src", i), data2) &&
+                  templa_load_file(file_name(out3 + TEMPLA_PATH_SEP + L"src", i), data3);
+        assert(ok);
+        assert(data1 == data2 && data1 == data3);
+        assert(data1.find("foo") == data1.npos || data1.find('\0') != data1.npos);
+    }
+
+    remove_tree(source, count);
+    remove_tree(out1 + TEMPLA_PATH_SEP + L"src", count);
+    remove_tree(out2 + TEMPLA_PATH_SEP + L"src", count);
+    remove_tree(out3 + TEMPLA_PATH_SEP + L"src", count);
+    remove_dir(out1);
+    remove_dir(out2);
+    remove_dir(out3);
+    remove_dir(work);
+
+    fprintf(stderr, "%u files: synchronous %.3f s, io_uring (depth %u) %.3f s, pipeline %.3f s\n",
+            unsigned(count), sync, depth, uring, pipeline);
+    puts("OK");
+    return 0;
+}
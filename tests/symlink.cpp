@@ -0,0 +1,82 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include "test_util.hpp"
+
+#ifdef _WIN32
+int main(void)
+{
+    puts("OK");     // symbolic links need a privilege on Windows
+    return 0;
+}
+#else
+static bool exists(const string_t& path)
+{
+    struct stat st;
+    return lstat(std::string(path.begin(), path.end()).c_str(), &st) == 0;
+}
+
+int main(void)
+{
+    // src/a/up leads back to src, and src/a/ext to a folder outside
+    string_t work = L"symlink.tmp", source = work + L"/src", out = work + L"/out";
+    make_dir(work);
+    make_dir(source);
+    make_dir(source + L"/a");
+    make_dir(work + L"/other");
+    bool ok = templa_save_file(source + L"/a/f_foo.txt", std::string("foo\n")) &&
+              templa_save_file(work + L"/other/o.txt", std::string("foo\n"));
+    assert(ok);
+    int ret1 = symlink("..", "symlink.tmp/src/a/up");
+    int ret2 = symlink("../../other", "symlink.tmp/src/a/ext");
+    assert(ret1 == 0 && ret2 == 0);
+
+    mapping_t mapping;
+    mapping[L"foo"] = L"bar";
+    auto reporter = templa_new_reporter(TR_QUIET);
+    for (int mode = 0; mode < 4; ++mode)
+    {
+        TEMPLA_OPTIONS options;
+        options.jobs = (mode == 1) ? 1 : 0;
+        options.ordered = (mode == 2);
+        TEMPLA_JOB job(mapping, string_list_t(), options);
+
+        if (mode == 3)
+        {
+            // the plan of a sink
+            TEMPLA_MEMORY_FS output;
+            TEMPLA_RET ret = job.run(source, output, NULL, NULL, reporter.get());
+            assert(ret == TEMPLA_RET_OK);
+            assert(output.files.size() == 2);
+            assert(output.files[L"src/a/f_bar.txt"] == "bar\n");
+            assert(output.files[L"src/a/ext/o.txt"] == "bar\n");
+            continue;
+        }
+
+        make_dir(out);
+        TEMPLA_RET ret = job.run(source, out, NULL, NULL, reporter.get());
+        assert(ret == TEMPLA_RET_OK);
+        assert(exists(out + L"/src/a/f_bar.txt") && exists(out + L"/src/a/ext/o.txt"));
+        assert(!exists(out + L"/src/a/up"));
+
+        remove_file(out + L"/src/a/f_bar.txt");
+        remove_file(out + L"/src/a/ext/o.txt");
+        remove_dir(out + L"/src/a/ext");
+        remove_dir(out + L"/src/a");
+        remove_dir(out + L"/src");
+        remove_dir(out);
+    }
+
+    remove_file(source + L"/a/up");
+    remove_file(source + L"/a/ext");
+    remove_file(source + L"/a/f_foo.txt");
+    remove_file(work + L"/other/o.txt");
+    remove_dir(work + L"/other");
+    remove_dir(source + L"/a");
+    remove_dir(source);
+    remove_dir(work);
+
+    puts("OK");
+    return 0;
+}
+#endif
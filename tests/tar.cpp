@@ -0,0 +1,80 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include "../templa.hpp"
+
+int main(void)
+{
+    TEMPLA_MEMORY_FS input;
+    input.files[L"foo.txt"] = "foo\r\n";
+    input.files[L"sub_foo/a.txt"] = std::string("\xFF\xFE" "f\0o\0o\0", 8);
+    input.files[L"sub_foo/data.bin"] = "foo";
+    input.files[L"sub_foo/" + string_t(90, L'd') + L"/" + string_t(60, L'e') + L"_foo.txt"] = "foo";
+    input.files[L"sub_foo/" + string_t(150, L'f') + L".txt"] = std::string(1000, 'x');
+    input.dirs.insert(L"empty_foo/");
+
+    mapping_t mapping;
+    mapping[L"foo"] = L"bar";
+    string_list_t ignore;
+    ignore.push_back(L"*.bin");
+    auto reporter = templa_new_reporter(TR_QUIET);
+
+    // the names as they are into an archive, with the ignored file too
+    FILE *fp = tmpfile();
+    assert(fp);
+    TEMPLA_TAR_WRITER writer(fp);
+    TEMPLA_RET ret = TEMPLA_JOB(mapping_t(), string_list_t()).run(input, writer, NULL, NULL,
+                                                                  reporter.get());
+    assert(ret == TEMPLA_RET_OK && writer.finish());
+
+    // from the archive, as from the memory
+    TEMPLA_STATS stats;
+    TEMPLA_OPTIONS options;
+    options.stats = &stats;
+    TEMPLA_JOB job(mapping, ignore, options);
+    TEMPLA_MEMORY_FS expected, output;
+    ret = job.run(input, expected, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK);
+
+    rewind(fp);
+    ret = job.run_tar(fp, output, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK);
+    assert(output.files == expected.files && output.dirs == expected.dirs);
+    assert(output.files.size() == 4 && output.files[L"bar.txt"] == "bar\r\n");
+    assert(stats.files == 8 && stats.ignored == 2);
+
+    // the outputs into an archive again
+    FILE *fp2 = tmpfile();
+    assert(fp2);
+    TEMPLA_TAR_WRITER writer2(fp2);
+    rewind(fp);
+    ret = job.run_tar(fp, writer2, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK && writer2.finish());
+    rewind(fp2);
+    TEMPLA_MEMORY_FS output2;
+    ret = TEMPLA_JOB(mapping_t(), string_list_t()).run_tar(fp2, output2, NULL, NULL,
+                                                           reporter.get());
+    assert(ret == TEMPLA_RET_OK && output2.files == expected.files);
+    fclose(fp2);
+
+    // a broken header
+    rewind(fp);
+    fputc('X', fp);
+    rewind(fp);
+    TEMPLA_MEMORY_FS broken;
+    ret = job.run_tar(fp, broken, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_READERROR);
+    fclose(fp);
+
+    // the JSON would follow the archive on stdout
+    wchar_t *argv[] = {
+        const_cast<wchar_t *>(L"templa"), const_cast<wchar_t *>(L"--tar-output"),
+        const_cast<wchar_t *>(L"-"), const_cast<wchar_t *>(L"--stats-json"),
+        const_cast<wchar_t *>(L"-"), const_cast<wchar_t *>(L"foo"),
+    };
+    ret = templa_main(int(sizeof(argv) / sizeof(argv[0])), argv);
+    assert(ret == TEMPLA_RET_SYNTAXERROR);
+
+    puts("OK");
+    return 0;
+}
@@ -0,0 +1,429 @@
+/* templa_bench --- Run templa() on a generated tree and report the speed as JSON.
+   License: MIT */
+#ifdef _WIN32
+    #include <windows.h>
+    #include <psapi.h>
+    #include <io.h>
+    #include <fcntl.h>
+#else
+    #include <sys/stat.h>
+    #include <sys/resource.h>
+    #include <fcntl.h>
+    #include <unistd.h>
+#endif
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <cmath>
+#include <chrono>
+#include <random>
+#include <set>
+#include <algorithm>
+#include "test_util.hpp"
+
+// What the tree looks like. Everything comes from the seed.
+struct BENCH_CONFIG
+{
+    unsigned seed = 1;
+    size_t files = 10000;
+    unsigned depth = 3;             // levels of folders below the root
+    unsigned fanout = 4;            // folders in each folder
+    size_t min_size = 64;           // file sizes, log-uniform in between
+    size_t max_size = 64 * 1024;
+    // weights of TE_BINARY, TE_UTF8, TE_UTF16, TE_UTF16BE, TE_ANSI, TE_ASCII
+    unsigned encodings[6] = { 5, 40, 5, 5, 0, 45 };
+    double crlf = 0.5;              // ratio of files with CRLF
+    double density = 1.0;           // keys per KiB of text
+    size_t keys = 16;               // size of the mapping
+    unsigned runs = 3;
+    string_t work = L"templa_bench.tmp";
+    bool keep = false;
+    TEMPLA_OPTIONS options;
+};
+
+struct BENCH_TREE
+{
+    std::vector<string_t> files, dirs;  // relative to the root
+    uint64_t bytes = 0;
+    size_t by_encoding[6] = { 0 };
+};
+
+static const char *const encoding_names[6] =
+{
+    "binary", "utf8", "utf16", "utf16be", "ansi", "ascii",
+};
+
+static string_t key_name(size_t i)
+{
+    wchar_t buf[32];
+    swprintf(buf, 32, L"KEY%05u", unsigned(i));
+    return buf;
+}
+
+static string_t key_value(size_t i)
+{
+    return L"value_" + std::to_wstring(i);
+}
+
+// The text of a file: words, with the keys at the given density.
+static string_t make_text(std::mt19937& rng, const BENCH_CONFIG& config, size_t size,
+                          bool crlf, bool non_ascii)
+{
+    static const wchar_t *const words[] =
+    {
+        L"int", L"return", L"static", L"const", L"value", L"template", L"(x)",
+        L"{", L"}", L"=", L"0;", L"name", L"\t", L"//",
+    };
+    static const wchar_t *const non_ascii_words[] =
+    {
+        L"été", L"日本語", L"Δ", L"ü",
+    };
+    std::uniform_real_distribution<double> real(0, 1);
+    double key_chance = config.density / 1024 * 6;  // per word of about 6 bytes
+
+    string_t text;
+    size_t line = 0;
+    while (text.size() < size)
+    {
+        if (config.keys && real(rng) < key_chance)
+            text += key_name(rng() % config.keys);
+        else if (non_ascii && rng() % 16 == 0)
+            text += non_ascii_words[rng() % 4];
+        else
+            text += words[rng() % (sizeof(words) / sizeof(words[0]))];
+
+        if (++line % 10 == 0)
+            text += crlf ? L"\r\n" : L"\n";
+        else
+            text += L' ';
+    }
+    return text;
+}
+
+static binary_t make_contents(std::mt19937& rng, const BENCH_CONFIG& config, size_t size,
+                              TEMPLA_ENCODING encoding)
+{
+    binary_t data;
+    if (encoding == TE_BINARY)
+    {
+        data.resize(size);
+        for (auto& ch : data)
+            ch = char(rng() % 4 ? rng() : 0);
+        return data;
+    }
+
+    std::uniform_real_distribution<double> real(0, 1);
+    bool crlf = real(rng) < config.crlf;
+    size_t units = (encoding == TE_UTF16 || encoding == TE_UTF16BE) ? size / 2 : size;
+    string_t text = make_text(rng, config, units, crlf, encoding != TE_ASCII);
+
+    switch (encoding)
+    {
+    case TE_UTF8:
+        string_to_utf8(text.data(), text.size(), data);
+        if (rng() % 4 == 0)
+            data.insert(0, "\xEF\xBB\xBF");
+        break;
+    case TE_UTF16:
+    case TE_UTF16BE:
+        string_to_utf16(text.data(), text.size(), encoding == TE_UTF16BE, data);
+        data.insert(0, encoding == TE_UTF16BE ? "\xFE\xFF" : "\xFF\xFE");
+        break;
+    default:
+        for (auto ch : text)
+            data += char(ch < 0x80 ? ch : 0xE9);    // Latin-1 for TE_ANSI
+        break;
+    }
+    return data;
+}
+
+static bool make_tree(const string_t& root, const BENCH_CONFIG& config, BENCH_TREE& tree)
+{
+    std::mt19937 rng(config.seed);
+    std::uniform_real_distribution<double> real(0, 1);
+    unsigned total = 0;
+    for (auto weight : config.encodings)
+        total += weight;
+    if (!total)
+        return false;
+
+    std::set<string_t> dirs;
+    make_dir(root);
+    for (size_t i = 0; i < config.files; ++i)
+    {
+        string_t dir;
+        for (unsigned level = rng() % (config.depth + 1); level > 0; --level)
+        {
+            dir += L"d" + std::to_wstring(rng() % config.fanout);
+            if (dirs.insert(dir).second)
+            {
+                make_dir(root + TEMPLA_PATH_SEP + dir);
+                tree.dirs.push_back(dir);
+            }
+            dir += TEMPLA_PATH_SEP;
+        }
+
+        unsigned pick = rng() % total, k = 0;
+        while (pick >= config.encodings[k])
+            pick -= config.encodings[k++];
+        auto encoding = TEMPLA_ENCODING(k);
+
+        double ratio = double(config.max_size) / double(std::max<size_t>(config.min_size, 1));
+        size_t size = size_t(double(config.min_size) * std::pow(ratio, real(rng)));
+
+        // some names have a key in them
+        string_t name = L"f" + std::to_wstring(i);
+        if (config.keys && rng() % 8 == 0)
+            name += L"_" + key_name(rng() % config.keys);
+        name += (encoding == TE_BINARY) ? L".dat" : L".txt";
+
+        binary_t data = make_contents(rng, config, size, encoding);
+        if (!templa_save_file(root + TEMPLA_PATH_SEP + dir + name, data))
+            return false;
+        tree.files.push_back(dir + name);
+        tree.bytes += data.size();
+        tree.by_encoding[k]++;
+    }
+    return true;
+}
+
+static void remove_tree(const string_t& root, const BENCH_TREE& tree, const mapping_t& mapping)
+{
+    for (auto file : tree.files)
+    {
+        for (auto& pair : mapping)
+        {
+            for (size_t ich = 0; (ich = file.find(pair.first, ich)) != file.npos; ich += pair.second.size())
+                file.replace(ich, pair.first.size(), pair.second);
+        }
+        remove_file(root + TEMPLA_PATH_SEP + file);
+    }
+    for (auto it = tree.dirs.rbegin(); it != tree.dirs.rend(); ++it)
+        remove_dir(root + TEMPLA_PATH_SEP + *it);
+    remove_dir(root);
+}
+
+// templa() prints a line for each file; the report is the JSON only.
+static int silence_stdout(void)
+{
+    fflush(stdout);
+#ifdef _WIN32
+    int saved = _dup(1);
+    int null = _open("NUL", _O_WRONLY);
+    _dup2(null, 1);
+    _close(null);
+#else
+    int saved = dup(1);
+    int null = open("/dev/null", O_WRONLY);
+    dup2(null, 1);
+    close(null);
+#endif
+    return saved;
+}
+
+static void restore_stdout(int saved)
+{
+    fflush(stdout);
+#ifdef _WIN32
+    _dup2(saved, 1);
+    _close(saved);
+#else
+    dup2(saved, 1);
+    close(saved);
+#endif
+}
+
+static uint64_t peak_rss_kb(void)
+{
+#ifdef _WIN32
+    PROCESS_MEMORY_COUNTERS counters;
+    if (!GetProcessMemoryInfo(GetCurrentProcess(), &counters, sizeof(counters)))
+        return 0;
+    return counters.PeakWorkingSetSize / 1024;
+#else
+    struct rusage usage;
+    if (getrusage(RUSAGE_SELF, &usage) != 0)
+        return 0;
+#ifdef __APPLE__
+    return uint64_t(usage.ru_maxrss) / 1024;   // bytes
+#else
+    return uint64_t(usage.ru_maxrss);
+#endif
+#endif
+}
+
+static void usage(void)
+{
+    fputs("Usage: templa_bench [OPTIONS]\n"
+          "  --seed N          seed of the tree (default: 1)\n"
+          "  --files N         number of files (default: 10000)\n"
+          "  --depth N         levels of folders (default: 3)\n"
+          "  --fanout N        folders in a folder (default: 4)\n"
+          "  --min-size N      smallest file in bytes (default: 64)\n"
+          "  --max-size N      largest file in bytes (default: 65536)\n"
+          "  --encodings LIST  weights of binary,utf8,utf16,utf16be,ansi,ascii\n"
+          "                    (default: 5,40,5,5,0,45)\n"
+          "  --crlf R          ratio of files with CRLF (default: 0.5)\n"
+          "  --density R       keys per KiB of text (default: 1)\n"
+          "  --keys N          entries in the mapping (default: 16)\n"
+          "  --runs N          runs over the tree (default: 3)\n"
+          "  --work DIR        folder for the tree (default: templa_bench.tmp)\n"
+          "  --keep            do not remove the tree at the end\n"
+          "  --jobs N, --ordered, --pipeline SIZE, --io-uring DEPTH, --force-decode\n"
+          "                    passed to templa()\n", stderr);
+}
+
+static bool parse_args(int argc, char **argv, BENCH_CONFIG& config)
+{
+    for (int i = 1; i < argc; ++i)
+    {
+        std::string arg = argv[i];
+        if (arg == "--keep")
+        {
+            config.keep = true;
+            continue;
+        }
+        if (arg == "--ordered")
+        {
+            config.options.ordered = true;
+            continue;
+        }
+        if (arg == "--force-decode")
+        {
+            config.options.force_decode = true;
+            continue;
+        }
+        if (i + 1 >= argc)
+            return false;
+
+        const char *value = argv[++i];
+        if (arg == "--seed")
+            config.seed = unsigned(strtoul(value, NULL, 10));
+        else if (arg == "--files")
+            config.files = size_t(strtoull(value, NULL, 10));
+        else if (arg == "--depth")
+            config.depth = unsigned(strtoul(value, NULL, 10));
+        else if (arg == "--fanout")
+            config.fanout = std::max(1u, unsigned(strtoul(value, NULL, 10)));
+        else if (arg == "--min-size")
+            config.min_size = size_t(strtoull(value, NULL, 10));
+        else if (arg == "--max-size")
+            config.max_size = size_t(strtoull(value, NULL, 10));
+        else if (arg == "--crlf")
+            config.crlf = atof(value);
+        else if (arg == "--density")
+            config.density = atof(value);
+        else if (arg == "--keys")
+            config.keys = size_t(strtoull(value, NULL, 10));
+        else if (arg == "--runs")
+            config.runs = std::max(1u, unsigned(strtoul(value, NULL, 10)));
+        else if (arg == "--work")
+            config.work = string_t(value, value + strlen(value));
+        else if (arg == "--jobs")
+            config.options.jobs = unsigned(strtoul(value, NULL, 10));
+        else if (arg == "--pipeline")
+            config.options.pipeline_size = strtoull(value, NULL, 10);
+        else if (arg == "--io-uring")
+            config.options.uring_depth = unsigned(strtoul(value, NULL, 10));
+        else if (arg == "--encodings")
+        {
+            char *end = const_cast<char *>(value);
+            for (int k = 0; k < 6; ++k)
+            {
+                config.encodings[k] = unsigned(strtoul(end, &end, 10));
+                if (*end != (k < 5 ? ',' : '\0'))
+                    return false;
+                ++end;
+            }
+        }
+        else
+            return false;
+    }
+    return config.min_size <= config.max_size;
+}
+
+int main(int argc, char **argv)
+{
+    BENCH_CONFIG config;
+    if (!parse_args(argc, argv, config))
+    {
+        usage();
+        return 1;
+    }
+
+    mapping_t mapping;
+    for (size_t i = 0; i < config.keys; ++i)
+        mapping[key_name(i)] = key_value(i);
+    string_list_t ignore;
+
+    string_t source = config.work + TEMPLA_PATH_SEP + L"src";
+    string_t output = config.work + TEMPLA_PATH_SEP + L"out";
+    BENCH_TREE tree;
+    make_dir(config.work);
+    auto start = std::chrono::steady_clock::now();
+    if (!make_tree(source, config, tree))
+    {
+        fprintf(stderr, "ERROR: Cannot make the tree in '%ls'\n", config.work.c_str());
+        return 1;
+    }
+    std::chrono::duration<double> generated = std::chrono::steady_clock::now() - start;
+    make_dir(output);
+
+    std::vector<double> seconds;
+    TEMPLA_RET ret = TEMPLA_RET_OK;
+    for (unsigned run = 0; run < config.runs && ret == TEMPLA_RET_OK; ++run)
+    {
+        int saved = silence_stdout();
+        start = std::chrono::steady_clock::now();
+        ret = templa(source, output, mapping, ignore, config.options);
+        std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+        restore_stdout(saved);
+        seconds.push_back(elapsed.count());
+    }
+    uint64_t rss = peak_rss_kb();
+
+    if (!config.keep)
+    {
+        remove_tree(source, tree, mapping_t());
+        remove_tree(output + TEMPLA_PATH_SEP + L"src", tree, mapping);
+        remove_dir(output);
+        remove_dir(config.work);
+    }
+
+    if (ret != TEMPLA_RET_OK)
+    {
+        fprintf(stderr, "ERROR: templa() failed (%d)\n", int(ret));
+        return 1;
+    }
+
+    double best = *std::min_element(seconds.begin(), seconds.end());
+    printf("{\n");
+    std::string version = templa_get_version();
+    printf("  \"version\": \"%s\",\n", version.substr(0, version.find('\n')).c_str());
+    printf("  \"config\": {\"seed\": %u, \"files\": %u, \"depth\": %u, \"fanout\": %u, "
+           "\"min_size\": %u, \"max_size\": %u, \"crlf\": %g, \"density\": %g, \"keys\": %u, "
+           "\"jobs\": %u, \"ordered\": %s, \"pipeline\": %llu, \"io_uring\": %u, "
+           "\"force_decode\": %s},\n",
+           config.seed, unsigned(config.files), config.depth, config.fanout,
+           unsigned(config.min_size), unsigned(config.max_size), config.crlf, config.density,
+           unsigned(config.keys), config.options.jobs, config.options.ordered ? "true" : "false",
+           (unsigned long long)config.options.pipeline_size, config.options.uring_depth,
+           config.options.force_decode ? "true" : "false");
+    printf("  \"tree\": {\"files\": %u, \"dirs\": %u, \"bytes\": %llu, \"generate_s\": %.3f, "
+           "\"encodings\": {",
+           unsigned(tree.files.size()), unsigned(tree.dirs.size()),
+           (unsigned long long)tree.bytes, generated.count());
+    for (int k = 0; k < 6; ++k)
+        printf("%s\"%s\": %u", k ? ", " : "", encoding_names[k], unsigned(tree.by_encoding[k]));
+    printf("}},\n");
+    printf("  \"runs\": [");
+    for (size_t i = 0; i < seconds.size(); ++i)
+        printf("%s%.4f", i ? ", " : "", seconds[i]);
+    printf("],\n");
+    printf("  \"best_s\": %.4f,\n", best);
+    printf("  \"files_per_s\": %.1f,\n", double(tree.files.size()) / best);
+    printf("  \"mb_per_s\": %.2f,\n", double(tree.bytes) / best / 1e6);
+    printf("  \"peak_rss_kb\": %llu\n", (unsigned long long)rss);
+    printf("}\n");
+    return 0;
+}
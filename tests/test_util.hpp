@@ -0,0 +1,42 @@
+#pragma once
+
+// Folders and files on the disk for the tests, by wide names.
+
+#include <cstdio>
+#include "../templa.hpp"
+#ifdef _WIN32
+    #include <direct.h>
+#else
+    #include <sys/stat.h>
+    #include <unistd.h>
+#endif
+
+inline void make_dir(const string_t& path)
+{
+#ifdef _WIN32
+    _wmkdir(path.c_str());
+#else
+    std::string native(path.begin(), path.end());
+    mkdir(native.c_str(), 0777);
+#endif
+}
+
+inline void remove_dir(const string_t& path)
+{
+#ifdef _WIN32
+    _wrmdir(path.c_str());
+#else
+    std::string native(path.begin(), path.end());
+    rmdir(native.c_str());
+#endif
+}
+
+inline void remove_file(const string_t& path)
+{
+#ifdef _WIN32
+    _wremove(path.c_str());
+#else
+    std::string native(path.begin(), path.end());
+    std::remove(native.c_str());
+#endif
+}
@@ -0,0 +1,176 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include <chrono>
+#include <random>
+#include "../templa.hpp"
+
+static void put_utf8(std::string& bin, uint32_t ch)
+{
+    if (ch < 0x80)
+    {
+        bin += char(ch);
+    }
+    else if (ch < 0x800)
+    {
+        bin += char(0xC0 | (ch >> 6));
+        bin += char(0x80 | (ch & 0x3F));
+    }
+    else if (ch < 0x10000)
+    {
+        bin += char(0xE0 | (ch >> 12));
+        bin += char(0x80 | ((ch >> 6) & 0x3F));
+        bin += char(0x80 | (ch & 0x3F));
+    }
+    else
+    {
+        bin += char(0xF0 | (ch >> 18));
+        bin += char(0x80 | ((ch >> 12) & 0x3F));
+        bin += char(0x80 | ((ch >> 6) & 0x3F));
+        bin += char(0x80 | (ch & 0x3F));
+    }
+}
+
+static void put_utf16(std::string& bin, uint32_t ch, bool big_endian)
+{
+    uint32_t units[2] = { ch, 0 };
+    size_t count = 1;
+    if (ch >= 0x10000)
+    {
+        units[0] = 0xD800 | ((ch - 0x10000) >> 10);
+        units[1] = 0xDC00 | ((ch - 0x10000) & 0x3FF);
+        count = 2;
+    }
+    for (size_t i = 0; i < count; ++i)
+    {
+        bin += char(big_endian ? (units[i] >> 8) : units[i]);
+        bin += char(big_endian ? units[i] : (units[i] >> 8));
+    }
+}
+
+static void put_string(string_t& str, uint32_t ch)
+{
+    if (sizeof(wchar_t) == 2 && ch >= 0x10000)
+    {
+        str += wchar_t(0xD800 | ((ch - 0x10000) >> 10));
+        str += wchar_t(0xDC00 | ((ch - 0x10000) & 0x3FF));
+        return;
+    }
+    str += wchar_t(ch);
+}
+
+// Convert the text both ways and compare with the expected forms.
+static void check(const std::vector<uint32_t>& text)
+{
+    std::string utf8, utf16, utf16be;
+    string_t str;
+    for (auto ch : text)
+    {
+        put_utf8(utf8, ch);
+        put_utf16(utf16, ch, false);
+        put_utf16(utf16be, ch, true);
+        put_string(str, ch);
+    }
+
+    string_t ret;
+    assert(utf8_to_string(utf8.data(), utf8.size(), ret));
+    assert(ret == str);
+    assert(utf8_to_string(utf8.data(), utf8.size(), ret, true));
+    assert(ret == str);
+    utf16_to_string(utf16.data(), utf16.size(), false, ret);
+    assert(ret == str);
+    utf16_to_string(utf16be.data(), utf16be.size(), true, ret);
+    assert(ret == str);
+
+    binary_t bin;
+    string_to_utf8(str.data(), str.size(), bin);
+    assert(bin == utf8);
+    string_to_utf16(str.data(), str.size(), false, bin);
+    assert(bin == utf16);
+    string_to_utf16(str.data(), str.size(), true, bin);
+    assert(bin == utf16be);
+}
+
+static double throughput(const std::string& utf8)
+{
+    const int count = 8;
+    size_t converted = 0;
+    string_t str;
+    binary_t bin;
+    auto start = std::chrono::steady_clock::now();
+    for (int i = 0; i < count; ++i)
+    {
+        utf8_to_string(utf8.data(), utf8.size(), str);
+        string_to_utf8(str.data(), str.size(), bin);
+        converted += bin.size();
+    }
+    std::chrono::duration<double> elapsed = std::chrono::steady_clock::now() - start;
+    assert(converted == utf8.size() * count);
+    return double(utf8.size()) * count / elapsed.count() / 1e9;
+}
+
+int main(void)
+{
+    // every code point, in runs that reach the block sizes, with ASCII
+    // in between so that both the fast and the slow paths are taken
+    std::mt19937 rng(1);
+    std::vector<uint32_t> text;
+    for (uint32_t ch = 0; ch <= 0x10FFFF; ++ch)
+    {
+        if (0xD800 <= ch && ch <= 0xDFFF)
+            continue;
+        text.push_back(ch);
+        if (rng() % 8 == 0)
+        {
+            for (size_t n = rng() % 40; n > 0; --n)
+                text.push_back('a' + n % 26);
+        }
+        if (text.size() >= 200)
+        {
+            check(text);
+            text.clear();
+        }
+    }
+    check(text);
+
+    // malformed UTF-8 is replaced, or escaped and restored
+    static const char *const malformed[] =
+    {
+        "\x80", "\xC0\xAF", "\xE0\x80\xAF", "\xED\xA0\x80", "\xF4\x90\x80\x80",
+        "\xF8\x88\x80\x80\x80", "\xE6\x97", "\xFF" "0123456789abcdef\xFE",
+    };
+    for (auto bytes : malformed)
+    {
+        std::string bin = std::string("0123456789abcdef") + bytes + "xyz";
+        string_t str;
+        assert(!utf8_to_string(bin.data(), bin.size(), str));
+        assert(str.find(wchar_t(0xFFFD)) != str.npos);
+
+        assert(!utf8_to_string(bin.data(), bin.size(), str, true));
+        binary_t ret;
+        string_to_utf8(str.data(), str.size(), ret, true);
+        assert(ret == bin);
+    }
+
+    // unpaired surrogates
+    string_t lone = L"0123456789";
+    lone += wchar_t(0xD800);
+    lone += L"abc";
+    binary_t bin;
+    string_to_utf8(lone.data(), lone.size(), bin);
+    assert(bin == "0123456789\xEF\xBF\xBD" "abc");
+    utf16_to_string("\x00\xD8" "a\0", 4, false, lone);
+    assert(lone.size() == 2 && lone[0] == wchar_t(0xD800) && lone[1] == L'a');
+
+    std::string ascii, utf8;
+    while (ascii.size() < (16 << 20))
+        ascii += "The quick brown fox jumps over the lazy dog.\r\n";
+    while (utf8.size() < (16 << 20))
+        utf8 += "\xE6\x97\xA5\xE6\x9C\xAC\xE8\xAA\x9E text \xC3\xA9\r\n";
+
+    printf("ASCII: %.2f GB/s\n", throughput(ascii));
+    printf("UTF-8: %.2f GB/s\n", throughput(utf8));
+
+    puts("OK");
+    return 0;
+}
@@ -0,0 +1,124 @@
+#include <cstdio>
+#include <cstring>
+#include <cassert>
+#include "test_util.hpp"
+
+// A relative path of the memory into one on the disk.
+static string_t disk_path(const string_t& root, string_t path)
+{
+    for (auto& ch : path)
+    {
+        if (ch == L'/')
+            ch = TEMPLA_PATH_SEP;
+    }
+    return root + TEMPLA_PATH_SEP + path;
+}
+
+int main(void)
+{
+    TEMPLA_MEMORY_FS input;
+    input.files[L"foo.txt"] = std::string("\xFF\xFE" "f\0o\0o\0\r\0\n\0", 12);    // UTF-16
+    input.files[L"readme.txt"] = "no keys\n";
+    input.files[L"bin_foo.dat"] = std::string("foo\0\0foo", 8);
+    input.files[L"sub_foo/a.txt"] = "foo\r\nfoo\xC3\xA9\r\n";
+    input.files[L"sub_foo/data.bin"] = "foo";
+    input.files[L"sub_foo/deep/b_foo.txt"] = "\xEF\xBB\xBF" "foo\n";
+    input.dirs.insert(L"empty_foo/");
+
+    mapping_t mapping;
+    mapping[L"foo"] = L"bar";
+    string_list_t ignore;
+    ignore.push_back(L"*.bin");
+    TEMPLA_STATS stats;
+    TEMPLA_OPTIONS options;
+    options.stats = &stats;
+    TEMPLA_JOB job(mapping, ignore, options);
+    auto reporter = templa_new_reporter(TR_QUIET);
+
+    TEMPLA_MEMORY_FS output;
+    TEMPLA_RET ret = job.run(input, output, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK);
+
+    assert(output.files.size() == 5);
+    assert(output.files[L"bar.txt"] == std::string("\xFF\xFE" "b\0a\0r\0\r\0\n\0", 12));
+    assert(output.files[L"readme.txt"] == "no keys\n");
+    assert(output.files[L"bin_bar.dat"] == std::string("foo\0\0foo", 8));
+    assert(output.files[L"sub_bar/a.txt"] == "bar\r\nbar\xC3\xA9\r\n");
+    assert(output.files[L"sub_bar/deep/b_bar.txt"] == "\xEF\xBB\xBF" "bar\n");
+    assert(output.dirs.size() == 3 && output.dirs.count(L"empty_bar/"));
+    assert(stats.files == 5 && stats.ignored == 1 && stats.replacements[L"foo"] == 4);
+
+    // the same tree on the disk gives the same outputs
+    string_t work = L"vfs.tmp", source = work + TEMPLA_PATH_SEP + L"src";
+    string_t out = work + TEMPLA_PATH_SEP + L"out";
+    make_dir(work);
+    make_dir(source);
+    make_dir(out);
+    for (auto& dir : input.dirs)
+        make_dir(disk_path(source, dir));
+    make_dir(disk_path(source, L"sub_foo"));
+    make_dir(disk_path(source, L"sub_foo/deep"));
+    for (auto& pair : input.files)
+    {
+        bool ok = templa_save_file(disk_path(source, pair.first), pair.second);
+        assert(ok);
+    }
+    ret = job.run(source, out, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK);
+
+    string_t destination = out + TEMPLA_PATH_SEP + L"src";
+    for (auto& pair : output.files)
+    {
+        binary_t data;
+        bool ok = templa_load_file(disk_path(destination, pair.first), data);
+        assert(ok && data == pair.second);
+        remove_file(disk_path(destination, pair.first));
+    }
+    for (auto& pair : input.files)
+        remove_file(disk_path(source, pair.first));
+    remove_dir(disk_path(destination, L"empty_bar"));
+    remove_dir(disk_path(destination, L"sub_bar/deep"));
+    remove_dir(disk_path(destination, L"sub_bar"));
+    remove_dir(destination);
+    remove_dir(out);
+    remove_dir(disk_path(source, L"empty_foo"));
+    remove_dir(disk_path(source, L"sub_foo/deep"));
+    remove_dir(disk_path(source, L"sub_foo"));
+    remove_dir(source);
+    remove_dir(work);
+
+    // names are made valid as on the disk
+    TEMPLA_MEMORY_FS odd;
+    odd.files[L"a:foo?.txt"] = "foo";
+    mapping[L"name"] = L"a*b";
+    odd.files[L"name.txt"] = "name";
+    TEMPLA_MEMORY_FS renamed;
+    ret = TEMPLA_JOB(mapping, ignore).run(odd, renamed, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK);
+    assert(renamed.files.size() == 2);
+    assert(renamed.files[L"a_bar_.txt"] == "bar" && renamed.files[L"a_b.txt"] == "a*b");
+
+    // keys that are one pattern in UTF-8 (lone surrogates) are counted by key
+    mapping_t same;
+    same[L"\xD800x"] = L"A";
+    same[L"\xD801x"] = L"B";
+    same[L"\xFF21"] = L"bar";     // after them, in the mapping
+    TEMPLA_STATS same_stats;
+    TEMPLA_OPTIONS same_options;
+    same_options.stats = &same_stats;
+    TEMPLA_MEMORY_FS text, replaced;
+    text.files[L"a.txt"] = "\xEF\xBB\xBF" "\xEF\xBC\xA1 \xEF\xBC\xA1\n";
+    ret = TEMPLA_JOB(same, ignore, same_options).run(text, replaced, NULL, NULL, reporter.get());
+    assert(ret == TEMPLA_RET_OK && replaced.files[L"a.txt"] == "\xEF\xBB\xBF" "bar bar\n");
+    assert(same_stats.replacements.size() == 1 && same_stats.replacements[L"\xFF21"] == 2);
+
+    // a missing folder
+    TEMPLA_MEMORY_FS missing;
+    missing.files[L"x.txt"] = "x";
+    std::vector<TEMPLA_VFS_ENTRY> entries;
+    assert(!missing.enumerate(L"nothing/", entries));
+    assert(missing.enumerate(L"", entries) && entries.size() == 1 && !entries[0].is_dir);
+
+    puts("OK");
+    return 0;
+}
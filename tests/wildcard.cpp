@@ -1,8 +1,29 @@
-#include <windows.h>
 #include <cstdio>
 #include <cassert>
+#include <cwchar>
+#include <random>
 #include "../templa.hpp"
 
+// Whether any of the patterns matches, one templa_wildcard at a time.
+static bool reference(const string_list_t& patterns, const string_t& str)
+{
+    for (auto& pattern : patterns)
+    {
+        if (templa_wildcard(str, pattern))
+            return true;
+    }
+    return false;
+}
+
+static string_t random_string(std::mt19937& rng, const wchar_t *chars, size_t max_length)
+{
+    string_t ret;
+    size_t num_chars = wcslen(chars);
+    for (size_t length = rng() % (max_length + 1); length > 0; --length)
+        ret += chars[rng() % num_chars];
+    return ret;
+}
+
 int main(void)
 {
     assert(templa_wildcard(L"", L""));
@@ -56,6 +77,38 @@ int main(void)
     assert(templa_wildcard(L"ABC", L"a*c"));
     assert(templa_wildcard(L"ABC", L"A*C"));
 
+    {
+        string_list_t patterns = { L"q", L"*.bin", L".git", L".svn", L".vs" };
+        TEMPLA_GLOBSET globset(patterns);
+        assert(globset.match(L"q") && globset.match(L"Q"));
+        assert(globset.match(L"a.bin") && globset.match(L"A.BIN") && globset.match(L".bin"));
+        assert(globset.match(L".git") && globset.match(L".Svn"));
+        assert(!globset.match(L"qq") && !globset.match(L"a.bin2") && !globset.match(L".gitignore"));
+        assert(!globset.match(L""));
+        assert(!TEMPLA_GLOBSET().match(L""));
+        assert(TEMPLA_GLOBSET(string_list_t{ L"" }).match(L""));
+        assert(TEMPLA_GLOBSET(string_list_t{ L"*" }).match(L"anything"));
+        assert(TEMPLA_GLOBSET(string_list_t{ L"ab*" }).match(L"ABC"));
+        assert(TEMPLA_GLOBSET(string_list_t{ L"a*b?c" }).match(L"a-b-bxc"));
+        assert(!TEMPLA_GLOBSET(string_list_t{ L"a*b?c" }).match(L"a-b-bc"));
+    }
+
+    // random sets against templa_wildcard, with sizes that span words of
+    // the automaton, and non-ASCII characters that differ in case
+    std::mt19937 rng(1);
+    for (int n = 0; n < 20000; ++n)
+    {
+        string_list_t patterns;
+        for (size_t count = 1 + rng() % 12; count > 0; --count)
+            patterns.push_back(random_string(rng, L"ab\u00E9\u00C9**??", 8));
+        TEMPLA_GLOBSET globset(patterns);
+        for (int k = 0; k < 20; ++k)
+        {
+            string_t str = random_string(rng, L"aAbB\u00E9\u00C9", 10);
+            assert(globset.match(str) == reference(patterns, str));
+        }
+    }
+
     puts("OK");
     return 0;
 }